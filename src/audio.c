@@ -0,0 +1,255 @@
+#include <SDL.h>
+
+#include "audio.h"
+#include "instrument.h"
+#include "invaders.h"
+
+#define AUDIO_FREQUENCY 44100
+#define AUDIO_SAMPLES 512
+#define AUDIO_GAIN 128 // out of 256
+
+// how far the audio output is behind the emulation, in cycles: the
+// emulation runs in bursts of one host frame, the sounds of a burst have to
+// be queued before they are mixed
+#define AUDIO_LATENCY (2 * CYCLES_PER_FRAME)
+// the output jumps to the emulation when it drifts further than this (eg.
+// in fast-forward), and the sounds queued too late to be in time are dropped
+#define AUDIO_MAX_DRIFT (6 * CYCLES_PER_FRAME)
+#define AUDIO_MAX_DELAY CYCLES_PER_FRAME
+
+#define QUEUE_SIZE 256 // power of two
+// positions in the queue wrap at twice its size, to tell full from empty
+#define QUEUE_WRAP(i) ((i) & (2 * QUEUE_SIZE - 1))
+
+typedef struct audio_event audio_event;
+struct audio_event {
+  uint64_t cycle;
+  int sound;
+};
+
+typedef struct audio_voice audio_voice;
+struct audio_voice {
+  const int16_t* samples;
+  uint32_t length;
+  uint32_t position; // == length when the voice is not playing
+};
+
+static SDL_AudioDeviceID device = 0;
+
+// pcm samples of every sound, in the format of the device (signed 16 bits,
+// mono), decoded once when loaded: allocated here, or used in place from
+// the memory given to invaders_audio_load_pcm (then `bank` is NULL)
+static int16_t* bank[INVADERS_SOUND_COUNT];
+
+// single producer (emulation), single consumer (audio callback) queue: the
+// producer only writes `queue_head`, the consumer only `queue_tail`
+static audio_event queue[QUEUE_SIZE];
+static SDL_atomic_t queue_head;
+static SDL_atomic_t queue_tail;
+// low 32 bits of the last cycle reached by the emulation, enough as long
+// as the emulation does not jump by more than 2^31 cycles at once
+static SDL_atomic_t emulated_cycle;
+
+// state of the audio callback
+static audio_voice voices[INVADERS_SOUND_COUNT]; // one voice per sound
+static int64_t output_cycle; // emulated cycle of the next output sample
+static bool output_started = false;
+static int32_t mix_buffer[AUDIO_SAMPLES * 4];
+
+static void mix_voices(int from, int to) {
+  for (int v = 0; v < INVADERS_SOUND_COUNT; v++) {
+    audio_voice* const voice = &voices[v];
+    for (int i = from; i < to && voice->position < voice->length; i++) {
+      mix_buffer[i] += voice->samples[voice->position++];
+    }
+  }
+}
+
+static void audio_callback(void* userdata, Uint8* stream, int len) {
+  (void) userdata;
+  INSTRUMENT_BEGIN(start);
+  int16_t* const out = (int16_t*) stream;
+  int count = len / sizeof *out;
+  if (count > (int) SDL_arraysize(mix_buffer)) {
+    count = SDL_arraysize(mix_buffer);
+  }
+  SDL_memset(mix_buffer, 0, count * sizeof *mix_buffer);
+
+  // keeps the output at a fixed latency behind the emulation
+  const uint32_t emulated = SDL_AtomicGet(&emulated_cycle);
+  const int32_t drift =
+      (int32_t) (emulated - (uint32_t) (output_cycle + AUDIO_LATENCY));
+  if (!output_started || drift > AUDIO_MAX_DRIFT || drift < -AUDIO_MAX_DRIFT) {
+    output_cycle += drift;
+    output_started = true;
+  }
+
+  const double cycles_per_sample = (double) CLOCK_SPEED / AUDIO_FREQUENCY;
+  const int64_t end_cycle = output_cycle + count * cycles_per_sample;
+
+  // starts the queued sounds at their sample in this buffer
+  int position = 0;
+  int tail = SDL_AtomicGet(&queue_tail);
+  while (tail != SDL_AtomicGet(&queue_head)) {
+    const audio_event* const e = &queue[tail & (QUEUE_SIZE - 1)];
+    const int64_t cycle = e->cycle;
+    if (cycle >= end_cycle) {
+      break; // for a next buffer
+    }
+
+    if (cycle + AUDIO_MAX_DELAY >= output_cycle) {
+      int offset = 0;
+      if (cycle > output_cycle) {
+        offset = (cycle - output_cycle) / cycles_per_sample;
+      }
+      if (offset > position) {
+        mix_voices(position, offset);
+        position = offset;
+      }
+      voices[e->sound].position = 0;
+    } // else too late: dropped
+
+    tail = QUEUE_WRAP(tail + 1);
+  }
+  SDL_AtomicSet(&queue_tail, tail);
+
+  mix_voices(position, count);
+  output_cycle = end_cycle;
+
+  for (int i = 0; i < count; i++) {
+    const int32_t sample = mix_buffer[i] * AUDIO_GAIN / 256;
+    out[i] = sample > INT16_MAX ? INT16_MAX
+             : sample < INT16_MIN ? INT16_MIN
+                                  : sample;
+  }
+  INSTRUMENT_END(INVADERS_STAGE_AUDIO, start);
+}
+
+int invaders_audio_open(void) {
+  SDL_AudioSpec want;
+  SDL_zero(want);
+  want.freq = AUDIO_FREQUENCY;
+  want.format = AUDIO_S16SYS;
+  want.channels = 1;
+  want.samples = AUDIO_SAMPLES;
+  want.callback = audio_callback;
+
+  // the sdl converts the output if the device uses another format
+  device = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+  if (device == 0) {
+    SDL_Log("unable to open audio device: %s", SDL_GetError());
+    return 1;
+  }
+
+  SDL_AtomicSet(&queue_head, 0);
+  SDL_AtomicSet(&queue_tail, 0);
+  SDL_PauseAudioDevice(device, 0);
+  return 0;
+}
+
+void invaders_audio_close(void) {
+  if (device != 0) {
+    SDL_CloseAudioDevice(device);
+    device = 0;
+  }
+  for (int v = 0; v < INVADERS_SOUND_COUNT; v++) {
+    SDL_free(bank[v]);
+    bank[v] = NULL;
+    voices[v].samples = NULL;
+    voices[v].length = voices[v].position = 0;
+  }
+}
+
+static void set_sound(
+    int sound, const int16_t* samples, uint32_t length, bool owned) {
+  SDL_LockAudioDevice(device);
+  SDL_free(bank[sound]);
+  bank[sound] = owned ? (int16_t*) samples : NULL;
+  voices[sound].samples = samples;
+  voices[sound].length = length;
+  voices[sound].position = length;
+  SDL_UnlockAudioDevice(device);
+}
+
+// decodes a wav file into the bank
+void invaders_audio_load(int sound, const char* filename) {
+  SDL_AudioSpec spec;
+  Uint8* data;
+  Uint32 size;
+  if (SDL_LoadWAV(filename, &spec, &data, &size) == NULL) {
+    fprintf(stderr, "Error: cannot open sound file %s\n", filename);
+    return;
+  }
+
+  SDL_AudioCVT cvt;
+  if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq,
+          AUDIO_S16SYS, 1, AUDIO_FREQUENCY) < 0) {
+    fprintf(stderr, "Error: cannot convert sound file %s: %s\n", filename,
+        SDL_GetError());
+    SDL_FreeWAV(data);
+    return;
+  }
+
+  cvt.len = size;
+  cvt.buf = SDL_malloc(size * cvt.len_mult);
+  if (cvt.buf == NULL) {
+    SDL_FreeWAV(data);
+    return;
+  }
+  SDL_memcpy(cvt.buf, data, size);
+  SDL_FreeWAV(data);
+  SDL_ConvertAudio(&cvt);
+
+  set_sound(sound, (int16_t*) cvt.buf, cvt.len_cvt / sizeof(int16_t), true);
+}
+
+// uses sounds already decoded (eg. from an asset archive): signed 16 bits
+// little endian mono samples, played in place when they are in the format
+// of the device. `data` must stay valid until invaders_audio_close.
+void invaders_audio_load_pcm(
+    int sound, const uint8_t* data, uint32_t size, int frequency) {
+  SDL_AudioCVT cvt;
+  const int needed = SDL_BuildAudioCVT(&cvt, AUDIO_S16LSB, 1, frequency,
+      AUDIO_S16SYS, 1, AUDIO_FREQUENCY);
+  if (needed == 0 && (uintptr_t) data % sizeof(int16_t) == 0) {
+    set_sound(sound, (const int16_t*) data, size / sizeof(int16_t), false);
+    return;
+  }
+  if (needed < 0) {
+    fprintf(stderr, "Error: cannot convert sound %d: %s\n", sound,
+        SDL_GetError());
+    return;
+  }
+
+  cvt.len = size;
+  cvt.buf = SDL_malloc(size * cvt.len_mult);
+  if (cvt.buf == NULL) {
+    return;
+  }
+  SDL_memcpy(cvt.buf, data, size);
+  SDL_ConvertAudio(&cvt);
+  set_sound(sound, (int16_t*) cvt.buf, cvt.len_cvt / sizeof(int16_t), true);
+}
+
+// queues a sound triggered by the game at emulated cycle `cycle`: if the
+// queue is full, the sound is dropped
+void invaders_audio_play(int sound, uint64_t cycle) {
+  if (device == 0 || voices[sound].samples == NULL) {
+    return;
+  }
+
+  const int head = SDL_AtomicGet(&queue_head);
+  if (QUEUE_WRAP(head - SDL_AtomicGet(&queue_tail)) == QUEUE_SIZE) {
+    return;
+  }
+  queue[head & (QUEUE_SIZE - 1)].cycle = cycle;
+  queue[head & (QUEUE_SIZE - 1)].sound = sound;
+  // publishes the event (SDL_AtomicSet is a full memory barrier)
+  SDL_AtomicSet(&queue_head, QUEUE_WRAP(head + 1));
+}
+
+// tells the audio callback how far the emulation has run, to be called
+// after every update of the machine
+void invaders_audio_sync(uint64_t cycle) {
+  SDL_AtomicSet(&emulated_cycle, (int) (uint32_t) cycle);
+}
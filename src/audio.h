@@ -0,0 +1,20 @@
+#ifndef INVADERS_AUDIO_H
+#define INVADERS_AUDIO_H
+
+#include <stdint.h>
+
+// Sound output of the frontend: the samples are decoded once into a bank in
+// memory, and the sounds triggered by the game are queued with the emulated
+// cycle at which they happened. The audio callback mixes them at the sample
+// matching that cycle, a fixed latency behind the emulation.
+int invaders_audio_open(void);
+void invaders_audio_close(void);
+void invaders_audio_load(int sound, const char* filename);
+void invaders_audio_load_pcm(
+    int sound, const uint8_t* data, uint32_t size, int frequency);
+
+// called from the emulation thread, never block
+void invaders_audio_play(int sound, uint64_t cycle);
+void invaders_audio_sync(uint64_t cycle);
+
+#endif // INVADERS_AUDIO_H
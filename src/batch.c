@@ -0,0 +1,288 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+// Each thread owns a range of machines [lo, hi[ packed in a single atomic
+// word. The owner takes machines from the bottom of its range; once it is
+// empty, it steals from the top of the other ranges, so that threads that
+// end early (eg. machines in attract mode) help the slower ones.
+typedef struct work_queue work_queue;
+struct work_queue {
+  _Alignas(64) _Atomic uint64_t range;
+};
+
+struct invaders_batch_pool {
+  int thread_count;
+  pthread_t* threads;
+  work_queue* queues;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  unsigned long generation; // incremented for every step
+  int busy_workers;
+  bool quit;
+
+  invaders_batch* batch;
+};
+
+static inline uint64_t pack_range(uint32_t lo, uint32_t hi) {
+  return (uint64_t) hi << 32 | lo;
+}
+
+// takes a machine from the bottom of queue `q`, returns -1 if it is empty
+static int queue_pop(work_queue* const q) {
+  uint64_t range = atomic_load(&q->range);
+  for (;;) {
+    const uint32_t lo = range & 0xFFFFFFFF;
+    const uint32_t hi = range >> 32;
+    if (lo >= hi) {
+      return -1;
+    }
+    if (atomic_compare_exchange_weak(&q->range, &range, pack_range(lo + 1, hi))) {
+      return lo;
+    }
+  }
+}
+
+// takes a machine from the top of queue `q`, returns -1 if it is empty
+static int queue_steal(work_queue* const q) {
+  uint64_t range = atomic_load(&q->range);
+  for (;;) {
+    const uint32_t lo = range & 0xFFFFFFFF;
+    const uint32_t hi = range >> 32;
+    if (lo >= hi) {
+      return -1;
+    }
+    if (atomic_compare_exchange_weak(&q->range, &range, pack_range(lo, hi - 1))) {
+      return hi - 1;
+    }
+  }
+}
+
+static void run_machine(invaders_batch* const b, int i) {
+  invaders* const si = &b->machines[i];
+  si->port1 = b->port1[i];
+  si->port2 = b->port2[i];
+
+  invaders_run_frames(si, 1);
+
+  b->port3[i] = si->last_out_port3;
+  b->port5[i] = si->last_out_port5;
+
+  if (b->observations != NULL) {
+    invaders_observe(b->observer, si, b->observations + i * b->observer->size);
+  }
+  if (b->features != NULL) {
+    invaders_get_features(si, b->features + i * INVADERS_FEATURE_COUNT);
+  }
+}
+
+// runs every machine of the current step, starting with the ones of the
+// queue owned by thread `id`
+static void run_queues(invaders_batch_pool* const pool, int id) {
+  int i;
+  while ((i = queue_pop(&pool->queues[id])) >= 0) {
+    run_machine(pool->batch, i);
+  }
+
+  for (int n = 1; n < pool->thread_count; n++) {
+    work_queue* const victim = &pool->queues[(id + n) % pool->thread_count];
+    while ((i = queue_steal(victim)) >= 0) {
+      run_machine(pool->batch, i);
+    }
+  }
+}
+
+static void* worker_main(void* userdata) {
+  invaders_batch_pool* const pool = (invaders_batch_pool*) userdata;
+  unsigned long generation = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  const int id = ++pool->busy_workers;
+  pthread_cond_signal(&pool->done_cond);
+
+  for (;;) {
+    while (!pool->quit && pool->generation == generation) {
+      pthread_cond_wait(&pool->start_cond, &pool->lock);
+    }
+    if (pool->quit) {
+      break;
+    }
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_queues(pool, id);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy_workers -= 1;
+    if (pool->busy_workers == 0) {
+      pthread_cond_signal(&pool->done_cond);
+    }
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static invaders_batch_pool* pool_create(invaders_batch* const b, int threads) {
+  invaders_batch_pool* const pool = calloc(1, sizeof *pool);
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pool->batch = b;
+  pool->thread_count = threads;
+  pool->threads = calloc(threads, sizeof *pool->threads);
+  pool->queues = aligned_alloc(
+      _Alignof(work_queue), threads * sizeof *pool->queues);
+  if (pool->threads == NULL || pool->queues == NULL) {
+    free(pool->threads);
+    free(pool->queues);
+    free(pool);
+    return NULL;
+  }
+  for (int i = 0; i < threads; i++) {
+    atomic_init(&pool->queues[i].range, 0);
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  // thread 0 is the thread calling invaders_batch_step
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+      fprintf(stderr, "error: cannot create batch thread %d\n", i);
+      pool->thread_count = i;
+      break;
+    }
+  }
+
+  // wait for the workers to pick their ids
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy_workers != pool->thread_count - 1) {
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  }
+  pool->busy_workers = 0;
+  pthread_mutex_unlock(&pool->lock);
+
+  return pool;
+}
+
+static void pool_destroy(invaders_batch_pool* const pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->start_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 1; i < pool->thread_count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->start_cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->queues);
+  free(pool->threads);
+  free(pool);
+}
+
+invaders_batch* invaders_batch_create(int count, int threads) {
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads > count) {
+    threads = count;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  invaders_batch* const b = calloc(1, sizeof *b);
+  if (b == NULL) {
+    return NULL;
+  }
+
+  // an empty batch still gets its arrays (calloc(0) may return NULL)
+  const int size = count > 0 ? count : 1;
+  b->count = count;
+  b->machines = calloc(size, sizeof *b->machines);
+  b->rom = malloc(sizeof *b->rom);
+  b->port1 = calloc(size, 4);
+  if (b->machines == NULL || b->rom == NULL || b->port1 == NULL) {
+    free(b->machines);
+    free(b->rom);
+    free(b->port1);
+    free(b);
+    return NULL;
+  }
+  b->port2 = b->port1 + count;
+  b->port3 = b->port2 + count;
+  b->port5 = b->port3 + count;
+
+  invaders_rom_init(b->rom);
+  // the observations and features are read from the video ram: the screen
+  // of the machines is never rendered
+  for (int i = 0; i < count; i++) {
+    invaders_init(&b->machines[i], b->rom);
+    b->machines[i].skip_render = true;
+  }
+
+  b->pool = pool_create(b, threads);
+  if (b->pool == NULL) {
+    invaders_batch_destroy(b);
+    return NULL;
+  }
+
+  return b;
+}
+
+void invaders_batch_destroy(invaders_batch* const b) {
+  if (b->pool != NULL) {
+    pool_destroy(b->pool);
+  }
+  free(b->machines);
+  free(b->rom);
+  free(b->port1);
+  free(b);
+}
+
+// loads a rom chunk in the rom shared by every machine of the batch
+int invaders_batch_load_rom(invaders_batch* const b, const uint8_t* data,
+    size_t size, uint16_t start_addr) {
+  return invaders_rom_load_mem(b->rom, data, size, start_addr);
+}
+
+// advances every machine by one frame
+void invaders_batch_step(invaders_batch* const b) {
+  invaders_batch_pool* const pool = b->pool;
+
+  // machines are split in contiguous chunks, one per thread
+  const int threads = pool->thread_count;
+  for (int i = 0; i < threads; i++) {
+    const uint32_t lo = (uint64_t) b->count * i / threads;
+    const uint32_t hi = (uint64_t) b->count * (i + 1) / threads;
+    atomic_store(&pool->queues[i].range, pack_range(lo, hi));
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->generation += 1;
+  pool->busy_workers = threads - 1;
+  pthread_cond_broadcast(&pool->start_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  run_queues(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy_workers != 0) {
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
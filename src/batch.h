@@ -0,0 +1,47 @@
+#ifndef INVADERS_BATCH_H
+#define INVADERS_BATCH_H
+
+#include "invaders.h"
+#include "observe.h"
+
+typedef struct invaders_batch_pool invaders_batch_pool;
+
+// N independent machines stepped in lockstep, one frame per call to
+// `invaders_batch_step`, across a pool of threads. Inputs and outputs of
+// every machine are stored in contiguous arrays of `count` elements.
+typedef struct invaders_batch invaders_batch;
+struct invaders_batch {
+  int count;
+  invaders* machines;
+  invaders_rom* rom; // shared by every machine
+
+  // inputs, copied to each machine before the frame is run
+  uint8_t* port1;
+  uint8_t* port2;
+
+  // outputs, updated after the frame has been run: sound ports 3 and 5
+  // (last values written by the game)
+  uint8_t* port3;
+  uint8_t* port5;
+
+  // optional outputs, in buffers given by the caller (NULL if unused):
+  // the observations of every machine (count * observer->size bytes, see
+  // observe.h), written straight from the video ram of the machines, and
+  // INVADERS_FEATURE_COUNT features of every machine
+  const invaders_observer* observer;
+  uint8_t* observations;
+  int32_t* features;
+
+  invaders_batch_pool* pool;
+};
+
+// creates `count` machines stepped by `threads` threads (the calling thread
+// included, at most one per machine). 0 (or less) threads means one thread
+// per online cpu. Returns NULL if out of memory.
+invaders_batch* invaders_batch_create(int count, int threads);
+void invaders_batch_destroy(invaders_batch* const b);
+int invaders_batch_load_rom(invaders_batch* const b, const uint8_t* data,
+    size_t size, uint16_t start_addr);
+void invaders_batch_step(invaders_batch* const b);
+
+#endif // INVADERS_BATCH_H
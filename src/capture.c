@@ -0,0 +1,384 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "capture.h"
+#include "crc32.h"
+
+#define SOUND_QUEUE_SIZE 1024 // power of two
+#define BITMAP_SIZE (SCREEN_HEIGHT * SCREEN_WIDTH / 8)
+#define FILE_BUFFER_SIZE (1 << 20)
+
+typedef struct capture_slot capture_slot;
+struct capture_slot {
+  unsigned long frame;
+  uint8_t bitmap[SCREEN_HEIGHT][SCREEN_WIDTH / 8];
+};
+
+typedef struct capture_sound capture_sound;
+struct capture_sound {
+  uint64_t cycle;
+  unsigned long frame;
+  int sound;
+};
+
+struct invaders_capture {
+  int format;
+  char* path;
+  FILE* file; // NULL for png
+  FILE* sounds;
+
+  // single producer (emulation), single consumer (writer) queues of
+  // captured frames and sounds: the counters only increase, the producer
+  // only writes the heads, the writer only the tails
+  capture_slot* slots;
+  unsigned slot_count; // power of two
+  _Atomic unsigned frame_head, frame_tail;
+  capture_sound sound_queue[SOUND_QUEUE_SIZE];
+  _Atomic unsigned sound_head, sound_tail;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  atomic_bool quit;
+
+  // state of the writer
+  uint8_t last[SCREEN_HEIGHT][SCREEN_WIDTH / 8]; // last frame written
+  unsigned long last_frame;
+  bool started; // a frame has been written
+  unsigned long written; // frames written, repeated ones included
+  bool error;
+
+  // state of the emulation thread
+  unsigned long captured, dropped, dropped_sounds;
+};
+
+// REVERSE[b] is b with its bits in the reverse order
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+
+static const uint8_t REVERSE[256] = {R6(0), R6(2), R6(1), R6(3)};
+
+#undef R6
+#undef R4
+#undef R2
+
+static inline void put32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+static void write_bytes(invaders_capture* const c, FILE* f,
+    const void* data, size_t size) {
+  if (fwrite(data, 1, size, f) != size) {
+    c->error = true;
+  }
+}
+
+static void write_png_chunk(invaders_capture* const c, FILE* f,
+    const char* type, const uint8_t* data, uint32_t size) {
+  uint8_t header[8], crc[4];
+  put32(header, size);
+  memcpy(header + 4, type, 4);
+  put32(crc, invaders_crc32(invaders_crc32(0, type, 4), data, size));
+  write_bytes(c, f, header, sizeof header);
+  write_bytes(c, f, data, size);
+  write_bytes(c, f, crc, sizeof crc);
+}
+
+// writes a 1 bit grayscale png, its image data in a single stored (not
+// compressed) deflate block: at most a few KB per frame
+static void write_png(invaders_capture* const c, const capture_slot* slot) {
+  enum { ROW_SIZE = 1 + SCREEN_WIDTH / 8 }; // filter type, then the pixels
+  enum { RAW_SIZE = ROW_SIZE * SCREEN_HEIGHT };
+
+  char path[1024];
+  snprintf(path, sizeof path, "%s-%06lu.png", c->path, slot->frame);
+  FILE* f = fopen(path, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "error: can't open '%s'.\n", path);
+    c->error = true;
+    return;
+  }
+
+  static const uint8_t SIGNATURE[8] = {
+      0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  write_bytes(c, f, SIGNATURE, sizeof SIGNATURE);
+
+  uint8_t header[13] = {0};
+  put32(header, SCREEN_WIDTH);
+  put32(header + 4, SCREEN_HEIGHT);
+  header[8] = 1; // bit depth, then colour type 0 (grayscale)
+  write_png_chunk(c, f, "IHDR", header, sizeof header);
+
+  // zlib header, stored block header, pixels (leftmost in the high bit in
+  // png), adler-32 of the pixels
+  uint8_t data[2 + 5 + RAW_SIZE + 4];
+  data[0] = 0x78;
+  data[1] = 0x01;
+  data[2] = 0x01; // last block, stored
+  data[3] = RAW_SIZE & 0xFF;
+  data[4] = RAW_SIZE >> 8;
+  data[5] = ~RAW_SIZE & 0xFF;
+  data[6] = (~RAW_SIZE >> 8) & 0xFF;
+  uint8_t* raw = &data[7];
+  uint32_t a = 1, b = 0;
+  for (int row = 0; row < SCREEN_HEIGHT; row++) {
+    raw[row * ROW_SIZE] = 0;
+    for (int i = 0; i < SCREEN_WIDTH / 8; i++) {
+      raw[row * ROW_SIZE + 1 + i] = REVERSE[slot->bitmap[row][i]];
+    }
+    for (int i = 0; i < ROW_SIZE; i++) {
+      a = (a + raw[row * ROW_SIZE + i]) % 65521;
+      b = (b + a) % 65521;
+    }
+  }
+  put32(&raw[RAW_SIZE], b << 16 | a);
+  write_png_chunk(c, f, "IDAT", data, sizeof data);
+  write_png_chunk(c, f, "IEND", NULL, 0);
+
+  if (fclose(f) != 0) {
+    c->error = true;
+  }
+}
+
+// writes a frame of the y4m or raw stream
+static void write_frame(invaders_capture* const c,
+    const uint8_t (*bitmap)[SCREEN_WIDTH / 8]) {
+  c->written += 1;
+  if (c->format == INVADERS_CAPTURE_RAW) {
+    write_bytes(c, c->file, bitmap, BITMAP_SIZE);
+    return;
+  }
+
+  uint8_t luma[SCREEN_HEIGHT][SCREEN_WIDTH];
+  for (int row = 0; row < SCREEN_HEIGHT; row++) {
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+      luma[row][x] = (bitmap[row][x / 8] >> (x % 8)) & 1 ? 0xFF : 0;
+    }
+  }
+  write_bytes(c, c->file, "FRAME\n", 6);
+  write_bytes(c, c->file, luma, sizeof luma);
+}
+
+// writes the last frame again up to frame `frame` (excluded), when the
+// frames in between have not been captured
+static void repeat_last(invaders_capture* const c, unsigned long frame) {
+  for (; c->started && c->last_frame + 1 < frame; c->last_frame++) {
+    write_frame(c, (const uint8_t (*)[SCREEN_WIDTH / 8]) c->last);
+  }
+}
+
+static void write_slot(invaders_capture* const c, const capture_slot* slot) {
+  if (c->format == INVADERS_CAPTURE_PNG) {
+    c->written += 1;
+    write_png(c, slot);
+    return;
+  }
+
+  repeat_last(c, slot->frame);
+  write_frame(c, (const uint8_t (*)[SCREEN_WIDTH / 8]) slot->bitmap);
+  memcpy(c->last, slot->bitmap, BITMAP_SIZE);
+  c->last_frame = slot->frame;
+  c->started = true;
+}
+
+static void* writer_main(void* userdata) {
+  invaders_capture* const c = (invaders_capture*) userdata;
+  for (;;) {
+    // the producer signals without the lock, a wakeup may be missed: the
+    // queues are checked again after a short timeout
+    pthread_mutex_lock(&c->lock);
+    while (!atomic_load(&c->quit) &&
+           atomic_load(&c->frame_tail) == atomic_load(&c->frame_head) &&
+           atomic_load(&c->sound_tail) == atomic_load(&c->sound_head)) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += 10 * 1000 * 1000;
+      if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+      }
+      pthread_cond_timedwait(&c->cond, &c->lock, &deadline);
+    }
+    pthread_mutex_unlock(&c->lock);
+    const bool quit = atomic_load(&c->quit);
+
+    unsigned tail = atomic_load(&c->sound_tail);
+    for (; tail != atomic_load(&c->sound_head); tail++) {
+      const capture_sound* const s =
+          &c->sound_queue[tail & (SOUND_QUEUE_SIZE - 1)];
+      if (fprintf(c->sounds, "%llu %lu %d\n", (unsigned long long) s->cycle,
+              s->frame, s->sound) < 0) {
+        c->error = true;
+      }
+    }
+    atomic_store(&c->sound_tail, tail);
+
+    tail = atomic_load(&c->frame_tail);
+    for (; tail != atomic_load(&c->frame_head); tail++) {
+      write_slot(c, &c->slots[tail & (c->slot_count - 1)]);
+      // frees the slot
+      atomic_store(&c->frame_tail, tail + 1);
+    }
+
+    if (quit) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void capture_free(invaders_capture* const c) {
+  if (c->file != NULL) {
+    fclose(c->file);
+  }
+  if (c->sounds != NULL) {
+    fclose(c->sounds);
+  }
+  free(c->slots);
+  free(c->path);
+  free(c);
+}
+
+// starts a capture in file `path` (or files `path-FRAME.png`), with a ring
+// of `slots` frames (rounded up to a power of two). Returns NULL on error.
+invaders_capture* invaders_capture_open(
+    const char* path, int format, int slots) {
+  invaders_capture* const c = calloc(1, sizeof *c);
+  if (c == NULL) {
+    return NULL;
+  }
+
+  c->format = format;
+  c->slot_count = 1;
+  while (c->slot_count < (unsigned) slots) {
+    c->slot_count *= 2;
+  }
+  c->slots = malloc(c->slot_count * sizeof *c->slots);
+  c->path = malloc(strlen(path) + 1);
+  if (c->slots == NULL || c->path == NULL) {
+    capture_free(c);
+    return NULL;
+  }
+  strcpy(c->path, path);
+
+  if (format != INVADERS_CAPTURE_PNG) {
+    c->file = fopen(path, "wb");
+    if (c->file == NULL) {
+      fprintf(stderr, "error: can't open '%s'.\n", path);
+      capture_free(c);
+      return NULL;
+    }
+    setvbuf(c->file, NULL, _IOFBF, FILE_BUFFER_SIZE);
+  }
+  if (format == INVADERS_CAPTURE_Y4M) {
+    // grayscale in full range, at the exact rate of the game
+    fprintf(c->file,
+        "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 Cmono XCOLORRANGE=FULL\n",
+        SCREEN_WIDTH, SCREEN_HEIGHT, CLOCK_SPEED, CYCLES_PER_FRAME);
+  }
+
+  char sounds_path[1024];
+  snprintf(sounds_path, sizeof sounds_path, "%s.sounds", path);
+  c->sounds = fopen(sounds_path, "w");
+  if (c->sounds == NULL) {
+    fprintf(stderr, "error: can't open '%s'.\n", sounds_path);
+    capture_free(c);
+    return NULL;
+  }
+  fprintf(c->sounds, "# cycle frame sound\n");
+
+  atomic_init(&c->frame_head, 0);
+  atomic_init(&c->frame_tail, 0);
+  atomic_init(&c->sound_head, 0);
+  atomic_init(&c->sound_tail, 0);
+  atomic_init(&c->quit, false);
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  if (pthread_create(&c->thread, NULL, writer_main, c) != 0) {
+    fprintf(stderr, "error: cannot create capture thread\n");
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    capture_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+// captures the screen of the machine as frame number `si->frame_count`,
+// dropped if the writer is too far behind
+void invaders_capture_frame(invaders_capture* const c, invaders* const si) {
+  const unsigned head = atomic_load_explicit(&c->frame_head,
+      memory_order_relaxed);
+  if (head - atomic_load(&c->frame_tail) == c->slot_count) {
+    c->dropped += 1;
+    return;
+  }
+
+  capture_slot* const slot = &c->slots[head & (c->slot_count - 1)];
+  slot->frame = si->frame_count;
+  invaders_render_bitmap(si, slot->bitmap);
+  atomic_store(&c->frame_head, head + 1);
+  pthread_cond_signal(&c->cond);
+  c->captured += 1;
+}
+
+// captures a sound triggered by the game (eg. from the `play_sound`
+// callback), dropped if the queue is full
+void invaders_capture_sound(
+    invaders_capture* const c, invaders* const si, int sound) {
+  const unsigned head = atomic_load_explicit(&c->sound_head,
+      memory_order_relaxed);
+  if (head - atomic_load(&c->sound_tail) == SOUND_QUEUE_SIZE) {
+    c->dropped_sounds += 1;
+    return;
+  }
+
+  capture_sound* const s = &c->sound_queue[head & (SOUND_QUEUE_SIZE - 1)];
+  s->cycle = invaders_get_cycles(si);
+  s->frame = si->frame_count;
+  s->sound = sound;
+  atomic_store(&c->sound_head, head + 1);
+}
+
+// waits for the writer to write every captured frame, and ends the stream
+// after frame `frame`: the last frame captured lasts until then.
+// Returns 0 if everything has been written.
+int invaders_capture_close(invaders_capture* const c, unsigned long frame) {
+  atomic_store(&c->quit, true);
+  pthread_cond_signal(&c->cond);
+  pthread_join(c->thread, NULL);
+  pthread_cond_destroy(&c->cond);
+  pthread_mutex_destroy(&c->lock);
+
+  if (c->format != INVADERS_CAPTURE_PNG) {
+    repeat_last(c, frame + 1);
+  }
+  if ((c->file != NULL && fclose(c->file) != 0) || fclose(c->sounds) != 0) {
+    c->error = true;
+  }
+  c->file = NULL;
+  c->sounds = NULL;
+
+  fprintf(stderr, "capture: %lu frames captured, %lu written, %lu dropped",
+      c->captured, c->written, c->dropped);
+  if (c->dropped_sounds > 0) {
+    fprintf(stderr, ", %lu sounds dropped", c->dropped_sounds);
+  }
+  fprintf(stderr, "\n");
+
+  const bool error = c->error;
+  if (error) {
+    fprintf(stderr, "error: can't write capture '%s'.\n", c->path);
+  }
+  capture_free(c);
+  return error ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+#ifndef INVADERS_CAPTURE_H
+#define INVADERS_CAPTURE_H
+
+#include "invaders.h"
+
+// formats of the captured video
+enum {
+  INVADERS_CAPTURE_Y4M, // grayscale yuv4mpeg stream, at the rate of the game
+  INVADERS_CAPTURE_RAW, // 1 bit per pixel frames (see invaders_render_bitmap)
+                        // at the rate of the game
+  INVADERS_CAPTURE_PNG, // one 1 bit per pixel png per captured frame, named
+                        // after the number of the frame
+};
+
+typedef struct invaders_capture invaders_capture;
+
+// Video capture of a machine, for headless recordings: the frames are
+// drawn (1 bit per pixel) in a bounded ring buffer, written by a background
+// thread. The emulation never waits for the writer: when the ring is full,
+// the frame is dropped (and counted). In the y4m and raw streams, a frame
+// lasts until the frame captured after it, so capturing only the frames
+// where the screen changed keeps the timing of the game. The sounds are
+// written to a text side track, `PATH.sounds`: one `CYCLE FRAME SOUND`
+// line per sound.
+invaders_capture* invaders_capture_open(
+    const char* path, int format, int slots);
+void invaders_capture_frame(invaders_capture* const c, invaders* const si);
+void invaders_capture_sound(
+    invaders_capture* const c, invaders* const si, int sound);
+int invaders_capture_close(invaders_capture* const c, unsigned long frame);
+
+#endif // INVADERS_CAPTURE_H
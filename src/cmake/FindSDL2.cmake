@@ -1,2 +0,0 @@
-# stub file to avoid errors on "find_package(SDL2 REQUIRED)" when
-# cross-compiling to web using emscripten
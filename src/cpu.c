@@ -0,0 +1,285 @@
+// Fast path for the code running from rom: as the rom never changes, every
+// instruction is decoded once (handler, immediate operand, size and cycles)
+// when the rom is loaded, and then executed by calling its handler directly,
+// without fetching and decoding opcodes through the memory callbacks.
+//
+// Everything the handlers do not cover (code in ram, interrupts, EI, DI, HLT)
+// is run by i8080_step, on the same i8080 state: both paths must stay
+// equivalent, cycle counts included.
+//
+// Builds with INVADERS_RECOMPILED also have the basic blocks of the rom
+// translated to C at build time (see tools/recompile.c), run as a whole
+// when they end exactly as the instructions run one by one would.
+#include "cpu.h"
+#include "cpu_ops.h"
+#include "crc32.h"
+
+#define OP(name, ...)                                                       \
+  static void name(invaders* const si, const invaders_insn* const insn) { \
+    i8080* const c = &si->cpu;                                             \
+    const uint16_t imm = insn->imm;                                        \
+    (void) c;                                                              \
+    (void) imm;                                                            \
+    __VA_ARGS__                                                            \
+  }
+
+// data transfer
+
+#define FOR_REGS(X, arg) \
+  X(arg, b) X(arg, c) X(arg, d) X(arg, e) X(arg, h) X(arg, l) X(arg, a)
+#define FOR_REGS2(X, arg) \
+  X(arg, b) X(arg, c) X(arg, d) X(arg, e) X(arg, h) X(arg, l) X(arg, a)
+
+#define DEF_MOV(dst, src) OP(mov_##dst##_##src, c->dst = c->src;)
+#define DEF_MOVS(unused, dst) FOR_REGS2(DEF_MOV, dst)
+FOR_REGS(DEF_MOVS, )
+
+#define DEF_REG_OPS(unused, r)                     \
+  OP(mov_##r##_m, c->r = rb(si, get_hl(c));)       \
+  OP(mov_m_##r, wb(si, get_hl(c), c->r);)          \
+  OP(mvi_##r, c->r = imm;)                         \
+  OP(inr_##r, c->r = inr(c, c->r);)                \
+  OP(dcr_##r, c->r = dcr(c, c->r);)                \
+  OP(add_##r, add(c, c->r, 0);)                    \
+  OP(adc_##r, add(c, c->r, c->cf);)                \
+  OP(sub_##r, sub(c, c->r, 0);)                    \
+  OP(sbb_##r, sub(c, c->r, c->cf);)                \
+  OP(ana_##r, ana(c, c->r);)                       \
+  OP(xra_##r, xra(c, c->r);)                       \
+  OP(ora_##r, ora(c, c->r);)                       \
+  OP(cmp_##r, cmp(c, c->r);)
+FOR_REGS(DEF_REG_OPS, )
+
+OP(mvi_m, wb(si, get_hl(c), imm);)
+OP(inr_m, wb(si, get_hl(c), inr(c, rb(si, get_hl(c))));)
+OP(dcr_m, wb(si, get_hl(c), dcr(c, rb(si, get_hl(c))));)
+OP(add_m, add(c, rb(si, get_hl(c)), 0);)
+OP(adc_m, add(c, rb(si, get_hl(c)), c->cf);)
+OP(sub_m, sub(c, rb(si, get_hl(c)), 0);)
+OP(sbb_m, sub(c, rb(si, get_hl(c)), c->cf);)
+OP(ana_m, ana(c, rb(si, get_hl(c)));)
+OP(xra_m, xra(c, rb(si, get_hl(c)));)
+OP(ora_m, ora(c, rb(si, get_hl(c)));)
+OP(cmp_m, cmp(c, rb(si, get_hl(c)));)
+
+OP(adi, add(c, imm, 0);)
+OP(aci, add(c, imm, c->cf);)
+OP(sui, sub(c, imm, 0);)
+OP(sbi, sub(c, imm, c->cf);)
+OP(ani, ana(c, imm);)
+OP(xri, xra(c, imm);)
+OP(ori, ora(c, imm);)
+OP(cpi, cmp(c, imm);)
+
+OP(nop, )
+OP(lxi_b, set_bc(c, imm);)
+OP(lxi_d, set_de(c, imm);)
+OP(lxi_h, set_hl(c, imm);)
+OP(lxi_sp, c->sp = imm;)
+OP(stax_b, wb(si, get_bc(c), c->a);)
+OP(stax_d, wb(si, get_de(c), c->a);)
+OP(ldax_b, c->a = rb(si, get_bc(c));)
+OP(ldax_d, c->a = rb(si, get_de(c));)
+OP(inx_b, set_bc(c, get_bc(c) + 1);)
+OP(inx_d, set_de(c, get_de(c) + 1);)
+OP(inx_h, set_hl(c, get_hl(c) + 1);)
+OP(inx_sp, c->sp += 1;)
+OP(dcx_b, set_bc(c, get_bc(c) - 1);)
+OP(dcx_d, set_de(c, get_de(c) - 1);)
+OP(dcx_h, set_hl(c, get_hl(c) - 1);)
+OP(dcx_sp, c->sp -= 1;)
+OP(dad_b, dad(c, get_bc(c));)
+OP(dad_d, dad(c, get_de(c));)
+OP(dad_h, dad(c, get_hl(c));)
+OP(dad_sp, dad(c, c->sp);)
+OP(shld, ww(si, imm, get_hl(c));)
+OP(lhld, set_hl(c, rw(si, imm));)
+OP(sta, wb(si, imm, c->a);)
+OP(lda, c->a = rb(si, imm);)
+OP(xchg, const uint16_t de = get_de(c); set_de(c, get_hl(c)); set_hl(c, de);)
+OP(xthl, const uint16_t val = rw(si, c->sp); ww(si, c->sp, get_hl(c));
+     set_hl(c, val);)
+OP(sphl, c->sp = get_hl(c);)
+OP(pchl, c->pc = get_hl(c);)
+
+// rotates & misc
+
+OP(rlc, c->cf = c->a >> 7; c->a = (c->a << 1) | c->cf;)
+OP(rrc, c->cf = c->a & 1; c->a = (c->a >> 1) | (c->cf << 7);)
+OP(ral, const bool cy = c->cf; c->cf = c->a >> 7; c->a = (c->a << 1) | cy;)
+OP(rar, const bool cy = c->cf; c->cf = c->a & 1; c->a = (c->a >> 1) | (cy << 7);)
+OP(daa_, daa(c);)
+OP(cma, c->a = ~c->a;)
+OP(stc, c->cf = 1;)
+OP(cmc, c->cf = !c->cf;)
+
+// stack
+
+OP(push_b, push(si, get_bc(c));)
+OP(push_d, push(si, get_de(c));)
+OP(push_h, push(si, get_hl(c));)
+OP(push_psw, push(si, c->a << 8 | get_flags(c));)
+OP(pop_b, set_bc(c, pop(si));)
+OP(pop_d, set_de(c, pop(si));)
+OP(pop_h, set_hl(c, pop(si));)
+OP(pop_psw, const uint16_t af = pop(si); c->a = af >> 8;
+    set_flags(c, af & 0xFF);)
+
+// branches
+
+OP(jmp, c->pc = imm;)
+OP(jnz, if (!c->zf) c->pc = imm;)
+OP(jz, if (c->zf) c->pc = imm;)
+OP(jnc, if (!c->cf) c->pc = imm;)
+OP(jc, if (c->cf) c->pc = imm;)
+OP(jpo, if (!c->pf) c->pc = imm;)
+OP(jpe, if (c->pf) c->pc = imm;)
+OP(jp, if (!c->sf) c->pc = imm;)
+OP(jm, if (c->sf) c->pc = imm;)
+OP(call_, call(si, imm);)
+OP(cnz, cond_call(si, imm, !c->zf);)
+OP(cz, cond_call(si, imm, c->zf);)
+OP(cnc, cond_call(si, imm, !c->cf);)
+OP(cc, cond_call(si, imm, c->cf);)
+OP(cpo, cond_call(si, imm, !c->pf);)
+OP(cpe, cond_call(si, imm, c->pf);)
+OP(cp, cond_call(si, imm, !c->sf);)
+OP(cm, cond_call(si, imm, c->sf);)
+OP(ret, c->pc = pop(si);)
+OP(rnz, cond_ret(si, !c->zf);)
+OP(rz, cond_ret(si, c->zf);)
+OP(rnc, cond_ret(si, !c->cf);)
+OP(rc, cond_ret(si, c->cf);)
+OP(rpo, cond_ret(si, !c->pf);)
+OP(rpe, cond_ret(si, c->pf);)
+OP(rp, cond_ret(si, !c->sf);)
+OP(rm, cond_ret(si, c->sf);)
+OP(rst_0, call(si, 0x00);)
+OP(rst_1, call(si, 0x08);)
+OP(rst_2, call(si, 0x10);)
+OP(rst_3, call(si, 0x18);)
+OP(rst_4, call(si, 0x20);)
+OP(rst_5, call(si, 0x28);)
+OP(rst_6, call(si, 0x30);)
+OP(rst_7, call(si, 0x38);)
+
+// i/o
+
+OP(in, c->a = c->port_in(c->userdata, imm);)
+OP(out, c->port_out(c->userdata, imm, c->a);)
+
+typedef void (*handler)(invaders* const si, const invaders_insn* const insn);
+
+#define REG_ROW(op) \
+  op##_b, op##_c, op##_d, op##_e, op##_h, op##_l, op##_m, op##_a
+
+// NULL entries (EI, DI, HLT) are left to i8080_step
+static const handler HANDLERS[256] = {
+    // 0x00
+    nop, lxi_b, stax_b, inx_b, inr_b, dcr_b, mvi_b, rlc, //
+    nop, dad_b, ldax_b, dcx_b, inr_c, dcr_c, mvi_c, rrc, //
+    nop, lxi_d, stax_d, inx_d, inr_d, dcr_d, mvi_d, ral, //
+    nop, dad_d, ldax_d, dcx_d, inr_e, dcr_e, mvi_e, rar, //
+    nop, lxi_h, shld, inx_h, inr_h, dcr_h, mvi_h, daa_, //
+    nop, dad_h, lhld, dcx_h, inr_l, dcr_l, mvi_l, cma, //
+    nop, lxi_sp, sta, inx_sp, inr_m, dcr_m, mvi_m, stc, //
+    nop, dad_sp, lda, dcx_sp, inr_a, dcr_a, mvi_a, cmc, //
+    // 0x40
+    mov_b_b, mov_b_c, mov_b_d, mov_b_e, mov_b_h, mov_b_l, mov_b_m, mov_b_a, //
+    mov_c_b, mov_c_c, mov_c_d, mov_c_e, mov_c_h, mov_c_l, mov_c_m, mov_c_a, //
+    mov_d_b, mov_d_c, mov_d_d, mov_d_e, mov_d_h, mov_d_l, mov_d_m, mov_d_a, //
+    mov_e_b, mov_e_c, mov_e_d, mov_e_e, mov_e_h, mov_e_l, mov_e_m, mov_e_a, //
+    mov_h_b, mov_h_c, mov_h_d, mov_h_e, mov_h_h, mov_h_l, mov_h_m, mov_h_a, //
+    mov_l_b, mov_l_c, mov_l_d, mov_l_e, mov_l_h, mov_l_l, mov_l_m, mov_l_a, //
+    mov_m_b, mov_m_c, mov_m_d, mov_m_e, mov_m_h, mov_m_l, NULL, mov_m_a, //
+    mov_a_b, mov_a_c, mov_a_d, mov_a_e, mov_a_h, mov_a_l, mov_a_m, mov_a_a, //
+    // 0x80
+    REG_ROW(add), REG_ROW(adc), REG_ROW(sub), REG_ROW(sbb), //
+    REG_ROW(ana), REG_ROW(xra), REG_ROW(ora), REG_ROW(cmp), //
+    // 0xC0
+    rnz, pop_b, jnz, jmp, cnz, push_b, adi, rst_0, //
+    rz, ret, jz, jmp, cz, call_, aci, rst_1, //
+    rnc, pop_d, jnc, out, cnc, push_d, sui, rst_2, //
+    rc, ret, jc, in, cc, call_, sbi, rst_3, //
+    rpo, pop_h, jpo, xthl, cpo, push_h, ani, rst_4, //
+    rpe, pchl, jpe, xchg, cpe, call_, xri, rst_5, //
+    rp, pop_psw, jp, NULL, cp, push_psw, ori, rst_6, //
+    rm, sphl, jm, NULL, cm, call_, cpi, rst_7, //
+};
+
+// (re)decodes every instruction of the rom, must be called every time the
+// rom data changes
+void invaders_cpu_decode(invaders_rom* const rom) {
+  for (int addr = 0; addr < ROM_SIZE; addr++) {
+    const uint8_t opcode = rom->data[addr];
+    invaders_insn* const insn = &rom->code[addr];
+
+    insn->size = OPCODE_SIZES[opcode];
+    insn->cycles = OPCODE_CYCLES[opcode];
+    insn->imm = 0;
+    insn->exec = HANDLERS[opcode];
+
+    if (addr + insn->size > ROM_SIZE) {
+      // the operands are not in rom
+      insn->exec = NULL;
+    } else if (insn->size == 2) {
+      insn->imm = rom->data[addr + 1];
+    } else if (insn->size == 3) {
+      insn->imm = rom->data[addr + 1] | rom->data[addr + 2] << 8;
+    }
+  }
+
+  rom->blocks = NULL;
+#ifdef INVADERS_RECOMPILED
+  // the blocks are only used if the bytes they were translated from are the
+  // same in this rom (other data, such as the high score, may differ)
+  uint32_t crc = 0;
+  for (int addr = 0; addr < ROM_SIZE; addr++) {
+    if (invaders_recompiled_code[addr / 8] & (1 << addr % 8)) {
+      crc = invaders_crc32(crc, &rom->data[addr], 1);
+    }
+  }
+  if (crc == invaders_recompiled_crc) {
+    rom->blocks = invaders_recompiled_blocks;
+  }
+#endif
+}
+
+// executes one instruction, through the decoded rom if possible
+void invaders_cpu_step(invaders* const si) {
+  i8080* const c = &si->cpu;
+
+  if (c->pc < ROM_SIZE && c->interrupt_delay == 0 && !c->halted &&
+      !(c->interrupt_pending && c->iff)) {
+    const invaders_insn* const insn = &si->rom->code[c->pc];
+    if (insn->exec != NULL) {
+      c->cyc += insn->cycles;
+      c->pc += insn->size;
+      insn->exec(si, insn);
+      return;
+    }
+  }
+
+  i8080_step(c);
+}
+
+// runs the cpu for at least `count` cycles, a block of the recompiled rom
+// at a time when its last instruction starts before `count` (the
+// instructions run one by one would stop at the same point), else one
+// instruction at a time. The rom must have blocks.
+void invaders_cpu_run_blocks(invaders* const si, unsigned long count) {
+  i8080* const c = &si->cpu;
+  const invaders_block* const blocks = si->rom->blocks;
+
+  while (c->cyc < count) {
+    if (c->pc < ROM_SIZE && c->interrupt_delay == 0 && !c->halted &&
+        !(c->interrupt_pending && c->iff)) {
+      const invaders_block* const block = &blocks[c->pc];
+      if (block->run != NULL && c->cyc + block->lead < count) {
+        block->run(si);
+        continue;
+      }
+    }
+    invaders_cpu_step(si);
+  }
+}
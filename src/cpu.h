@@ -0,0 +1,19 @@
+#ifndef INVADERS_CPU_H
+#define INVADERS_CPU_H
+
+#include "invaders.h"
+
+void invaders_cpu_decode(invaders_rom* const rom);
+void invaders_cpu_step(invaders* const si);
+void invaders_cpu_run_blocks(invaders* const si, unsigned long count);
+
+#ifdef INVADERS_RECOMPILED
+// rom translated by invaders_recompile (see tools/recompile.c): the blocks
+// by address, the bytes of the rom they were translated from (one bit per
+// byte) and the crc32 of these bytes
+extern const invaders_block invaders_recompiled_blocks[ROM_SIZE];
+extern const uint8_t invaders_recompiled_code[ROM_SIZE / 8];
+extern const uint32_t invaders_recompiled_crc;
+#endif
+
+#endif // INVADERS_CPU_H
@@ -0,0 +1,236 @@
+#ifndef INVADERS_CPU_OPS_H
+#define INVADERS_CPU_OPS_H
+
+// operations of the 8080 on the state of a machine, shared by the threaded
+// engine (cpu.c) and the recompiled rom (see tools/recompile.c), so that
+// both compute exactly what i8080_step does
+#include "invaders.h"
+
+static inline uint8_t rb(invaders* const si, uint16_t addr) {
+  return invaders_read(si, addr);
+}
+
+static inline void wb(invaders* const si, uint16_t addr, uint8_t val) {
+  invaders_write(si, addr, val);
+}
+
+static inline uint16_t rw(invaders* const si, uint16_t addr) {
+  return rb(si, addr + 1) << 8 | rb(si, addr);
+}
+
+static inline void ww(invaders* const si, uint16_t addr, uint16_t val) {
+  wb(si, addr, val & 0xFF);
+  wb(si, addr + 1, val >> 8);
+}
+
+static inline uint16_t get_bc(i8080* const c) {
+  return c->b << 8 | c->c;
+}
+
+static inline uint16_t get_de(i8080* const c) {
+  return c->d << 8 | c->e;
+}
+
+static inline uint16_t get_hl(i8080* const c) {
+  return c->h << 8 | c->l;
+}
+
+static inline void set_bc(i8080* const c, uint16_t val) {
+  c->b = val >> 8;
+  c->c = val & 0xFF;
+}
+
+static inline void set_de(i8080* const c, uint16_t val) {
+  c->d = val >> 8;
+  c->e = val & 0xFF;
+}
+
+static inline void set_hl(i8080* const c, uint16_t val) {
+  c->h = val >> 8;
+  c->l = val & 0xFF;
+}
+
+static inline bool parity(uint8_t val) {
+  val ^= val >> 4;
+  val ^= val >> 2;
+  val ^= val >> 1;
+  return !(val & 1);
+}
+
+static inline void set_zsp(i8080* const c, uint8_t val) {
+  c->zf = val == 0;
+  c->sf = val >> 7;
+  c->pf = parity(val);
+}
+
+// returns if there was a carry between bit "bit_no" and "bit_no - 1" when
+// executing "a + b + cy"
+static inline bool carry(int bit_no, uint8_t a, uint8_t b, bool cy) {
+  const int16_t result = a + b + cy;
+  const int16_t carry = result ^ a ^ b;
+  return carry & (1 << bit_no);
+}
+
+static inline void add(i8080* const c, uint8_t val, bool cy) {
+  const uint8_t result = c->a + val + cy;
+  c->cf = carry(8, c->a, val, cy);
+  c->hf = carry(4, c->a, val, cy);
+  set_zsp(c, result);
+  c->a = result;
+}
+
+static inline void sub(i8080* const c, uint8_t val, bool cy) {
+  add(c, ~val, !cy);
+  c->cf = !c->cf;
+}
+
+static inline void cmp(i8080* const c, uint8_t val) {
+  const int16_t result = c->a - val;
+  c->cf = result >> 8;
+  c->hf = ~(c->a ^ result ^ val) & 0x10;
+  set_zsp(c, result & 0xFF);
+}
+
+static inline void ana(i8080* const c, uint8_t val) {
+  const uint8_t result = c->a & val;
+  c->cf = 0;
+  c->hf = ((c->a | val) & 0x08) != 0;
+  set_zsp(c, result);
+  c->a = result;
+}
+
+static inline void xra(i8080* const c, uint8_t val) {
+  c->a ^= val;
+  c->cf = 0;
+  c->hf = 0;
+  set_zsp(c, c->a);
+}
+
+static inline void ora(i8080* const c, uint8_t val) {
+  c->a |= val;
+  c->cf = 0;
+  c->hf = 0;
+  set_zsp(c, c->a);
+}
+
+static inline uint8_t inr(i8080* const c, uint8_t val) {
+  const uint8_t result = val + 1;
+  c->hf = (result & 0xF) == 0;
+  set_zsp(c, result);
+  return result;
+}
+
+static inline uint8_t dcr(i8080* const c, uint8_t val) {
+  const uint8_t result = val - 1;
+  c->hf = !((result & 0xF) == 0xF);
+  set_zsp(c, result);
+  return result;
+}
+
+static inline void dad(i8080* const c, uint16_t val) {
+  c->cf = ((get_hl(c) + val) >> 16) & 1;
+  set_hl(c, get_hl(c) + val);
+}
+
+static inline void daa(i8080* const c) {
+  bool cy = c->cf;
+  uint8_t correction = 0;
+  const uint8_t lsb = c->a & 0x0F;
+  const uint8_t msb = c->a >> 4;
+
+  if (c->hf || lsb > 9) {
+    correction += 0x06;
+  }
+  if (c->cf || msb > 9 || (msb >= 9 && lsb > 9)) {
+    correction += 0x60;
+    cy = 1;
+  }
+  add(c, correction, 0);
+  c->cf = cy;
+}
+
+static inline void push(invaders* const si, uint16_t val) {
+  si->cpu.sp -= 2;
+  ww(si, si->cpu.sp, val);
+}
+
+static inline uint16_t pop(invaders* const si) {
+  const uint16_t val = rw(si, si->cpu.sp);
+  si->cpu.sp += 2;
+  return val;
+}
+
+// pc already points to the next instruction
+static inline void call(invaders* const si, uint16_t addr) {
+  push(si, si->cpu.pc);
+  si->cpu.pc = addr;
+}
+
+static inline void cond_call(invaders* const si, uint16_t addr, bool cond) {
+  if (cond) {
+    call(si, addr);
+    si->cpu.cyc += 6;
+  }
+}
+
+static inline void cond_ret(invaders* const si, bool cond) {
+  if (cond) {
+    si->cpu.pc = pop(si);
+    si->cpu.cyc += 6;
+  }
+}
+
+static inline uint8_t get_flags(i8080* const c) {
+  return c->sf << 7 | c->zf << 6 | c->hf << 4 | c->pf << 2 | 1 << 1 | c->cf;
+}
+
+static inline void set_flags(i8080* const c, uint8_t flags) {
+  c->sf = (flags >> 7) & 1;
+  c->zf = (flags >> 6) & 1;
+  c->hf = (flags >> 4) & 1;
+  c->pf = (flags >> 2) & 1;
+  c->cf = flags & 1;
+}
+
+// cycles of each instruction (6 more for the conditional calls and returns
+// taken)
+static const uint8_t OPCODE_CYCLES[256] = {
+    4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4, //
+    4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4, //
+    4, 10, 16, 5, 5, 5, 7, 4, 4, 10, 16, 5, 5, 5, 7, 4, //
+    4, 10, 13, 5, 10, 10, 10, 4, 4, 10, 13, 5, 5, 5, 7, 4, //
+    5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5, //
+    5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5, //
+    5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5, //
+    7, 7, 7, 7, 7, 7, 7, 7, 5, 5, 5, 5, 5, 5, 7, 5, //
+    4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, //
+    4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, //
+    4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, //
+    4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, //
+    5, 10, 10, 10, 11, 11, 7, 11, 5, 10, 10, 10, 11, 17, 7, 11, //
+    5, 10, 10, 10, 11, 11, 7, 11, 5, 10, 10, 10, 11, 17, 7, 11, //
+    5, 10, 10, 18, 11, 11, 7, 11, 5, 5, 10, 4, 11, 17, 7, 11, //
+    5, 10, 10, 4, 11, 11, 7, 11, 5, 5, 10, 4, 11, 17, 7, 11, //
+};
+
+// size of each instruction, in bytes
+static const uint8_t OPCODE_SIZES[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, //
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, //
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, //
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1, //
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, //
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1, //
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1, //
+};
+
+#endif // INVADERS_CPU_OPS_H
@@ -0,0 +1,11 @@
+#ifndef INVADERS_CRC32_H
+#define INVADERS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (the one of zip and png), start with `crc` = 0 and pass the result
+// of the previous call to hash data in several parts
+uint32_t invaders_crc32(uint32_t crc, const void* data, size_t size);
+
+#endif // INVADERS_CRC32_H
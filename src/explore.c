@@ -0,0 +1,119 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "explore.h"
+
+typedef struct explore_job explore_job;
+struct explore_job {
+  const invaders* root;
+  invaders_branch* branches;
+  int count;
+  _Atomic int next; // next branch to be taken by a thread
+};
+
+typedef struct explore_worker explore_worker;
+struct explore_worker {
+  explore_job* job;
+  invaders* scratch; // machine of the branches that keep none, or NULL
+  pthread_t thread;
+};
+
+static void run_branch(const invaders* const root,
+    invaders_branch* const b, invaders* const child) {
+  invaders_fork(child, root);
+  child->skip_render = true;
+  child->userdata = NULL;
+  child->update_screen = NULL;
+  child->play_sound = NULL;
+  child->frame_start = NULL;
+
+  for (int i = 0; i < b->frames; i++) {
+    child->port1 = b->port1[i];
+    if (b->port2 != NULL) {
+      child->port2 = b->port2[i];
+    }
+    invaders_run_frames(child, 1);
+  }
+
+  invaders_get_features(child, b->features);
+  b->score = b->features[INVADERS_FEATURE_SCORE1];
+}
+
+// runs the branches until there are none left, the scratch machine is
+// only allocated if one of them needs it
+static int run_branches(explore_worker* const w) {
+  explore_job* const job = w->job;
+  int i;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+    invaders_branch* const b = &job->branches[i];
+    if (b->machine == NULL && w->scratch == NULL) {
+      w->scratch = malloc(sizeof *w->scratch);
+      if (w->scratch == NULL) {
+        return 1;
+      }
+    }
+    run_branch(job->root, b, b->machine != NULL ? b->machine : w->scratch);
+  }
+  return 0;
+}
+
+static void* worker_main(void* userdata) {
+  explore_worker* const w = (explore_worker*) userdata;
+  return run_branches(w) != 0 ? w : NULL;
+}
+
+int invaders_explore(const invaders* const root,
+    invaders_branch* const branches, int count, int threads) {
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads > count) {
+    threads = count;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  explore_worker* const workers = calloc(threads, sizeof *workers);
+  if (workers == NULL) {
+    return 1;
+  }
+  explore_job job = {.root = root, .branches = branches, .count = count};
+  atomic_init(&job.next, 0);
+
+  // worker 0 is the calling thread
+  int started = 1;
+  for (int i = 0; i < threads; i++) {
+    workers[i].job = &job;
+  }
+  for (; started < threads; started++) {
+    if (pthread_create(&workers[started].thread, NULL, worker_main,
+            &workers[started]) != 0) {
+      fprintf(stderr, "error: cannot create explore thread %d\n", started);
+      break;
+    }
+  }
+
+  int result = run_branches(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    void* failed;
+    pthread_join(workers[i].thread, &failed);
+    if (failed != NULL) {
+      result = 1;
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    free(workers[i].scratch);
+  }
+  free(workers);
+
+  if (result != 0) {
+    fprintf(stderr, "error: cannot allocate the explored machines\n");
+  }
+  return result;
+}
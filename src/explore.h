@@ -0,0 +1,35 @@
+#ifndef INVADERS_EXPLORE_H
+#define INVADERS_EXPLORE_H
+
+#include "invaders.h"
+#include "observe.h"
+
+// A branch of an exploration: inputs played from the state of the root
+// machine, and what came of them
+typedef struct invaders_branch invaders_branch;
+struct invaders_branch {
+  // inputs, given by the caller: port 1 and port 2 of each frame (port2 can
+  // be NULL to keep the one of the root)
+  const uint8_t* port1;
+  const uint8_t* port2;
+  int frames;
+  // machine left in the state reached, to explore further from it (can be
+  // NULL if only the results are needed)
+  invaders* machine;
+
+  // results, at the end of the branch: the score of player 1 (0x20F8), and
+  // every feature of the game (see observe.h)
+  int32_t score;
+  int32_t features[INVADERS_FEATURE_COUNT];
+};
+
+// Runs `count` branches from the state of `root`, each one in a fork of it
+// (see invaders_fork), across `threads` threads (the calling thread
+// included, 0 for one per online cpu). The branches are taken in order by
+// the threads as they become free. The forks do not render their screen
+// nor call the callbacks of the root, which must not run meanwhile.
+// Returns 0 on success.
+int invaders_explore(const invaders* const root,
+    invaders_branch* const branches, int count, int threads);
+
+#endif // INVADERS_EXPLORE_H
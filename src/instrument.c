@@ -0,0 +1,172 @@
+// counters of the instrumentation (see instrument.h), updated by the
+// emulation thread(s), the render thread and the audio thread: they are
+// all atomic, and the trace events are written in a ring buffer.
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "instrument.h"
+
+// last stage timings kept for the trace
+#define TRACE_SIZE 65536 // power of two
+#define SUMMARY_TOP_OPCODES 8
+
+typedef struct trace_event trace_event;
+struct trace_event {
+  uint64_t begin, end; // in nanoseconds
+  uint8_t stage;
+  uint8_t thread;
+};
+
+static const char* STAGE_NAMES[INVADERS_STAGE_COUNT] = {
+    "cpu", "render", "texture upload", "present", "audio"};
+
+static atomic_uint_fast64_t opcode_count[256];
+static atomic_uint_fast64_t opcode_cycles[256];
+static atomic_uint_fast64_t port_count[2][256]; // in, out
+static atomic_uint_fast64_t interrupt_count[8]; // by RST number
+static atomic_uint_fast64_t stage_count[INVADERS_STAGE_COUNT];
+static atomic_uint_fast64_t stage_time[INVADERS_STAGE_COUNT];
+
+static trace_event trace[TRACE_SIZE];
+static atomic_uint_fast64_t trace_position;
+static atomic_int thread_count;
+static _Thread_local int thread_id = -1;
+
+static inline void add(atomic_uint_fast64_t* counter, uint64_t value) {
+  atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline uint64_t get(atomic_uint_fast64_t* counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void invaders_instrument_opcode(uint8_t opcode, uint32_t cycles) {
+  add(&opcode_count[opcode], 1);
+  add(&opcode_cycles[opcode], cycles);
+}
+
+void invaders_instrument_port(int out, uint8_t port) {
+  add(&port_count[out != 0][port], 1);
+}
+
+void invaders_instrument_interrupt(uint8_t vector) {
+  add(&interrupt_count[(vector >> 3) & 7], 1);
+}
+
+// returns the time in nanoseconds
+uint64_t invaders_instrument_begin(void) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+  timespec_get(&ts, TIME_UTC);
+#endif
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void invaders_instrument_end(int stage, uint64_t begin) {
+  const uint64_t end = invaders_instrument_begin();
+  add(&stage_count[stage], 1);
+  add(&stage_time[stage], end - begin);
+
+  if (thread_id < 0) {
+    thread_id = atomic_fetch_add(&thread_count, 1);
+  }
+  const uint64_t position = atomic_fetch_add(&trace_position, 1);
+  trace_event* const e = &trace[position % TRACE_SIZE];
+  e->begin = begin;
+  e->end = end;
+  e->stage = stage;
+  e->thread = thread_id;
+}
+
+static int compare_opcodes(const void* a, const void* b) {
+  const uint64_t x = get(&opcode_cycles[*(const uint8_t*) a]);
+  const uint64_t y = get(&opcode_cycles[*(const uint8_t*) b]);
+  return (x < y) - (x > y);
+}
+
+// prints the counters since the start
+void invaders_instrument_summary(FILE* f) {
+  uint64_t instructions = 0, cycles = 0;
+  uint8_t opcodes[256];
+  for (int op = 0; op < 256; op++) {
+    instructions += get(&opcode_count[op]);
+    cycles += get(&opcode_cycles[op]);
+    opcodes[op] = op;
+  }
+  qsort(opcodes, 256, 1, compare_opcodes);
+
+  fprintf(f, "instructions: %llu (%llu cycles)\n",
+      (unsigned long long) instructions, (unsigned long long) cycles);
+  for (int i = 0; i < SUMMARY_TOP_OPCODES; i++) {
+    const uint8_t op = opcodes[i];
+    fprintf(f, "  opcode %02x: %llu times, %.1f%% of the cycles\n", op,
+        (unsigned long long) get(&opcode_count[op]),
+        cycles ? 100.0 * get(&opcode_cycles[op]) / cycles : 0.0);
+  }
+
+  fprintf(f, "ports:");
+  for (int out = 0; out < 2; out++) {
+    for (int port = 0; port < 256; port++) {
+      const uint64_t count = get(&port_count[out][port]);
+      if (count != 0) {
+        fprintf(f, " %s %d: %llu,", out ? "out" : "in", port,
+            (unsigned long long) count);
+      }
+    }
+  }
+  fprintf(f, "\ninterrupts:");
+  for (int rst = 0; rst < 8; rst++) {
+    const uint64_t count = get(&interrupt_count[rst]);
+    if (count != 0) {
+      fprintf(f, " rst %d: %llu,", rst, (unsigned long long) count);
+    }
+  }
+  fprintf(f, "\nstages:\n");
+  for (int s = 0; s < INVADERS_STAGE_COUNT; s++) {
+    const uint64_t count = get(&stage_count[s]);
+    const double ms = get(&stage_time[s]) / 1e6;
+    fprintf(f, "  %s: %.1f ms in %llu calls (%.3f ms each)\n", STAGE_NAMES[s],
+        ms, (unsigned long long) count, count ? ms / count : 0.0);
+  }
+}
+
+// writes the last stage timings as a chrome trace, to be called when the
+// instrumented threads are stopped
+int invaders_instrument_export(const char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) {
+    fprintf(stderr, "error: can't open trace file '%s'.\n", filename);
+    return 1;
+  }
+
+  const uint64_t position = atomic_load(&trace_position);
+  const uint64_t first = position > TRACE_SIZE ? position - TRACE_SIZE : 0;
+  uint64_t origin = UINT64_MAX;
+  for (uint64_t i = first; i < position; i++) {
+    const uint64_t begin = trace[i % TRACE_SIZE].begin;
+    origin = begin < origin ? begin : origin;
+  }
+  fprintf(f, "{\"traceEvents\":[\n");
+  for (uint64_t i = first; i < position; i++) {
+    const trace_event* const e = &trace[i % TRACE_SIZE];
+    fprintf(f,
+        "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+        "\"ts\":%.3f,\"dur\":%.3f}%s\n",
+        STAGE_NAMES[e->stage], e->thread, (e->begin - origin) / 1e3,
+        (e->end - e->begin) / 1e3, i + 1 < position ? "," : "");
+  }
+  fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+
+  if (fclose(f) != 0) {
+    fprintf(stderr, "error: can't write trace file '%s'.\n", filename);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef INVADERS_INSTRUMENT_H
+#define INVADERS_INSTRUMENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Instrumentation of the hot paths, compiled in when INVADERS_INSTRUMENT is
+// defined (cmake -DINVADERS_INSTRUMENT=ON): counts the instructions run by
+// opcode (and their cycles), the port accesses and the interrupts, and
+// times the stages of a frame, which can be exported as a chrome trace
+// (chrome://tracing or https://ui.perfetto.dev). Otherwise, the macros
+// below expand to nothing.
+enum {
+  INVADERS_STAGE_CPU,
+  INVADERS_STAGE_RENDER,
+  INVADERS_STAGE_UPLOAD,
+  INVADERS_STAGE_PRESENT,
+  INVADERS_STAGE_AUDIO,
+  INVADERS_STAGE_COUNT,
+};
+
+#ifdef INVADERS_INSTRUMENT
+
+void invaders_instrument_opcode(uint8_t opcode, uint32_t cycles);
+void invaders_instrument_port(int out, uint8_t port);
+void invaders_instrument_interrupt(uint8_t vector);
+uint64_t invaders_instrument_begin(void);
+void invaders_instrument_end(int stage, uint64_t begin);
+void invaders_instrument_summary(FILE* f);
+int invaders_instrument_export(const char* filename);
+
+#define INSTRUMENT_OPCODE(opcode, cycles) \
+  invaders_instrument_opcode(opcode, cycles)
+#define INSTRUMENT_PORT(out, port) invaders_instrument_port(out, port)
+#define INSTRUMENT_INTERRUPT(vector) invaders_instrument_interrupt(vector)
+// times the code between INSTRUMENT_BEGIN(name) and INSTRUMENT_END(stage,
+// name), in the same block
+#define INSTRUMENT_BEGIN(name) \
+  const uint64_t name = invaders_instrument_begin()
+#define INSTRUMENT_END(stage, name) invaders_instrument_end(stage, name)
+
+#else
+
+#define INSTRUMENT_OPCODE(opcode, cycles)
+#define INSTRUMENT_PORT(out, port)
+#define INSTRUMENT_INTERRUPT(vector)
+#define INSTRUMENT_BEGIN(name)
+#define INSTRUMENT_END(stage, name)
+
+#endif // INVADERS_INSTRUMENT
+
+#endif // INVADERS_INSTRUMENT_H
@@ -1,26 +1,71 @@
+#include <stdio.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "invaders.h"
+#include "cpu.h"
+#include "instrument.h"
+#include "profiler.h"
+
+// read by the unmapped pages (0x6000-0xFFFF)
+static const uint8_t UNMAPPED_PAGE[256];
 
 // reads a byte from memory
 static uint8_t invaders_rb(void* userdata, uint16_t addr) {
-  invaders* const si = (invaders*) userdata;
-
-  if (addr >= 0x6000) {
-    return 0;
-  }
-  if (addr >= 0x4000 && addr < 0x6000) {
-    addr -= 0x2000; // RAM mirror
-  }
-
-  return si->memory[addr];
+  return invaders_read((invaders*) userdata, addr);
 }
 
 // writes a byte to memory
 static void invaders_wb(void* userdata, uint16_t addr, uint8_t val) {
-  invaders* const si = (invaders*) userdata;
+  invaders_write((invaders*) userdata, addr, val);
+}
 
-  // the game can only write to 0x2000-0x4000
-  if (addr >= 0x2000 && addr < 0x4000) {
-    si->memory[addr] = val;
+// writes a byte to a page that is not directly writable
+void invaders_write_special(invaders* const si, uint16_t addr, uint8_t val) {
+  // rom, mirror and unmapped pages are read only
+  if (si->page_flags[addr >> 8] & INVADERS_PAGE_VRAM) {
+    if (si->ram[addr - RAM_ADDR] != val) {
+      // marks the line of vram as changed for the next screen update
+      const int line = (addr - VRAM_ADDR) / 32;
+      si->dirty_lines[line / 32] |= 1u << (line % 32);
+    }
+    si->ram[addr - RAM_ADDR] = val;
+  }
+}
+
+// builds the page table of the memory map:
+// 0x0000-0x1FFF rom (read only)
+// 0x2000-0x23FF work ram
+// 0x2400-0x3FFF video ram
+// 0x4000-0x5FFF ram mirror (read only)
+// 0x6000-0xFFFF unmapped, reads 0
+void invaders_map_memory(invaders* const si) {
+  for (int page = 0; page < 256; page++) {
+    const uint16_t addr = page << 8;
+    if (addr < RAM_ADDR) {
+      si->read_pages[page] = &si->rom->data[addr];
+      si->write_pages[page] = NULL;
+      si->page_flags[page] = INVADERS_PAGE_READONLY;
+    } else if (addr < VRAM_ADDR) {
+      si->read_pages[page] = &si->ram[addr - RAM_ADDR];
+      si->write_pages[page] = &si->ram[addr - RAM_ADDR];
+      si->page_flags[page] = 0;
+    } else if (addr < RAM_ADDR + RAM_SIZE) {
+      si->read_pages[page] = &si->ram[addr - RAM_ADDR];
+      si->write_pages[page] = NULL;
+      si->page_flags[page] = INVADERS_PAGE_VRAM;
+    } else if (addr < 0x6000) {
+      si->read_pages[page] = &si->ram[addr - RAM_ADDR - 0x2000];
+      si->write_pages[page] = NULL;
+      si->page_flags[page] = INVADERS_PAGE_READONLY | INVADERS_PAGE_MIRROR;
+    } else {
+      si->read_pages[page] = UNMAPPED_PAGE;
+      si->write_pages[page] = NULL;
+      si->page_flags[page] = INVADERS_PAGE_READONLY;
+    }
   }
 }
 
@@ -51,6 +96,7 @@ static uint8_t port_in(void* userdata, uint8_t port) {
   default: fprintf(stderr, "error: unknown IN port %02x\n", port); break;
   }
 
+  INSTRUMENT_PORT(0, port);
   return value;
 }
 
@@ -86,25 +132,33 @@ static void port_out(void* userdata, uint8_t port, uint8_t value) {
 
   default: fprintf(stderr, "error: unknown OUT port %02x\n", port); break;
   }
+
+  INSTRUMENT_PORT(1, port);
 }
 
-static inline NMIX_FileSource* load_sound(const char* filename) {
-  SDL_RWops* f = SDL_RWFromFile(filename, "rb");
-  if (f == NULL) {
-    fprintf(stderr, "Error: cannot open sound file %s\n", filename);
-    return NULL;
-  }
+// line of the frame at which each event happens
+static const int EVENT_LINES[INVADERS_EVENT_COUNT] = {
+    [INVADERS_EVENT_MID_SCREEN] = 96,
+    [INVADERS_EVENT_VBLANK] = 224,
+};
 
-  NMIX_FileSource* source1 = NMIX_NewFileSource(f, "wav", 0);
-  if (source1 == NULL) {
-    fprintf(stderr, "NMIX Error: %s\n", SDL_GetError());
-    return NULL;
+// computes the next deadline of every event from the cycle count: the
+// events due at the current cycle are considered as already fired
+static void schedule_events(invaders* const si) {
+  const uint64_t frame_base = si->cycles - si->cycles % CYCLES_PER_FRAME;
+  for (int e = 0; e < INVADERS_EVENT_SAMPLE; e++) {
+    uint64_t deadline = frame_base + EVENT_LINES[e] * CYCLES_PER_LINE;
+    if (deadline <= si->cycles) {
+      deadline += CYCLES_PER_FRAME;
+    }
+    si->events[e] = deadline;
   }
-
-  return source1;
+  si->events[INVADERS_EVENT_SAMPLE] =
+      si->profiler != NULL ? si->cycles + si->profiler->period : UINT64_MAX;
 }
 
-void invaders_init(invaders* const si) {
+// initialises a machine running `rom`, which must outlive it
+void invaders_init(invaders* const si, invaders_rom* const rom) {
   i8080_init(&si->cpu);
   si->cpu.userdata = si;
   si->cpu.read_byte = invaders_rb;
@@ -112,9 +166,21 @@ void invaders_init(invaders* const si) {
   si->cpu.port_in = port_in;
   si->cpu.port_out = port_out;
 
-  memset(si->memory, 0, sizeof si->memory);
+  si->rom = rom;
+  memset(si->ram, 0, sizeof si->ram);
+  invaders_map_memory(si);
+#ifdef INVADERS_RECOMPILED
+  si->engine = INVADERS_ENGINE_RECOMPILED;
+#else
+  si->engine = INVADERS_ENGINE_THREADED;
+#endif
+#ifndef INVADERS_COMPACT_SCREEN
   memset(si->screen_buffer, 0, sizeof si->screen_buffer);
-  si->next_interrupt = 0xcf;
+#endif
+  si->cycles = 0;
+  si->clock_debt = 0;
+  si->profiler = NULL;
+  schedule_events(si);
 
   // PORT 1:
   // Bit Description
@@ -148,53 +214,305 @@ void invaders_init(invaders* const si) {
   si->last_out_port5 = 0;
 
   si->colored_screen = true;
+  si->frame_count = 0;
+  si->rendered_colored_screen = true;
+  si->skip_render = false;
+  si->skip_screen_buffer = false;
+  si->dirty_x0 = 0;
+  si->dirty_x1 = SCREEN_WIDTH;
+  invaders_invalidate_screen(si);
+
+  si->userdata = NULL;
   si->update_screen = NULL;
+  si->play_sound = NULL;
+  si->frame_start = NULL;
+}
 
-  // load sounds
-  si->sounds[0] = load_sound("roms/8.wav"); // ufo sound
-  si->sounds[1] = load_sound("roms/1.wav"); // shoot sound
-  si->sounds[2] = load_sound("roms/2.wav"); // player die
-  si->sounds[3] = load_sound("roms/3.wav"); // alien die
-  si->sounds[4] = load_sound("roms/4.wav"); // alien move 1
-  si->sounds[5] = load_sound("roms/5.wav"); // alien move 2
-  si->sounds[6] = load_sound("roms/6.wav"); // alien move 3
-  si->sounds[7] = load_sound("roms/7.wav"); // alien move 4
-  si->sounds[8] = load_sound("roms/0.wav"); // ufo hit
+// makes `child` a copy of `parent` that runs on from the same point (eg.
+// with other inputs), without copying what does not change or can be
+// rebuilt: the rom stays shared, and only the ram (8 KB) and the state of
+// the cpu, ports and scheduler are copied. The screen buffer of the child
+// is left as it is, and fully rendered again at its next screen update.
+// The callbacks and userdata are copied, the profiler is not. `child` need
+// not be initialised.
+void invaders_fork(invaders* const child, const invaders* const parent) {
+  child->cpu = parent->cpu;
+  child->cpu.userdata = child;
+  child->rom = parent->rom;
+  memcpy(child->ram, parent->ram, sizeof child->ram);
+  child->engine = parent->engine;
+  invaders_map_memory(child);
+
+  child->cycles = parent->cycles;
+  memcpy(child->events, parent->events, sizeof child->events);
+  child->events[INVADERS_EVENT_SAMPLE] = UINT64_MAX;
+  child->clock_debt = parent->clock_debt;
+  child->colored_screen = parent->colored_screen;
+  child->frame_count = parent->frame_count;
+
+  child->port1 = parent->port1;
+  child->port2 = parent->port2;
+  child->shift_msb = parent->shift_msb;
+  child->shift_lsb = parent->shift_lsb;
+  child->shift_offset = parent->shift_offset;
+  child->last_out_port3 = parent->last_out_port3;
+  child->last_out_port5 = parent->last_out_port5;
+
+  child->rendered_colored_screen = parent->rendered_colored_screen;
+  child->skip_render = parent->skip_render;
+  child->skip_screen_buffer = parent->skip_screen_buffer;
+  child->dirty_x0 = 0;
+  child->dirty_x1 = SCREEN_WIDTH;
+  invaders_invalidate_screen(child);
+  child->profiler = NULL;
+
+  child->userdata = parent->userdata;
+  child->update_screen = parent->update_screen;
+  child->play_sound = parent->play_sound;
+  child->frame_start = parent->frame_start;
 }
 
-// advances emulation for `ms` milliseconds.
-void invaders_update(invaders* const si, int ms) {
-  // machine executes exactly CLOCK_SPEED cycles every second, so we need
-  // to execute "ms * CLOCK_SPEED / 1000"
-  int count = 0;
-  while (count < ms * CLOCK_SPEED / 1000) {
-    int cyc = si->cpu.cyc;
-    i8080_step(&si->cpu);
-    int elapsed = si->cpu.cyc - cyc;
-    count += elapsed;
-
-    // interrupt handling: two interrupts are requested:
-    // - 0xcf (RST 8) when the beam is *near* the middle of the screen
-    // - 0xd7 (RST 10) when the beam is at the end of the screen (line 224)
-    //
-    // For now, we just request one interrupt after one mid-frame, so
-    // after "CYCLES_PER_FRAME / 2" cycles
-    if (si->cpu.cyc >= CYCLES_PER_FRAME / 2) {
-      si->cpu.cyc -= CYCLES_PER_FRAME / 2;
-
-      i8080_interrupt(&si->cpu, si->next_interrupt);
-      if (si->next_interrupt == 0xd7) {
-        // we update the screen at the start of vblank,
-        // which coincides with the request of RST 10 interrupt
-        invaders_gpu_update(si);
+static void fire_event(invaders* const si, int event) {
+  switch (event) {
+  case INVADERS_EVENT_MID_SCREEN:
+    i8080_interrupt(&si->cpu, 0xcf);
+    break;
+  case INVADERS_EVENT_VBLANK:
+    i8080_interrupt(&si->cpu, 0xd7);
+    // we update the screen at the start of vblank,
+    // which coincides with the request of RST 10 interrupt
+    if (!si->skip_render) {
+      INSTRUMENT_BEGIN(start);
+      invaders_gpu_update(si);
+      INSTRUMENT_END(INVADERS_STAGE_RENDER, start);
+    }
+    si->frame_count += 1;
+    if (si->frame_start != NULL) {
+      si->frame_start(si);
+    }
+    break;
+  case INVADERS_EVENT_SAMPLE:
+    invaders_profiler_sample(si->profiler, si);
+    si->events[event] += si->profiler->period;
+    return;
+  }
+  si->events[event] += CYCLES_PER_FRAME;
+}
+
+#ifdef INVADERS_INSTRUMENT
+// counts the instruction run by `step`: the one at pc, or the one sent by
+// an interrupt being accepted
+#define STEP(c, step)                                                    \
+  do {                                                                   \
+    const bool interrupt =                                               \
+        c->interrupt_pending && c->iff && c->interrupt_delay == 0;       \
+    const uint8_t opcode =                                               \
+        interrupt ? c->interrupt_vector : invaders_read(si, c->pc);      \
+    const unsigned long start = c->cyc;                                  \
+    step;                                                                \
+    INSTRUMENT_OPCODE(opcode, c->cyc - start);                           \
+    if (interrupt) {                                                     \
+      INSTRUMENT_INTERRUPT(opcode);                                      \
+    }                                                                    \
+  } while (0)
+#else
+#define STEP(c, step) step
+#endif
+
+// runs the cpu for at least `count` cycles, without checking for events
+static void run_cpu(invaders* const si, unsigned long count) {
+  INSTRUMENT_BEGIN(start);
+  i8080* const c = &si->cpu;
+  c->cyc = 0;
+#ifdef INVADERS_INSTRUMENT
+  // instrumented builds count every instruction: the recompiled rom is run
+  // by the threaded engine
+  const bool recompiled = false;
+#else
+  const bool recompiled =
+      si->engine == INVADERS_ENGINE_RECOMPILED && si->rom->blocks != NULL;
+#endif
+  if (recompiled) {
+    invaders_cpu_run_blocks(si, count);
+  } else if (si->engine != INVADERS_ENGINE_INTERPRETER) {
+    while (c->cyc < count) {
+      STEP(c, invaders_cpu_step(si));
+    }
+  } else {
+    while (c->cyc < count) {
+      STEP(c, i8080_step(c));
+    }
+  }
+  si->cycles += c->cyc;
+  c->cyc = 0;
+  INSTRUMENT_END(INVADERS_STAGE_CPU, start);
+}
+
+// runs the machine until cycle `deadline`, firing the events on the way:
+// the cpu runs uninterrupted from one event to the next.
+static void run_until(invaders* const si, uint64_t deadline) {
+  for (;;) {
+    int next = 0;
+    for (int e = 1; e < INVADERS_EVENT_COUNT; e++) {
+      if (si->events[e] < si->events[next]) {
+        next = e;
       }
-      si->next_interrupt = si->next_interrupt == 0xcf ? 0xd7 : 0xcf;
     }
+
+    if (si->events[next] <= si->cycles) {
+      fire_event(si, next);
+      continue;
+    }
+    if (si->cycles >= deadline) {
+      return;
+    }
+    const uint64_t stop =
+        si->events[next] < deadline ? si->events[next] : deadline;
+    run_cpu(si, stop - si->cycles);
   }
 }
 
-// updates the screen buffer according to what is in the video ram
-void invaders_gpu_update(invaders* const si) {
+// advances emulation for `ms` milliseconds.
+void invaders_update(invaders* const si, int ms) {
+  // machine executes exactly CLOCK_SPEED cycles every second: the fractions
+  // of cycles and the cycles run past the end of an update are carried over
+  // to the next one.
+  si->clock_debt += (int64_t) ms * CLOCK_SPEED;
+  if (si->clock_debt < 1000) {
+    return;
+  }
+
+  const uint64_t start = si->cycles;
+  run_until(si, start + si->clock_debt / 1000);
+  si->clock_debt -= (int64_t) (si->cycles - start) * 1000;
+}
+
+// samples the machine with `p` (NULL to stop), every period of `p` from now
+void invaders_set_profiler(invaders* const si, invaders_profiler* const p) {
+  si->profiler = p;
+  si->events[INVADERS_EVENT_SAMPLE] =
+      p != NULL ? si->cycles + p->period : UINT64_MAX;
+}
+
+// advances emulation by `count` frames: returns right after the
+// `count`-th vblank interrupt has been requested.
+void invaders_run_frames(invaders* const si, int count) {
+  for (int i = 0; i < count; i++) {
+    run_until(si, si->events[INVADERS_EVENT_VBLANK]);
+  }
+}
+
+// colours of the overlay, one row of the rotated screen for each zone
+enum { OVERLAY_WHITE, OVERLAY_RED, OVERLAY_GREEN, OVERLAY_BOTTOM };
+
+#define W {255, 255, 255, 0}
+#define R {255, 0, 0, 0}
+#define G {0, 255, 0, 0}
+#define X8(...) __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, \
+    __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__
+#define X56(...) X8(__VA_ARGS__), X8(__VA_ARGS__), X8(__VA_ARGS__), \
+    X8(__VA_ARGS__), X8(__VA_ARGS__), X8(__VA_ARGS__), X8(__VA_ARGS__)
+#define X224(...) X56(__VA_ARGS__), X56(__VA_ARGS__), X56(__VA_ARGS__), \
+    X56(__VA_ARGS__)
+
+static const uint8_t OVERLAY[4][SCREEN_WIDTH][4] = {
+    {X224(W)},
+    {X224(R)},
+    {X224(G)},
+    // white on the first 16 and last 89 pixels (the lives area), green
+    // in between:
+    {X8(W), X8(W), X56(G), X56(G), G, G, G, G, G, G, G, W, X56(W), X8(W),
+        X8(W), X8(W), X8(W)},
+};
+
+#undef X224
+#undef X56
+#undef X8
+#undef G
+#undef R
+#undef W
+
+// returns the zone of the overlay for a row of the rotated screen
+static inline int overlay_row(int row) {
+  const int px = SCREEN_HEIGHT - 1 - row; // x coordinate before rotation
+  if (px < 16) {
+    return OVERLAY_BOTTOM;
+  } else if (px <= 16 + 56) {
+    return OVERLAY_GREEN;
+  } else if (px >= 16 + 56 + 120 && px < 16 + 56 + 120 + 32) {
+    return OVERLAY_RED;
+  }
+  return OVERLAY_WHITE;
+}
+
+// PIXEL_MASKS[b][i] is 0xFFFFFFFF if bit i of b is set, 0 otherwise
+#define M(b, i) (((b) >> (i)) & 1 ? 0xFFFFFFFF : 0)
+#define M8(b) {M(b, 0), M(b, 1), M(b, 2), M(b, 3), M(b, 4), M(b, 5), M(b, 6), M(b, 7)}
+#define M4(b) M8(b), M8(b + 1), M8(b + 2), M8(b + 3)
+#define M16(b) M4(b), M4(b + 4), M4(b + 8), M4(b + 12)
+#define M64(b) M16(b), M16(b + 16), M16(b + 32), M16(b + 48)
+
+static const uint32_t PIXEL_MASKS[256][8] = {
+    M64(0), M64(64), M64(128), M64(192)};
+
+#undef M64
+#undef M16
+#undef M4
+#undef M8
+#undef M
+
+// transposes a 8x8 bit matrix (one row per byte): bit i of byte j becomes
+// bit j of byte i
+static inline uint64_t transpose_tile(uint64_t x) {
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+// the 8x8 pixels of the screen in bytes `col` of the lines [line, line + 8[
+// of vram: byte i holds the pixels of row SCREEN_HEIGHT - 1 - (col * 8 + i)
+// of the screen, the leftmost in bit 0
+static inline uint64_t load_tile(const uint8_t* vram, int line, int col) {
+  uint64_t tile = 0;
+  for (int k = 0; k < 8; k++) {
+    tile |= (uint64_t) vram[(line + k) * 32 + col] << (8 * k);
+  }
+  return transpose_tile(tile);
+}
+
+// writes 8 RGBA pixels: the overlay colours where the mask is set, black
+// elsewhere
+static inline void draw_pixels(
+    uint8_t dst[][4], const uint32_t mask[8], const uint8_t colour[][4]) {
+#if defined(__AVX2__)
+  const __m256i m = _mm256_loadu_si256((const __m256i*) mask);
+  const __m256i c = _mm256_loadu_si256((const __m256i*) colour);
+  _mm256_storeu_si256((__m256i*) dst, _mm256_and_si256(m, c));
+#elif defined(__SSE2__)
+  for (int i = 0; i < 8; i += 4) {
+    const __m128i m = _mm_loadu_si128((const __m128i*) &mask[i]);
+    const __m128i c = _mm_loadu_si128((const __m128i*) colour[i]);
+    _mm_storeu_si128((__m128i*) dst[i], _mm_and_si128(m, c));
+  }
+#else
+  uint32_t pixels[8];
+  memcpy(pixels, colour, sizeof pixels);
+  for (int i = 0; i < 8; i++) {
+    pixels[i] &= mask[i];
+  }
+  memcpy(dst, pixels, sizeof pixels);
+#endif
+}
+
+// draws the tiles of `tiles` (one bit per tile of 8 lines of vram, ie. 8
+// columns of the screen) in an rgba screen buffer
+static void render_tiles(invaders* const si,
+    uint8_t (*const screen)[SCREEN_WIDTH][4], uint32_t tiles) {
   // the screen is 256 * 224 pixels, and is rotated anti-clockwise.
   // these are the overlay dimensions:
   // ,_______________________________.
@@ -227,56 +545,205 @@ void invaders_gpu_update(invaders* const si) {
   // |WHITE|          |         WHITE|
   // `-------------------------------'
 
-  // the screen is 256 * 224 pixels, and 1 byte contains 8 pixels
-  for (int i = 0; i < 256 * 224 / 8; i++) {
-    const int y = i * 8 / 256;
-    const int base_x = (i * 8) % 256;
-    const uint8_t cur_byte = si->memory[VRAM_ADDR + i];
-
-    for (uint8_t bit = 0; bit < 8; bit++) {
-      int px = base_x + bit;
-      int py = y;
-      const bool is_pixel_lit = (cur_byte >> bit) & 1;
-      uint8_t r = 0, g = 0, b = 0;
-
-      // colour handling:
-      if (!si->colored_screen && is_pixel_lit) {
-        r = 255;
-        g = 255;
-        b = 255;
-      } else if (si->colored_screen && is_pixel_lit) {
-        if (px < 16) {
-          if (py < 16 || py > 118 + 16) {
-            r = 255;
-            g = 255;
-            b = 255;
+  // the screen is 256 * 224 pixels, and 1 byte contains 8 pixels.
+  // Once rotated, a byte of vram is a vertical strip of 8 pixels, so we
+  // render the screen by tiles of 8x8 pixels: the 8 bytes of a tile
+  // (8 consecutive lines of vram) are transposed so that each byte holds
+  // the 8 pixels of a row of the rotated screen, that are then expanded
+  // with PIXEL_MASKS and coloured with the overlay.
+  const uint8_t* const vram = invaders_get_vram(si);
+
+  for (int col = 0; col < 256 / 8; col++) {
+    for (int line = 0; line < SCREEN_WIDTH; line += 8) {
+      if (!((tiles >> (line / 8)) & 1)) {
+        continue;
+      }
+
+      const uint64_t tile = load_tile(vram, line, col);
+      for (int bit = 0; bit < 8; bit++) {
+        // space invaders' screen is rotated 90 degrees anti-clockwise
+        const int row = SCREEN_HEIGHT - 1 - (col * 8 + bit);
+        const uint8_t pixels = (tile >> (8 * bit)) & 0xFF;
+        const uint8_t(*overlay)[4] = si->colored_screen
+                                         ? OVERLAY[overlay_row(row)]
+                                         : OVERLAY[OVERLAY_WHITE];
+
+        draw_pixels(&screen[row][line], PIXEL_MASKS[pixels], &overlay[line]);
+      }
+    }
+  }
+}
+
+// the tiles covering the columns [x0, x1[ of the screen
+static uint32_t range_tiles(int x0, int x1) {
+  uint32_t tiles = 0;
+  for (int line = x0 < 0 ? 0 : x0; line < x1 && line < SCREEN_WIDTH;
+       line++) {
+    tiles |= 1u << (line / 8);
+  }
+  return tiles;
+}
+
+// draws the columns [x0, x1[ of the screen, as it is in the video ram, in
+// an rgba buffer of the caller (the columns are drawn by groups of 8, so a
+// few columns around the range may be drawn too)
+void invaders_render_screen(invaders* const si,
+    uint8_t (*const screen)[SCREEN_WIDTH][4], int x0, int x1) {
+  render_tiles(si, screen, range_tiles(x0, x1));
+}
+
+// PACKED_MASKS[n][i] has all its bits set if bit i of n is set: the masks of
+// 4 pixels, by the size of the pixels (1 or 2 bytes)
+#define M(n, i, all) (((n) >> (i)) & 1 ? (all) : 0)
+#define M4(n, all) {M(n, 0, all), M(n, 1, all), M(n, 2, all), M(n, 3, all)}
+#define M16(all)                                                            \
+  {M4(0, all), M4(1, all), M4(2, all), M4(3, all), M4(4, all), M4(5, all),  \
+      M4(6, all), M4(7, all), M4(8, all), M4(9, all), M4(10, all),          \
+      M4(11, all), M4(12, all), M4(13, all), M4(14, all), M4(15, all)}
+
+static const uint8_t PACKED_MASKS8[16][4] = M16(0xFF);
+static const uint16_t PACKED_MASKS16[16][4] = M16(0xFFFF);
+
+#undef M16
+#undef M4
+#undef M
+
+// draws the tiles of `tiles` in a screen buffer of `size` bytes per pixel
+// (1 or 2), with the colours of `palette` (INVADERS_COLOUR_*) on the lit
+// pixels and 0 elsewhere. The pixels are handled 4 at a time, as integers
+// in memory order.
+static inline void render_tiles_packed(invaders* const si, uint8_t* screen,
+    int size, uint32_t tiles, const uint16_t* palette) {
+  if (tiles == 0) {
+    return;
+  }
+
+  // the overlay in the format of the screen, by zone
+  uint8_t overlay[4][SCREEN_WIDTH * 2];
+  for (int zone = 0; zone < 4; zone++) {
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+      const uint8_t* const rgba =
+          OVERLAY[si->colored_screen ? zone : OVERLAY_WHITE][x];
+      const uint16_t colour = palette[rgba[1] == 0   ? INVADERS_COLOUR_RED
+                                      : rgba[0] == 0 ? INVADERS_COLOUR_GREEN
+                                                     : INVADERS_COLOUR_WHITE];
+      if (size == 1) {
+        overlay[zone][x] = colour;
+      } else {
+        memcpy(&overlay[zone][x * 2], &colour, 2);
+      }
+    }
+  }
+
+  const uint8_t* const vram = invaders_get_vram(si);
+  for (int col = 0; col < 256 / 8; col++) {
+    for (int line = 0; line < SCREEN_WIDTH; line += 8) {
+      if (!((tiles >> (line / 8)) & 1)) {
+        continue;
+      }
+
+      const uint64_t tile = load_tile(vram, line, col);
+      for (int bit = 0; bit < 8; bit++) {
+        const int row = SCREEN_HEIGHT - 1 - (col * 8 + bit);
+        const uint8_t pixels = (tile >> (8 * bit)) & 0xFF;
+        const uint8_t* const colours = &overlay[overlay_row(row)][line * size];
+        uint8_t* const dst = &screen[(row * SCREEN_WIDTH + line) * size];
+
+        for (int half = 0; half < 2; half++) {
+          const int n = (pixels >> (4 * half)) & 0xF;
+          if (size == 1) {
+            uint32_t mask, colour;
+            memcpy(&mask, PACKED_MASKS8[n], 4);
+            memcpy(&colour, &colours[half * 4], 4);
+            colour &= mask;
+            memcpy(&dst[half * 4], &colour, 4);
           } else {
-            g = 255;
+            uint64_t mask, colour;
+            memcpy(&mask, PACKED_MASKS16[n], 8);
+            memcpy(&colour, &colours[half * 8], 8);
+            colour &= mask;
+            memcpy(&dst[half * 8], &colour, 8);
           }
-        } else if (px >= 16 && px <= 16 + 56) {
-          g = 255;
-        } else if (px >= 16 + 56 + 120 && px < 16 + 56 + 120 + 32) {
-          r = 255;
-        } else {
-          r = 255;
-          g = 255;
-          b = 255;
         }
       }
+    }
+  }
+}
+
+// draws the columns [x0, x1[ of the screen, as it is in the video ram, in a
+// buffer of the caller of 2 bytes per pixel (eg. RGB565), with the colours
+// of `palette` (INVADERS_COLOUR_*) and 0 as black. The columns are drawn
+// by groups of 8, as with invaders_render_screen.
+void invaders_render_screen16(invaders* const si,
+    uint16_t (*const screen)[SCREEN_WIDTH], int x0, int x1,
+    const uint16_t palette[INVADERS_COLOUR_COUNT]) {
+  render_tiles_packed(
+      si, (uint8_t*) screen, 2, range_tiles(x0, x1), palette);
+}
+
+// same as invaders_render_screen16, with 1 byte per pixel (eg. RGB332)
+void invaders_render_screen8(invaders* const si,
+    uint8_t (*const screen)[SCREEN_WIDTH], int x0, int x1,
+    const uint8_t palette[INVADERS_COLOUR_COUNT]) {
+  uint16_t colours[INVADERS_COLOUR_COUNT];
+  for (int i = 0; i < INVADERS_COLOUR_COUNT; i++) {
+    colours[i] = palette[i];
+  }
+  render_tiles_packed(si, &screen[0][0], 1, range_tiles(x0, x1), colours);
+}
+
+// draws the screen, as it is in the video ram, in a bitmap of 1 bit per
+// pixel: 8 pixels per byte, the leftmost in bit 0
+void invaders_render_bitmap(
+    invaders* const si, uint8_t (*const bitmap)[SCREEN_WIDTH / 8]) {
+  const uint8_t* const vram = invaders_get_vram(si);
+  for (int col = 0; col < 256 / 8; col++) {
+    for (int line = 0; line < SCREEN_WIDTH; line += 8) {
+      const uint64_t tile = load_tile(vram, line, col);
+      for (int bit = 0; bit < 8; bit++) {
+        const int row = SCREEN_HEIGHT - 1 - (col * 8 + bit);
+        bitmap[row][line / 8] = (tile >> (8 * bit)) & 0xFF;
+      }
+    }
+  }
+}
 
-      // space invaders' screen is rotated 90 degrees anti-clockwise
-      // so we invert the coordinates:
-      const int temp_x = px;
-      px = py;
-      py = -temp_x + SCREEN_HEIGHT - 1;
+// updates the screen buffer according to what is in the video ram: only the
+// tiles containing lines of vram that have been written to since the last
+// update are rendered. With INVADERS_COMPACT_SCREEN (or skip_screen_buffer),
+// there is no screen buffer to render, only the changed columns are computed.
+void invaders_gpu_update(invaders* const si) {
+  if (si->colored_screen != si->rendered_colored_screen) {
+    invaders_invalidate_screen(si);
+    si->rendered_colored_screen = si->colored_screen;
+  }
 
-      si->screen_buffer[py][px][0] = r;
-      si->screen_buffer[py][px][1] = g;
-      si->screen_buffer[py][px][2] = b;
+  // one bit per tile of 8 lines
+  uint32_t dirty_tiles = 0;
+  si->dirty_x0 = SCREEN_WIDTH;
+  si->dirty_x1 = 0;
+  for (int line = 0; line < SCREEN_WIDTH; line++) {
+    if ((si->dirty_lines[line / 32] >> (line % 32)) & 1) {
+      dirty_tiles |= 1u << (line / 8);
+      si->dirty_x0 = line < si->dirty_x0 ? line : si->dirty_x0;
+      si->dirty_x1 = line + 1;
     }
   }
+  memset(si->dirty_lines, 0, sizeof si->dirty_lines);
 
-  si->update_screen(si);
+  if (dirty_tiles == 0) {
+    return;
+  }
+
+#ifndef INVADERS_COMPACT_SCREEN
+  if (!si->skip_screen_buffer) {
+    render_tiles(si, si->screen_buffer, dirty_tiles);
+  }
+#endif
+
+  if (si->update_screen != NULL) {
+    si->update_screen(si);
+  }
 }
 
 void invaders_play_sound(invaders* const si, uint8_t bank) {
@@ -323,46 +790,78 @@ void invaders_play_sound(invaders* const si, uint8_t bank) {
     }
   }
 
-  if (sound_to_play != -1 && si->sounds[sound_to_play] != NULL) {
-    NMIX_Play(si->sounds[sound_to_play]->source);
+  if (sound_to_play != -1 && si->play_sound != NULL) {
+    si->play_sound(si, sound_to_play);
   }
 }
 
+// clears the rom
+void invaders_rom_init(invaders_rom* const rom) {
+  memset(rom->storage, 0, sizeof rom->storage);
+  rom->data = rom->storage;
+  invaders_cpu_decode(rom);
+}
+
+// uses the ROM_SIZE bytes at `data` as the rom, without copying them: they
+// must stay valid and writable (see invaders_set_hiscore) as long as the
+// rom is used. The machines initialised with this rom before the call have
+// to be remapped with invaders_map_memory.
+void invaders_rom_map(invaders_rom* const rom, uint8_t* data) {
+  rom->data = data;
+  invaders_cpu_decode(rom);
+}
+
 // loads up a rom file at a specific address in memory (start_addr)
-int invaders_load_rom(
-    invaders* const si, const char* filename, uint16_t start_addr) {
-  SDL_RWops* f = SDL_RWFromFile(filename, "rb");
+int invaders_rom_load(
+    invaders_rom* const rom, const char* filename, uint16_t start_addr) {
+  FILE* f = fopen(filename, "rb");
   if (f == NULL) {
-    SDL_LogCritical(
-        SDL_LOG_CATEGORY_APPLICATION, "can't open rom file %s", filename);
-    SDL_ShowSimpleMessageBox(
-        SDL_MESSAGEBOX_ERROR, "Invaders error", "can't open rom file", NULL);
+    fprintf(stderr, "error: can't open rom file %s\n", filename);
     return 1;
   }
 
-  Sint64 file_size = SDL_RWsize(f);
+  // one extra byte so that oversized files are detected
+  uint8_t buffer[0x800 + 1];
+  size_t file_size = fread(buffer, 1, sizeof buffer, f);
+  fclose(f);
 
-  if (file_size > 0x800) {
-    SDL_LogCritical(SDL_LOG_CATEGORY_APPLICATION,
-        "rom file '%s' is too big to fit in memory", filename);
-    SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Invaders error",
-        "rom file is too big to fit in memory", NULL);
+  if (invaders_rom_load_mem(rom, buffer, file_size, start_addr) != 0) {
+    fprintf(stderr, "error: rom file '%s' could not be loaded\n", filename);
     return 1;
   }
+  return 0;
+}
 
-  SDL_RWread(f, &si->memory[start_addr], 1, file_size);
+// copies a rom chunk of `size` bytes to a specific address in memory
+int invaders_rom_load_mem(invaders_rom* const rom, const uint8_t* data,
+    size_t size, uint16_t start_addr) {
+  if (size > 0x800 || start_addr + size > ROM_SIZE) {
+    fprintf(stderr, "error: rom chunk is too big to fit in memory\n");
+    return 1;
+  }
 
-  SDL_RWclose(f);
+  memcpy(&rom->data[start_addr], data, size);
+  invaders_cpu_decode(rom);
   return 0;
 }
 
+// forces the whole screen to be rendered at the next screen update
+void invaders_invalidate_screen(invaders* const si) {
+  memset(si->dirty_lines, 0xFF, sizeof si->dirty_lines);
+}
+
+// returns the 7 KB of video ram: 224 lines of 32 bytes, 1 bit per pixel
+const uint8_t* invaders_get_vram(invaders* const si) {
+  return &si->ram[VRAM_ADDR - RAM_ADDR];
+}
+
 void invaders_get_hiscore(invaders* const si, uint8_t* value) {
   // scores are stored in RAM at 0x20F4 (high), 0x20F8 (P1) and 0x20FC (P2)
   // (two bytes each)
 
   const uint16_t SCORE_ADDR = 0x20F4;
-  value[0] = si->memory[SCORE_ADDR + 0];
-  value[1] = si->memory[SCORE_ADDR + 1];
+  value[0] = si->ram[SCORE_ADDR - RAM_ADDR + 0];
+  value[1] = si->ram[SCORE_ADDR - RAM_ADDR + 1];
 }
 
 void invaders_set_hiscore(invaders* const si, uint8_t value[2]) {
@@ -370,8 +869,168 @@ void invaders_set_hiscore(invaders* const si, uint8_t value[2]) {
   // copies memory from $1B00-$1BBF (rom) to $2000-$20BF,
   // so we need to update this location in memory instead of 0x20F4.
   // see http://computerarcheology.com/Arcade/SpaceInvaders/Code.html
+  //
+  // note: this patches the rom, that may be shared with other machines.
 
   const uint16_t SCORE_ADDR = 0x1BF4;
-  si->memory[SCORE_ADDR + 0] = value[0];
-  si->memory[SCORE_ADDR + 1] = value[1];
+  si->rom->data[SCORE_ADDR + 0] = value[0];
+  si->rom->data[SCORE_ADDR + 1] = value[1];
+  invaders_cpu_decode(si->rom);
+}
+
+// savestate layout (little endian), see INVADERS_STATE_SIZE:
+//   0  "INVS" magic
+//   4  version
+//   5  cpu: pc, sp (2 bytes each), a, b, c, d, e, h, l, flags (see below),
+//      interrupt vector, interrupt delay
+//  19  cycles since init (8 bytes), the scheduled events are derived from it
+//  27  shift msb, lsb & offset, last out port 3 & 5
+//  32  frame count (4 bytes)
+//  36  ram (0x2000-0x3FFF)
+//
+// version 1 stored a cycle count of the current half frame (4 bytes) after
+// the interrupt delay, and the next interrupt to request before the shift
+// registers.
+#define INVADERS_STATE_V1_SIZE (33 + RAM_SIZE)
+
+static inline void put16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+static inline void put32(uint8_t* p, uint32_t v) {
+  put16(p, v & 0xFFFF);
+  put16(p + 2, v >> 16);
+}
+
+static inline void put64(uint8_t* p, uint64_t v) {
+  put32(p, v & 0xFFFFFFFF);
+  put32(p + 4, v >> 32);
+}
+
+static inline uint16_t get16(const uint8_t* p) {
+  return p[0] | p[1] << 8;
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+  return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+static inline uint64_t get64(const uint8_t* p) {
+  return get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+// writes the state of the machine to `buffer` (INVADERS_STATE_SIZE bytes).
+// The rom, the inputs and the screen buffer are not part of the state.
+void invaders_save_state(invaders* const si, uint8_t* buffer) {
+  const i8080* const c = &si->cpu;
+  uint8_t* p = buffer;
+
+  memcpy(p, "INVS", 4);
+  p[4] = INVADERS_STATE_VERSION;
+  p += 5;
+
+  put16(p, c->pc);
+  put16(p + 2, c->sp);
+  p[4] = c->a;
+  p[5] = c->b;
+  p[6] = c->c;
+  p[7] = c->d;
+  p[8] = c->e;
+  p[9] = c->h;
+  p[10] = c->l;
+  p[11] = c->sf << 7 | c->zf << 6 | c->hf << 5 | c->pf << 4 | c->cf << 3 |
+          c->iff << 2 | c->halted << 1 | c->interrupt_pending;
+  p[12] = c->interrupt_vector;
+  p[13] = c->interrupt_delay;
+  put64(p + 14, si->cycles);
+  p += 22;
+
+  p[0] = si->shift_msb;
+  p[1] = si->shift_lsb;
+  p[2] = si->shift_offset;
+  p[3] = si->last_out_port3;
+  p[4] = si->last_out_port5;
+  put32(p + 5, si->frame_count);
+  p += 9;
+
+  memcpy(p, si->ram, RAM_SIZE);
+}
+
+// restores a state written by invaders_save_state, returns 0 on success
+int invaders_load_state(
+    invaders* const si, const uint8_t* buffer, size_t size) {
+  if (size < 5 || memcmp(buffer, "INVS", 4) != 0) {
+    fprintf(stderr, "error: invalid savestate\n");
+    return 1;
+  }
+  const int version = buffer[4];
+  if (version != 1 && version != INVADERS_STATE_VERSION) {
+    fprintf(stderr, "error: unsupported savestate version %d\n", version);
+    return 1;
+  }
+  if (size != (version == 1 ? INVADERS_STATE_V1_SIZE : INVADERS_STATE_SIZE)) {
+    fprintf(stderr, "error: invalid savestate\n");
+    return 1;
+  }
+
+  i8080* const c = &si->cpu;
+  const uint8_t* p = buffer + 5;
+
+  c->pc = get16(p);
+  c->sp = get16(p + 2);
+  c->a = p[4];
+  c->b = p[5];
+  c->c = p[6];
+  c->d = p[7];
+  c->e = p[8];
+  c->h = p[9];
+  c->l = p[10];
+  c->sf = (p[11] >> 7) & 1;
+  c->zf = (p[11] >> 6) & 1;
+  c->hf = (p[11] >> 5) & 1;
+  c->pf = (p[11] >> 4) & 1;
+  c->cf = (p[11] >> 3) & 1;
+  c->iff = (p[11] >> 2) & 1;
+  c->halted = (p[11] >> 1) & 1;
+  c->interrupt_pending = p[11] & 1;
+  c->interrupt_vector = p[12];
+  c->interrupt_delay = p[13];
+  c->cyc = 0;
+
+  if (version == 1) {
+    // places the machine in a frame so that the next interrupt is
+    // requested after the same number of cycles
+    const uint32_t half_frame_cycles = get32(p + 14);
+    const int event = p[18] == 0xcf ? INVADERS_EVENT_MID_SCREEN
+                                    : INVADERS_EVENT_VBLANK;
+    uint32_t remaining = 1;
+    if (half_frame_cycles < CYCLES_PER_FRAME / 2) {
+      remaining = CYCLES_PER_FRAME / 2 - half_frame_cycles;
+    }
+    si->frame_count = get32(p + 24);
+    const uint64_t deadline =
+        (uint64_t) si->frame_count * CYCLES_PER_FRAME +
+        EVENT_LINES[event] * CYCLES_PER_LINE;
+    // a half frame of version 1 is longer than the start of frame 0 before
+    // the first interrupt: the states saved there start at cycle 0
+    si->cycles = remaining < deadline ? deadline - remaining : 0;
+    p += 19;
+  } else {
+    si->cycles = get64(p + 14);
+    si->frame_count = get32(p + 27);
+    p += 22;
+  }
+
+  si->shift_msb = p[0];
+  si->shift_lsb = p[1];
+  si->shift_offset = p[2];
+  si->last_out_port3 = p[3];
+  si->last_out_port5 = p[4];
+  p += 9;
+
+  memcpy(si->ram, p, RAM_SIZE);
+  schedule_events(si);
+  invaders_invalidate_screen(si);
+  return 0;
 }
@@ -1,11 +1,10 @@
 #ifndef INVADERS_INVADERS_H
 #define INVADERS_INVADERS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
-#include <SDL.h>
-
-#include "SDL_nmix.h"
-#include "SDL_nmix_file.h"
 
 #include "8080/i8080.h"
 
@@ -13,39 +12,222 @@
 #define SCREEN_HEIGHT 256
 #define FPS 59.541985
 #define CLOCK_SPEED 1996800
-#define CYCLES_PER_FRAME (CLOCK_SPEED / FPS)
+#define CYCLES_PER_LINE 128
+#define LINES_PER_FRAME 262
+#define CYCLES_PER_FRAME (CYCLES_PER_LINE * LINES_PER_FRAME) // CLOCK_SPEED / FPS
 
+#define ROM_SIZE 0x2000
+#define RAM_ADDR 0x2000
+#define RAM_SIZE 0x2000
 #define VRAM_ADDR 0x2400
+#define VRAM_SIZE 0x1C00
+
+#define INVADERS_STATE_VERSION 2
+#define INVADERS_STATE_SIZE (36 + RAM_SIZE)
+
+// sounds triggered by the game on ports 3 and 5, passed to `play_sound`
+enum {
+  INVADERS_SOUND_UFO, // port 3, bit 0
+  INVADERS_SOUND_SHOOT, // port 3, bit 1
+  INVADERS_SOUND_PLAYER_DIE, // port 3, bit 2
+  INVADERS_SOUND_ALIEN_DIE, // port 3, bit 3
+  INVADERS_SOUND_FLEET1, // port 5, bit 0
+  INVADERS_SOUND_FLEET2, // port 5, bit 1
+  INVADERS_SOUND_FLEET3, // port 5, bit 2
+  INVADERS_SOUND_FLEET4, // port 5, bit 3
+  INVADERS_SOUND_UFO_HIT, // port 5, bit 4
+  INVADERS_SOUND_COUNT
+};
+
+// flags of the pages of the memory map, see `page_flags` below
+enum {
+  INVADERS_PAGE_READONLY = 1 << 0, // writes are ignored
+  INVADERS_PAGE_MIRROR = 1 << 1, // page mirrored from another address
+  INVADERS_PAGE_VRAM = 1 << 2, // writes mark the screen lines as dirty
+};
+
+// events of the scheduler, at a fixed line of every frame
+enum {
+  INVADERS_EVENT_MID_SCREEN, // line 96: RST 8
+  INVADERS_EVENT_VBLANK, // line 224: RST 10, screen update
+  INVADERS_EVENT_SAMPLE, // every period of the profiler, if any
+  INVADERS_EVENT_COUNT
+};
+
+// colours of the lit pixels (through the overlay), see
+// invaders_render_screen16
+enum {
+  INVADERS_COLOUR_WHITE,
+  INVADERS_COLOUR_RED,
+  INVADERS_COLOUR_GREEN,
+  INVADERS_COLOUR_COUNT
+};
+
+// execution engines, see `engine` below
+enum {
+  INVADERS_ENGINE_INTERPRETER, // i8080_step for every instruction
+  INVADERS_ENGINE_THREADED, // predecoded rom instructions (see cpu.c)
+  INVADERS_ENGINE_RECOMPILED, // rom translated to C ahead of time, in
+                              // builds with INVADERS_RECOMPILED (see
+                              // tools/recompile.c), threaded otherwise
+};
 
 typedef struct invaders invaders;
+typedef struct invaders_profiler invaders_profiler;
+
+// an instruction of the rom, decoded once when the rom is loaded
+typedef struct invaders_insn invaders_insn;
+struct invaders_insn {
+  // NULL if the instruction must be run by i8080_step
+  void (*exec)(invaders* const si, const invaders_insn* const insn);
+  uint16_t imm; // immediate operand (1 or 2 bytes)
+  uint8_t cycles;
+  uint8_t size;
+};
+
+// a basic block of the rom translated to C, run as a whole
+typedef struct invaders_block invaders_block;
+struct invaders_block {
+  void (*run)(invaders* const si); // NULL if no block starts there
+  uint16_t lead; // cycles of the block before its last instruction
+};
+
+// the 8 KB of rom (0x0000-0x1FFF), that can be shared by several machines
+typedef struct invaders_rom invaders_rom;
+struct invaders_rom {
+  uint8_t* data; // ROM_SIZE bytes: `storage`, or memory given to
+                 // invaders_rom_map (eg. a mapped asset archive)
+  uint8_t storage[ROM_SIZE];
+  invaders_insn code[ROM_SIZE]; // one decoded instruction per address
+  // blocks of the recompiled rom by address, NULL if the build has none or
+  // if they were not translated from this rom
+  const invaders_block* blocks;
+};
+
 struct invaders {
   i8080 cpu;
-  uint8_t memory[0x4000];
+  invaders_rom* rom;
+  uint8_t ram[RAM_SIZE]; // 0x2000-0x3FFF (mirrored at 0x4000-0x5FFF)
+  int engine;
+
+  // memory map, by pages of 256 bytes: host memory read by each page, and
+  // host memory written by each page (NULL for the pages that need special
+  // handling on writes, see invaders_write). Points into `ram`, so it has to
+  // be rebuilt by invaders_map_memory if the machine is moved.
+  const uint8_t* read_pages[256];
+  uint8_t* write_pages[256];
+  uint8_t page_flags[256]; // INVADERS_PAGE_*
+
+  // cycles elapsed since init (cpu.cyc is only used inside a run of the
+  // scheduler), and cycle at which each event is next due
+  uint64_t cycles;
+  uint64_t events[INVADERS_EVENT_COUNT];
+  // cycles owed to the host clock by invaders_update, in 1/1000 cycles
+  int64_t clock_debt;
 
-  uint8_t next_interrupt;
   bool colored_screen;
-  NMIX_FileSource* sounds[9];
+  unsigned long frame_count; // number of vblanks since init
 
   // SI-specific ports & shift registers that are used in IN/OUT opcodes
   uint8_t port1, port2;
   uint8_t shift_msb, shift_lsb, shift_offset;
   uint8_t last_out_port3, last_out_port5;
 
-  // screen pixel buffer
+#ifndef INVADERS_COMPACT_SCREEN
+  // screen pixel buffer (rgba). Built with INVADERS_COMPACT_SCREEN, the
+  // machine has none: the screen is only in the video ram (1 bit per pixel)
+  // and is drawn by invaders_render_screen in a buffer of the caller
   uint8_t screen_buffer[SCREEN_HEIGHT][SCREEN_WIDTH][4];
+#endif
+  // lines of vram (= columns of the screen) written since the last screen
+  // update, one bit per line
+  uint32_t dirty_lines[SCREEN_WIDTH / 32];
+  bool rendered_colored_screen;
+  // when set, the screen is not rendered at vblank: vram changes accumulate
+  // in `dirty_lines` until invaders_gpu_update is called
+  bool skip_render;
+  // when set, invaders_gpu_update only finds the changed columns and leaves
+  // the screen buffer as it is, for the frontends drawing the screen from
+  // the video ram (see invaders_render_screen16). Once cleared, the buffer
+  // is stale until invaders_invalidate_screen is called.
+  bool skip_screen_buffer;
+  // columns [dirty_x0, dirty_x1[ of the screen that have been changed by the
+  // last screen update
+  int dirty_x0, dirty_x1;
+
+  // guest profiler sampling the machine, see invaders_set_profiler
+  invaders_profiler* profiler;
+
+  // user provided pointer, untouched by the emulator
+  void* userdata;
   // function pointer provided by the user that will be called every time
-  // the screen must be updated:
+  // the screen has changed (can be NULL):
   void (*update_screen)(invaders* const si);
+  // function pointer provided by the user that will be called every time
+  // the game triggers a sound (one of INVADERS_SOUND_*, can be NULL):
+  void (*play_sound)(invaders* const si, int sound);
+  // function pointer provided by the user that will be called at every
+  // vblank, when a new frame starts (can be NULL): inputs set there are
+  // seen by the game at the same point of every frame
+  void (*frame_start)(invaders* const si);
 };
 
-void invaders_init(invaders* const si);
+void invaders_rom_init(invaders_rom* const rom);
+int invaders_rom_load(
+    invaders_rom* const rom, const char* filename, uint16_t start_addr);
+int invaders_rom_load_mem(invaders_rom* const rom, const uint8_t* data,
+    size_t size, uint16_t start_addr);
+void invaders_rom_map(invaders_rom* const rom, uint8_t* data);
+
+void invaders_init(invaders* const si, invaders_rom* const rom);
+void invaders_fork(invaders* const child, const invaders* const parent);
+void invaders_map_memory(invaders* const si);
+void invaders_write_special(invaders* const si, uint16_t addr, uint8_t val);
 void invaders_update(invaders* const si, int ms);
+void invaders_set_profiler(invaders* const si, invaders_profiler* const p);
+void invaders_run_frames(invaders* const si, int count);
 void invaders_gpu_update(invaders* const si);
+void invaders_render_screen(invaders* const si,
+    uint8_t (*const screen)[SCREEN_WIDTH][4], int x0, int x1);
+void invaders_render_screen16(invaders* const si,
+    uint16_t (*const screen)[SCREEN_WIDTH], int x0, int x1,
+    const uint16_t palette[INVADERS_COLOUR_COUNT]);
+void invaders_render_screen8(invaders* const si,
+    uint8_t (*const screen)[SCREEN_WIDTH], int x0, int x1,
+    const uint8_t palette[INVADERS_COLOUR_COUNT]);
+void invaders_render_bitmap(
+    invaders* const si, uint8_t (*const bitmap)[SCREEN_WIDTH / 8]);
 void invaders_play_sound(invaders* const si, uint8_t bank);
-int invaders_load_rom(
-    invaders* const si, const char* filename, uint16_t start_addr);
+const uint8_t* invaders_get_vram(invaders* const si);
+void invaders_invalidate_screen(invaders* const si);
+
+void invaders_save_state(invaders* const si, uint8_t* buffer);
+int invaders_load_state(
+    invaders* const si, const uint8_t* buffer, size_t size);
 
 void invaders_get_hiscore(invaders* const si, uint8_t* value);
 void invaders_set_hiscore(invaders* const si, uint8_t value[2]);
 
+// current cycle of the machine, also valid inside the callbacks (eg. to
+// timestamp the sounds)
+static inline uint64_t invaders_get_cycles(const invaders* const si) {
+  return si->cycles + si->cpu.cyc;
+}
+
+// memory accesses of the cpu: plain ram and rom pages are read and written
+// directly, only the special pages go through invaders_write_special
+static inline uint8_t invaders_read(invaders* const si, uint16_t addr) {
+  return si->read_pages[addr >> 8][addr & 0xFF];
+}
+
+static inline void invaders_write(
+    invaders* const si, uint16_t addr, uint8_t val) {
+  uint8_t* const page = si->write_pages[addr >> 8];
+  if (page != NULL) {
+    page[addr & 0xFF] = val;
+  } else {
+    invaders_write_special(si, addr, val);
+  }
+}
+
 #endif // INVADERS_INVADERS_H
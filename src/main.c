@@ -3,8 +3,15 @@
 #include <emscripten.h>
 #endif
 
-#include "SDL_nmix.h"
+#include "audio.h"
+#include "instrument.h"
 #include "invaders.h"
+#include "movie.h"
+#include "netplay.h"
+#include "pack.h"
+#include "pacing.h"
+#include "profiler.h"
+#include "video.h"
 
 #define JOYSTICK_DEAD_ZONE 8000
 
@@ -12,6 +19,7 @@
 #define FILE2 "roms/invaders.g"
 #define FILE3 "roms/invaders.f"
 #define FILE4 "roms/invaders.e"
+#define PACK_FILE "roms/invaders.pak"
 #define FILE_TEST1 "roms/invaders_test_rom/Sitest_716.bin"
 #define FILE_TEST2 "roms/test.h"
 
@@ -19,30 +27,410 @@ static SDL_Renderer* renderer = NULL;
 static SDL_Texture* texture = NULL;
 static SDL_Event e;
 
+// formats of the texture, from the most compact: the frames are uploaded
+// in the first one the renderer supports natively (or in the one given by
+// --texture), drawn straight from the video ram in the packed formats
+typedef struct texture_format texture_format;
+struct texture_format {
+  const char* name;
+  Uint32 format; // SDL_PIXELFORMAT_*
+  int frame_format; // INVADERS_VIDEO_*
+};
+static const texture_format TEXTURE_FORMATS[] = {
+    {"rgb332", SDL_PIXELFORMAT_RGB332, INVADERS_VIDEO_PACKED8},
+    {"rgb565", SDL_PIXELFORMAT_RGB565, INVADERS_VIDEO_PACKED16},
+    {"bgr565", SDL_PIXELFORMAT_BGR565, INVADERS_VIDEO_PACKED16},
+    {"rgb555", SDL_PIXELFORMAT_RGB555, INVADERS_VIDEO_PACKED16},
+    {"rgba32", SDL_PIXELFORMAT_RGBA32, INVADERS_VIDEO_RGBA32},
+};
+#define TEXTURE_FORMAT_COUNT \
+  (int) (sizeof TEXTURE_FORMATS / sizeof TEXTURE_FORMATS[0])
+static const texture_format* texture_format_used = NULL; // NULL for auto
+
+// returns if the renderer supports a texture format natively
+static bool supports_format(const SDL_RendererInfo* info, Uint32 format) {
+  for (Uint32 i = 0; i < info->num_texture_formats; i++) {
+    if (info->texture_formats[i] == format) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static invaders_rom rom;
 static invaders si;
 
+// asset archive written by invaders_pack, used in place of the separate
+// rom and sound files when present
+static invaders_pack pack;
+static bool pack_opened = false;
+
 static bool should_quit = false;
-static int speed = 1;
-static uint32_t current_time = 0;
-static uint32_t last_time = 0;
-static uint32_t dt = 0;
 static char* pref_path = NULL;
 
+// inputs set by the events, copied to the machine at the start of every
+// frame
+static uint8_t port1 = 0;
+static uint8_t port2 = 0;
+static bool colored_screen = true;
+
+// the emulation runs on its own thread (but on the web), paced by the host
+// clock: the render thread only sends it the inputs, and presents the
+// frames it publishes
+static SDL_atomic_t latched_inputs; // port1 | port2 << 8 | colored << 16
+static SDL_atomic_t fast_forward; // set while the fast-forward key is held
+#ifdef __EMSCRIPTEN__
+static uint32_t last_time = 0;
+#else
+static SDL_atomic_t emulation_running;
+#endif
+
+// the inputs are numbered every time they change, and the frames tagged
+// with the number of the inputs they were run with, to measure the latency
+// from an input to the first frame presented with it
+#define INPUT_SERIAL_SHIFT 17
+#define INPUT_SERIAL_MASK 0x3FFF
+#define INPUT_HISTORY 64 // power of two
+static int last_inputs = 0;
+static uint32_t input_serial = 0;
+static uint64_t input_times[INPUT_HISTORY];
+static uint32_t presented_serial = 0;
+static uint32_t frame_serial = 0; // of the frame being emulated
+
+// pacing options, and the statistics printed at exit with --stats
+static int max_catchup = 4;
+static bool spin_wait = false;
+static bool print_stats = false;
+
+// guest profiler, written at exit with --profile (see profiler.h)
+#define SAMPLE_PERIOD 1000 // cycles
+static invaders_profiler profiler;
+static const char* profile_path = NULL;
+static const char* symbols_path = NULL;
+
+#ifdef INVADERS_INSTRUMENT
+// instrumented builds print a summary of the counters periodically, and
+// write the trace of the stages at exit with --trace
+#define SUMMARY_PERIOD 5000 // ms
+static uint32_t last_summary = 0;
+static const char* trace_path = NULL;
+#endif
+static invaders_stats frame_times = {.name = "frame time"};
+static invaders_stats input_latencies = {.name = "input to present latency"};
+
+// run-ahead: after every frame, the next `run_ahead` frames are run with
+// the same inputs to present the last of them, then the machine is rolled
+// back. The game reacts to the inputs on screen that many frames earlier.
+#define MAX_RUN_AHEAD 4
+static int run_ahead = 0;
+static bool speculating = false;
+
+// fast-forward: runs `fast_forward_speed` times faster (as fast as possible
+// if 0), rendering only one frame per host frame and without sound, so that
+// nearly all the time goes to the cpu
+#define FAST_FORWARD_BATCH 16 // frames run between checks when unthrottled
+static int fast_forward_speed = 5;
+static bool fast_forwarding = false; // state of the emulation thread
+
+// netplay: the keys only move the local player, the other one is moved by
+// the inputs received from the network, through a rollback session (see
+// netplay.h). Not on the web.
+static invaders_netplay* netplay = NULL;
+static const invaders_rollback* rollback = NULL; // of the session
+static int netplay_player = 0;
+static int netplay_port = 0;
+static const char* netplay_peer = NULL;
+static int netplay_delay = 2;
+
+enum { MOVIE_NONE, MOVIE_RECORD, MOVIE_PLAY };
+static int movie_mode = MOVIE_NONE;
+static const char* movie_path = NULL;
+static invaders_movie movie;
+static bool headless = false;
+
+// indexed by INVADERS_SOUND_*
+static const char* SOUND_FILES[INVADERS_SOUND_COUNT] = {"8.wav", "1.wav",
+    "2.wav", "3.wav", "4.wav", "5.wav", "6.wav", "7.wav", "0.wav"};
+
+static void load_sounds(void) {
+  for (int i = 0; i < INVADERS_SOUND_COUNT; i++) {
+    const invaders_pack_entry* const entry =
+        pack_opened ? invaders_pack_find(&pack, SOUND_FILES[i]) : NULL;
+    if (entry != NULL && entry->type == INVADERS_PACK_PCM) {
+      invaders_audio_load_pcm(
+          i, &pack.data[entry->offset], entry->size, entry->param);
+      continue;
+    }
+
+    char path[32];
+    snprintf(path, sizeof path, "roms/%s", SOUND_FILES[i]);
+    invaders_audio_load(i, path);
+  }
+}
+
+static void play_sound(invaders* const si, int sound) {
+  if (speculating || fast_forwarding ||
+      (rollback != NULL && rollback->replaying)) {
+    return; // played when the frame is run for real, muted in fast-forward
+  }
+  // mixed at the sample matching the cycle of the sound, on the audio thread
+  invaders_audio_play(sound, invaders_get_cycles(si));
+}
+
+static int load_rom(const char* filename, uint16_t start_addr) {
+  if (invaders_rom_load(&rom, filename, start_addr) != 0) {
+    if (!headless) {
+      SDL_ShowSimpleMessageBox(
+          SDL_MESSAGEBOX_ERROR, "Invaders error", "can't load rom file", NULL);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// loads the roms from the asset archive if there is one, else from the
+// separate files. Must be done before invaders_init: the memory of the
+// machine is mapped to the rom.
+static int load_roms(void) {
+  pack_opened = invaders_pack_open(&pack, PACK_FILE) == 0;
+  if (pack_opened && invaders_pack_load_rom(&pack, &rom) == 0) {
+    return 0;
+  }
+  return load_rom(FILE1, 0x0000) || load_rom(FILE2, 0x0800) ||
+         load_rom(FILE3, 0x1000) || load_rom(FILE4, 0x1800);
+}
+
+static void close_pack(void) {
+  if (pack_opened) {
+    invaders_pack_close(&pack);
+    pack_opened = false;
+  }
+}
+
+static void frame_start(invaders* const si) {
+  if (speculating) {
+    return; // keeps the inputs of the frame run ahead of, records nothing
+  }
+
+  const int inputs = SDL_AtomicGet(&latched_inputs);
+  si->colored_screen = (inputs >> 16) & 1;
+  frame_serial = (inputs >> INPUT_SERIAL_SHIFT) & INPUT_SERIAL_MASK;
+  if (netplay != NULL) {
+    return; // the ports are set by the session
+  }
+
+  if (movie_mode == MOVIE_PLAY) {
+    if (invaders_movie_play_frame(&movie, si) != 0 ||
+        invaders_movie_ended(&movie)) {
+      // back to the live inputs
+      SDL_Log("end of movie playback (frame %u)", (unsigned) movie.position);
+      movie_mode = MOVIE_NONE;
+    }
+    return;
+  }
+
+  si->port1 = inputs & 0xFF;
+  si->port2 = (inputs >> 8) & 0xFF;
+  if (movie_mode == MOVIE_RECORD &&
+      invaders_movie_record_frame(&movie, si) != 0) {
+    movie_mode = MOVIE_NONE;
+  }
+}
+
+// plays a movie without window nor sound, as fast as possible
+static int play_headless(void) {
+  invaders_rom_init(&rom);
+  if (load_roms() != 0 || invaders_movie_load(&movie, movie_path) != 0) {
+    return 1;
+  }
+  invaders_init(&si, &rom);
+
+  const int result = invaders_movie_replay(&movie, &si);
+  if (result == 0) {
+    printf("replayed %u frames, ram identical to the recording\n",
+        (unsigned) movie.frame_count);
+  }
+  invaders_movie_free(&movie);
+  close_pack();
+  return result;
+}
+
+#ifdef __EMSCRIPTEN__
+// advances the emulation to the host clock
+static void run_emulation(void) {
+  const uint32_t current_time = SDL_GetTicks();
+  const uint32_t dt = current_time - last_time;
+  // the frames are not stepped one by one here: fast-forward only changes
+  // the speed, and is never unthrottled
+  fast_forwarding = SDL_AtomicGet(&fast_forward);
+  const int speed = !fast_forwarding      ? 1
+                    : fast_forward_speed > 0 ? fast_forward_speed
+                                             : 5;
+  invaders_update(&si, dt * speed);
+  invaders_audio_sync(invaders_get_cycles(&si));
+  last_time = current_time;
+}
+#else
+// runs one frame, and presents it or the frame `run_ahead` frames later:
+// frames not presented are not rendered at all
+static void run_frame(bool present) {
+  static uint8_t state[INVADERS_STATE_SIZE];
+  if (netplay != NULL) {
+    // the keys of player 1 move the local player, the frame is not run
+    // while waiting for the inputs of the other one
+    si.skip_render = !present;
+    const uint8_t input = SDL_AtomicGet(&latched_inputs) & 0x77;
+    if (invaders_netplay_frame(netplay, &si, input) < 0) {
+      SDL_Log("netplay stopped, both players are now local");
+      invaders_netplay_close(netplay);
+      netplay = NULL;
+      rollback = NULL;
+    }
+    return;
+  }
+
+  si.skip_render = !present || run_ahead > 0;
+  invaders_run_frames(&si, 1);
+  if (!present || run_ahead == 0) {
+    return;
+  }
+
+  // the frames run ahead are not profiled, they are run again for real
+  invaders_profiler* const p = si.profiler;
+  invaders_set_profiler(&si, NULL);
+  invaders_save_state(&si, state);
+
+  // the lines of vram written by the frames run ahead are kept apart: once
+  // the state is restored, the screen presented only differs from it there
+  uint32_t real_lines[SCREEN_WIDTH / 32];
+  uint32_t ahead_lines[SCREEN_WIDTH / 32];
+  memcpy(real_lines, si.dirty_lines, sizeof real_lines);
+  memset(si.dirty_lines, 0, sizeof si.dirty_lines);
+  speculating = true;
+  invaders_run_frames(&si, run_ahead);
+  speculating = false;
+  memcpy(ahead_lines, si.dirty_lines, sizeof ahead_lines);
+  for (int i = 0; i < SCREEN_WIDTH / 32; i++) {
+    si.dirty_lines[i] |= real_lines[i];
+  }
+  INSTRUMENT_BEGIN(render_start);
+  invaders_gpu_update(&si);
+  INSTRUMENT_END(INVADERS_STAGE_RENDER, render_start);
+
+  // restoring the state invalidates the whole screen
+  invaders_load_state(&si, state, sizeof state);
+  memcpy(si.dirty_lines, ahead_lines, sizeof si.dirty_lines);
+  invaders_set_profiler(&si, p);
+}
+
+// runs the emulation one whole frame at a time, each at the time it is due
+// on the high resolution clock
+static int emulation_thread(void* data) {
+  (void) data;
+  invaders_pacer pacer;
+  invaders_pacer_init(&pacer, max_catchup, spin_wait);
+  const uint64_t frequency = SDL_GetPerformanceFrequency();
+  const double ms_per_tick = 1000.0 / frequency;
+  const uint64_t frame_ticks = frequency * CYCLES_PER_FRAME / CLOCK_SPEED;
+  uint64_t last_present = SDL_GetPerformanceCounter();
+
+  while (SDL_AtomicGet(&emulation_running)) {
+    const bool was_fast_forwarding = fast_forwarding;
+    // both players of a netplay session run at the speed of the game
+    fast_forwarding = SDL_AtomicGet(&fast_forward) && netplay == NULL;
+    const int speed = fast_forwarding ? fast_forward_speed : 1;
+    if (was_fast_forwarding && !fast_forwarding) {
+      invaders_pacer_reset(&pacer);
+    }
+
+    const int frames = speed == 0 ? FAST_FORWARD_BATCH
+                                  : invaders_pacer_frames_due(&pacer, speed);
+    for (int i = 0; i < frames; i++) {
+      // when catching up, only the last frame is presented, and in
+      // fast-forward only one per host frame
+      bool present = i == frames - 1;
+      const uint64_t now = SDL_GetPerformanceCounter();
+      if (fast_forwarding) {
+        present = now - last_present >= frame_ticks;
+      } else if (present) {
+        // the frame time is the interval between two presented frames: the
+        // frames run to catch up are part of the stall they follow
+        invaders_stats_add(&frame_times, (now - last_present) * ms_per_tick);
+      }
+      if (present) {
+        last_present = now;
+      }
+      run_frame(present);
+    }
+    invaders_audio_sync(invaders_get_cycles(&si));
+
+    if (speed == 0) {
+      invaders_pacer_reset(&pacer);
+    } else {
+      invaders_pacer_wait(&pacer, speed);
+    }
+  }
+  return 0;
+}
+#endif
+
 static void update_screen(invaders* const si) {
-  int pitch = 0;
-  void* pixels = NULL;
-  if (SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0) {
-    SDL_Log("Unable to lock texture: %s", SDL_GetError());
-  } else {
-    memcpy(pixels, si->screen_buffer, pitch * SCREEN_HEIGHT);
-  }
-  SDL_UnlockTexture(texture);
+  invaders_video_publish(si, frame_serial);
 }
 
-void mainloop(void) {
-  current_time = SDL_GetTicks();
-  dt = current_time - last_time;
+static int pack_inputs(void) {
+  return port1 | port2 << 8 | (colored_screen ? 1 << 16 : 0);
+}
+
+// sends the inputs to the emulation, numbered when they have changed
+static void latch_inputs(void) {
+  const int inputs = pack_inputs();
+  if (inputs != last_inputs) {
+    last_inputs = inputs;
+    input_serial = (input_serial + 1) & INPUT_SERIAL_MASK;
+    input_times[input_serial % INPUT_HISTORY] = SDL_GetPerformanceCounter();
+  }
+  SDL_AtomicSet(&latched_inputs, inputs | input_serial << INPUT_SERIAL_SHIFT);
+}
 
+// presents the newest frame of the emulation
+static void present_frame(void) {
+  const invaders_frame* const frame = invaders_video_take();
+  if (frame != NULL && frame->x0 < frame->x1) {
+    INSTRUMENT_BEGIN(upload_start);
+    // only uploads the columns that have changed since the last frame
+    const SDL_Rect rect = {frame->x0, 0, frame->x1 - frame->x0, SCREEN_HEIGHT};
+    const void* pixels = &frame->pixels.rgba32[0][frame->x0];
+    int pitch = sizeof frame->pixels.rgba32[0];
+    if (texture_format_used->frame_format == INVADERS_VIDEO_PACKED16) {
+      pixels = &frame->pixels.packed16[0][frame->x0];
+      pitch = sizeof frame->pixels.packed16[0];
+    } else if (texture_format_used->frame_format == INVADERS_VIDEO_PACKED8) {
+      pixels = &frame->pixels.packed8[0][frame->x0];
+      pitch = sizeof frame->pixels.packed8[0];
+    }
+    if (SDL_UpdateTexture(texture, &rect, pixels, pitch) != 0) {
+      SDL_Log("Unable to update texture: %s", SDL_GetError());
+    }
+    INSTRUMENT_END(INVADERS_STAGE_UPLOAD, upload_start);
+  }
+
+  INSTRUMENT_BEGIN(present_start);
+  SDL_RenderClear(renderer);
+  SDL_RenderCopy(renderer, texture, NULL, NULL);
+  SDL_RenderPresent(renderer);
+  INSTRUMENT_END(INVADERS_STAGE_PRESENT, present_start);
+
+  if (frame != NULL && frame->tag != presented_serial) {
+    presented_serial = frame->tag;
+    const uint64_t ticks = SDL_GetPerformanceCounter() -
+                           input_times[presented_serial % INPUT_HISTORY];
+    invaders_stats_add(
+        &input_latencies, ticks * 1000.0 / SDL_GetPerformanceFrequency());
+  }
+}
+
+void mainloop(void) {
   while (SDL_PollEvent(&e) != 0) {
     if (e.type == SDL_QUIT) {
       should_quit = true;
@@ -52,24 +440,24 @@ void mainloop(void) {
     } else if (e.type == SDL_KEYDOWN) {
       SDL_Scancode key = e.key.keysym.scancode;
       if (key == SDL_SCANCODE_C) {
-        si.port1 |= 1 << 0; // coin
+        port1 |= 1 << 0; // coin
       } else if (key == SDL_SCANCODE_2) {
-        si.port1 |= 1 << 1; // P2 start button
+        port1 |= 1 << 1; // P2 start button
       } else if (key == SDL_SCANCODE_RETURN) {
-        si.port1 |= 1 << 2; // P1 start button
+        port1 |= 1 << 2; // P1 start button
       } else if (key == SDL_SCANCODE_SPACE) {
-        si.port1 |= 1 << 4; // P1 shoot button
-        si.port2 |= 1 << 4; // P2 shoot button
+        port1 |= 1 << 4; // P1 shoot button
+        port2 |= 1 << 4; // P2 shoot button
       } else if (key == SDL_SCANCODE_LEFT) {
-        si.port1 |= 1 << 5; // P1 joystick left
-        si.port2 |= 1 << 5; // P2 joystick left
+        port1 |= 1 << 5; // P1 joystick left
+        port2 |= 1 << 5; // P2 joystick left
       } else if (key == SDL_SCANCODE_RIGHT) {
-        si.port1 |= 1 << 6; // P1 joystick right
-        si.port2 |= 1 << 6; // P2 joystick right
+        port1 |= 1 << 6; // P1 joystick right
+        port2 |= 1 << 6; // P2 joystick right
       } else if (key == SDL_SCANCODE_T) {
-        si.port2 |= 1 << 2; // tilt
+        port2 |= 1 << 2; // tilt
       } else if (key == SDL_SCANCODE_F9) { // to toggle between b&w / color
-        si.colored_screen = !si.colored_screen;
+        colored_screen = !colored_screen;
       } else if (key == SDL_SCANCODE_ESCAPE) {
 // allow web users to kill game with esc key
 #ifdef __EMSCRIPTEN__
@@ -78,116 +466,197 @@ void mainloop(void) {
         SDL_PushEvent(&quit_event);
 #endif
       } else if (key == SDL_SCANCODE_TAB) {
-        speed = 5;
+        SDL_AtomicSet(&fast_forward, 1);
       }
     } else if (e.type == SDL_KEYUP) {
       SDL_Scancode key = e.key.keysym.scancode;
       if (key == SDL_SCANCODE_C) {
-        si.port1 &= 0b11111110; // coin
+        port1 &= 0b11111110; // coin
       } else if (key == SDL_SCANCODE_2) {
-        si.port1 &= 0b11111101; // P2 start button
+        port1 &= 0b11111101; // P2 start button
       } else if (key == SDL_SCANCODE_RETURN) {
-        si.port1 &= 0b11111011; // P1 start button
+        port1 &= 0b11111011; // P1 start button
       } else if (key == SDL_SCANCODE_SPACE) {
-        si.port1 &= 0b11101111; // P1 shoot button
-        si.port2 &= 0b11101111; // P2 shoot button
+        port1 &= 0b11101111; // P1 shoot button
+        port2 &= 0b11101111; // P2 shoot button
       } else if (key == SDL_SCANCODE_LEFT) {
-        si.port1 &= 0b11011111; // P1 joystick left
-        si.port2 &= 0b11011111; // P2 joystick left
+        port1 &= 0b11011111; // P1 joystick left
+        port2 &= 0b11011111; // P2 joystick left
       } else if (key == SDL_SCANCODE_RIGHT) {
-        si.port1 &= 0b10111111; // P1 joystick right
-        si.port2 &= 0b10111111; // P2 joystick right
+        port1 &= 0b10111111; // P1 joystick right
+        port2 &= 0b10111111; // P2 joystick right
       } else if (key == SDL_SCANCODE_T) {
-        si.port2 &= 0b11111011; // tilt
+        port2 &= 0b11111011; // tilt
       } else if (key == SDL_SCANCODE_TAB) {
-        speed = 1;
-        // clear the queued audio to avoid audio delays
-        // SDL_ClearQueuedAudio(audio_device); // @TODO
+        SDL_AtomicSet(&fast_forward, 0);
       }
     } else if (e.type == SDL_JOYAXISMOTION) {
       if (e.jaxis.axis == 0) { // x axis
         if (e.jaxis.value < -JOYSTICK_DEAD_ZONE) {
-          si.port1 |= 1 << 5; // P1 joystick left
-          si.port2 |= 1 << 5; // P2 joystick left
+          port1 |= 1 << 5; // P1 joystick left
+          port2 |= 1 << 5; // P2 joystick left
         } else if (e.jaxis.value > JOYSTICK_DEAD_ZONE) {
-          si.port1 |= 1 << 6; // P1 joystick right
-          si.port2 |= 1 << 6; // P2 joystick right
+          port1 |= 1 << 6; // P1 joystick right
+          port2 |= 1 << 6; // P2 joystick right
         } else {
-          si.port1 &= 0b11011111; // P1 joystick left
-          si.port2 &= 0b11011111; // P2 joystick left
+          port1 &= 0b11011111; // P1 joystick left
+          port2 &= 0b11011111; // P2 joystick left
 
-          si.port1 &= 0b10111111; // P1 joystick right
-          si.port2 &= 0b10111111; // P2 joystick right
+          port1 &= 0b10111111; // P1 joystick right
+          port2 &= 0b10111111; // P2 joystick right
         }
       }
     } else if (e.type == SDL_JOYBUTTONDOWN) {
       if (e.jbutton.button == 1) { // B
-        si.port1 |= 1 << 0; // coin
+        port1 |= 1 << 0; // coin
       } else if (e.jbutton.button == 0) {
-        si.port1 |= 1 << 4; // P1 shoot button
-        si.port2 |= 1 << 4; // P2 shoot button
+        port1 |= 1 << 4; // P1 shoot button
+        port2 |= 1 << 4; // P2 shoot button
       } else if (e.jbutton.button == 8) { // start
-        si.port1 |= 1 << 2; // P1 start button
+        port1 |= 1 << 2; // P1 start button
       } else if (e.jbutton.button == 9) { // select
-        si.port1 |= 1 << 1; // P2 start button
+        port1 |= 1 << 1; // P2 start button
       } else if (e.jbutton.button == 13) {
-        si.port1 |= 1 << 5; // P1 joystick left
-        si.port2 |= 1 << 5; // P2 joystick left
+        port1 |= 1 << 5; // P1 joystick left
+        port2 |= 1 << 5; // P2 joystick left
       } else if (e.jbutton.button == 14) {
-        si.port1 |= 1 << 6; // P1 joystick right
-        si.port2 |= 1 << 6; // P2 joystick right
+        port1 |= 1 << 6; // P1 joystick right
+        port2 |= 1 << 6; // P2 joystick right
       } else if (e.jbutton.button == 4) { // LB
         // to toggle between b&w / color
-        si.colored_screen = !si.colored_screen;
+        colored_screen = !colored_screen;
       }
     } else if (e.type == SDL_JOYBUTTONUP) {
       if (e.jbutton.button == 1) { // B
-        si.port1 &= 0b11111110; // coin
+        port1 &= 0b11111110; // coin
       } else if (e.jbutton.button == 0) {
-        si.port1 &= 0b11101111; // P1 shoot button
-        si.port2 &= 0b11101111; // P2 shoot button
+        port1 &= 0b11101111; // P1 shoot button
+        port2 &= 0b11101111; // P2 shoot button
       } else if (e.jbutton.button == 8) { // start
-        si.port1 &= 0b11111011; // P1 start button
+        port1 &= 0b11111011; // P1 start button
       } else if (e.jbutton.button == 9) { // select
-        si.port1 &= 0b11111101; // P2 start button
+        port1 &= 0b11111101; // P2 start button
       } else if (e.jbutton.button == 13) {
-        si.port1 &= 0b11011111; // P1 joystick left
-        si.port2 &= 0b11011111; // P2 joystick left
+        port1 &= 0b11011111; // P1 joystick left
+        port2 &= 0b11011111; // P2 joystick left
       } else if (e.jbutton.button == 14) {
-        si.port1 &= 0b10111111; // P1 joystick right
-        si.port2 &= 0b10111111; // P2 joystick right
+        port1 &= 0b10111111; // P1 joystick right
+        port2 &= 0b10111111; // P2 joystick right
       }
     }
   }
 
-  invaders_update(&si, dt * speed);
+  latch_inputs();
 
-  SDL_RenderClear(renderer);
-  SDL_RenderCopy(renderer, texture, NULL, NULL);
-  SDL_RenderPresent(renderer);
+#ifdef __EMSCRIPTEN__
+  // no threads: the emulation runs before every frame
+  run_emulation();
+#endif
+  present_frame();
 
-  last_time = current_time;
+#ifdef INVADERS_INSTRUMENT
+  if (SDL_GetTicks() - last_summary >= SUMMARY_PERIOD) {
+    last_summary = SDL_GetTicks();
+    invaders_instrument_summary(stderr);
+  }
+#endif
 }
 
-int main(void) {
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      movie_mode = MOVIE_RECORD;
+      movie_path = argv[++i];
+    } else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+      movie_mode = MOVIE_PLAY;
+      movie_path = argv[++i];
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--max-catchup") == 0 && i + 1 < argc) {
+      max_catchup = SDL_atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+      run_ahead = SDL_atoi(argv[++i]);
+      run_ahead = run_ahead < 0               ? 0
+                  : run_ahead > MAX_RUN_AHEAD ? MAX_RUN_AHEAD
+                                              : run_ahead;
+    } else if (strcmp(argv[i], "--fast-forward") == 0 && i + 1 < argc) {
+      fast_forward_speed = SDL_atoi(argv[++i]);
+      fast_forward_speed = fast_forward_speed < 0 ? 0 : fast_forward_speed;
+    } else if (strcmp(argv[i], "--spin") == 0) {
+      spin_wait = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      print_stats = true;
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+      symbols_path = argv[++i];
+#ifdef INVADERS_INSTRUMENT
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+#endif
+    } else if (strcmp(argv[i], "--texture") == 0 && i + 1 < argc) {
+      const char* const name = argv[++i];
+      texture_format_used = NULL;
+      for (int f = 0; f < TEXTURE_FORMAT_COUNT; f++) {
+        if (strcmp(name, TEXTURE_FORMATS[f].name) == 0) {
+          texture_format_used = &TEXTURE_FORMATS[f];
+        }
+      }
+      if (texture_format_used == NULL && strcmp(name, "auto") != 0) {
+        fprintf(stderr, "error: unknown texture format %s\n", name);
+        return 1;
+      }
+#ifndef __EMSCRIPTEN__
+    } else if (strcmp(argv[i], "--netplay") == 0 && i + 3 < argc) {
+      netplay_player = SDL_atoi(argv[++i]) - 1;
+      netplay_port = SDL_atoi(argv[++i]);
+      netplay_peer = argv[++i];
+    } else if (strcmp(argv[i], "--net-delay") == 0 && i + 1 < argc) {
+      netplay_delay = SDL_atoi(argv[++i]);
+#endif
+    } else {
+      fprintf(stderr,
+          "usage: %s [--record FILE | --play FILE [--headless]] "
+          "[--max-catchup FRAMES] [--run-ahead FRAMES] [--fast-forward SPEED] "
+          "[--spin] [--stats] [--profile FILE [--symbols FILE]] "
+          "[--texture auto|rgb332|rgb565|bgr565|rgb555|rgba32] "
+          "[--netplay 1|2 PORT HOST:PORT [--net-delay FRAMES]]\n",
+          argv[0]);
+      return 1;
+    }
+  }
+  if (netplay_peer != NULL &&
+      (netplay_player < 0 || netplay_player > 1 || netplay_port <= 0 ||
+          netplay_delay < 0 || netplay_delay > INVADERS_ROLLBACK_MAX_DELAY)) {
+    fprintf(stderr,
+        "error: --netplay needs player 1 or 2, a port, and a delay of at "
+        "most %d frames\n",
+        INVADERS_ROLLBACK_MAX_DELAY);
+    return 1;
+  }
+  if (netplay_peer != NULL && (movie_mode != MOVIE_NONE || run_ahead > 0)) {
+    fprintf(stderr, "error: --netplay can't be used with movies nor "
+                    "run-ahead\n");
+    return 1;
+  }
+  if (headless) {
+    if (movie_mode != MOVIE_PLAY) {
+      fprintf(stderr, "error: --headless needs a movie to --play\n");
+      return 1;
+    }
+    return play_headless();
+  }
+
   // SDL init
   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_JOYSTICK) != 0) {
     SDL_Log("unable to initialize SDL: %s", SDL_GetError());
     return 1;
   }
 
-  if (Sound_Init() == 0) {
-    SDL_Log("Unable to initialise SDL_sound: %s", Sound_GetError());
+  if (invaders_audio_open() != 0) {
     return 1;
   }
 
-  if (NMIX_OpenAudio(NMIX_DEFAULT_DEVICE, NMIX_DEFAULT_FREQUENCY,
-          NMIX_DEFAULT_SAMPLES) != 0) {
-    SDL_Log("NMIX Error: %s\n", SDL_GetError());
-    return -1;
-  }
-  NMIX_SetMasterGain(.5);
-
   // create SDL window
   SDL_Window* window = SDL_CreateWindow("Space Invaders",
       SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH * 2,
@@ -217,14 +686,33 @@ int main(void) {
   SDL_GetRendererInfo(renderer, &renderer_info);
   SDL_Log("using renderer %s", renderer_info.name);
 
-  // create texture
-  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
+  // create texture, in the most compact format the renderer supports
+  // natively (else rgba32, converted by SDL if needed)
+  for (int f = 0; texture_format_used == NULL; f++) {
+    if (f == TEXTURE_FORMAT_COUNT - 1 ||
+        supports_format(&renderer_info, TEXTURE_FORMATS[f].format)) {
+      texture_format_used = &TEXTURE_FORMATS[f];
+    }
+  }
+  texture = SDL_CreateTexture(renderer, texture_format_used->format,
       SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
 
   if (texture == NULL) {
     SDL_Log("unable to create texture: %s", SDL_GetError());
     return 1;
   }
+  SDL_Log("using texture format %s", texture_format_used->name);
+
+  // pixels of the colours of the screen in this format
+  uint16_t palette[INVADERS_COLOUR_COUNT] = {0};
+  SDL_PixelFormat* const pixel_format =
+      SDL_AllocFormat(texture_format_used->format);
+  if (pixel_format != NULL) {
+    palette[INVADERS_COLOUR_WHITE] = SDL_MapRGB(pixel_format, 255, 255, 255);
+    palette[INVADERS_COLOUR_RED] = SDL_MapRGB(pixel_format, 255, 0, 0);
+    palette[INVADERS_COLOUR_GREEN] = SDL_MapRGB(pixel_format, 0, 255, 0);
+    SDL_FreeFormat(pixel_format);
+  }
 
   // joystick init
   SDL_Joystick* joystick = NULL;
@@ -238,24 +726,60 @@ int main(void) {
     }
   }
 
+  // loading roms
+  invaders_rom_init(&rom);
+  if (load_roms() != 0) {
+    return 1;
+  }
+
   // game init
-  invaders_init(&si);
+  invaders_init(&si, &rom);
+  // the packed frames are drawn from the video ram, not the screen buffer
+  si.skip_screen_buffer =
+      texture_format_used->frame_format != INVADERS_VIDEO_RGBA32;
   si.update_screen = update_screen;
+  si.play_sound = play_sound;
+  si.frame_start = frame_start;
+  invaders_video_init(texture_format_used->frame_format, palette);
   update_screen(&si);
+  load_sounds();
 
-  // loading roms
-  if (invaders_load_rom(&si, FILE1, 0x0000) != 0) {
-    return 1;
-  }
-  if (invaders_load_rom(&si, FILE2, 0x0800) != 0) {
-    return 1;
+  // movies start from a machine just powered on
+  if (movie_mode == MOVIE_RECORD) {
+    if (invaders_movie_record_start(&movie, &si) != 0) {
+      return 1;
+    }
+  } else if (movie_mode == MOVIE_PLAY) {
+    if (invaders_movie_load(&movie, movie_path) != 0 ||
+        invaders_movie_play_start(&movie, &si) != 0) {
+      return 1;
+    }
   }
-  if (invaders_load_rom(&si, FILE3, 0x1000) != 0) {
-    return 1;
+
+  if (profile_path != NULL) {
+    if (invaders_profiler_init(&profiler, SAMPLE_PERIOD) != 0 ||
+        (symbols_path != NULL &&
+            invaders_profiler_load_symbols(&profiler, symbols_path) != 0)) {
+      return 1;
+    }
+    invaders_set_profiler(&si, &profiler);
   }
-  if (invaders_load_rom(&si, FILE4, 0x1800) != 0) {
-    return 1;
+#ifndef __EMSCRIPTEN__
+  if (netplay_peer != NULL) {
+    netplay = invaders_netplay_open(
+        netplay_player, netplay_delay, netplay_port, netplay_peer, NULL);
+    if (netplay == NULL) {
+      return 1;
+    }
+    rollback = invaders_netplay_rollback(netplay);
   }
+#endif
+  port1 = si.port1;
+  port2 = si.port2;
+  colored_screen = si.colored_screen;
+  last_inputs = pack_inputs();
+  latch_inputs();
+  SDL_AtomicSet(&fast_forward, 0);
 
   char* savefile_path = NULL;
   char* base_path = SDL_GetPrefPath("superzazu", "invaders");
@@ -274,9 +798,16 @@ int main(void) {
         savefile_path, savefile_path_len, "%s%s", pref_path, "highscore.sav");
   }
 
+  // the high scores are neither loaded nor saved in movies nor netplay, as
+  // they change the rom (decided here: movie_mode is reset when a replay
+  // ends)
+  const bool persist_hiscore = movie_mode == MOVIE_NONE && netplay == NULL;
+
   // load high scores
   SDL_RWops* f = NULL;
-  f = SDL_RWFromFile(savefile_path, "rb");
+  if (persist_hiscore) {
+    f = SDL_RWFromFile(savefile_path, "rb");
+  }
   if (f != NULL) {
     if (SDL_RWsize(f) != 2) {
       SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION, "Save file is corrupted");
@@ -297,18 +828,50 @@ int main(void) {
 
   // main loop
 #ifdef __EMSCRIPTEN__
+  last_time = SDL_GetTicks();
   emscripten_set_main_loop(mainloop, 0, 1);
 #else
+  SDL_AtomicSet(&emulation_running, 1);
+  SDL_Thread* thread = SDL_CreateThread(emulation_thread, "emulation", NULL);
+  if (thread == NULL) {
+    SDL_Log("unable to create emulation thread: %s", SDL_GetError());
+    return 1;
+  }
+
   while (!should_quit) {
     mainloop();
   }
+
+  SDL_AtomicSet(&emulation_running, 0);
+  SDL_WaitThread(thread, NULL);
+  if (netplay != NULL) {
+    invaders_netplay_close(netplay);
+  }
 #endif
 
+  if (print_stats) {
+    invaders_stats_print(&frame_times);
+    invaders_stats_print(&input_latencies);
+  }
+  if (profile_path != NULL) {
+    invaders_profiler_write(&profiler, profile_path);
+    invaders_profiler_free(&profiler);
+  }
+
+  if (movie_path != NULL) {
+    if (movie_mode == MOVIE_RECORD) {
+      invaders_movie_save(&movie, movie_path);
+    }
+    invaders_movie_free(&movie);
+  }
+
   // save high scores
   uint8_t save[2] = {0, 0};
   invaders_get_hiscore(&si, save);
 
-  f = SDL_RWFromFile(savefile_path, "wb");
+  if (persist_hiscore) {
+    f = SDL_RWFromFile(savefile_path, "wb");
+  }
   if (f != NULL) {
     size_t written = SDL_RWwrite(f, &save, 1, 2);
     if (written == 2) {
@@ -332,8 +895,15 @@ int main(void) {
     SDL_JoystickClose(joystick);
   }
 
-  NMIX_CloseAudio();
-  Sound_Quit();
+  // the sounds may be played from the archive, closed after the audio
+  invaders_audio_close();
+  close_pack();
+
+#ifdef INVADERS_INSTRUMENT
+  if (trace_path != NULL) {
+    invaders_instrument_export(trace_path);
+  }
+#endif
   SDL_DestroyTexture(texture);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
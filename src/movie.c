@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "crc32.h"
+#include "movie.h"
+
+// movie file layout (little endian):
+//   0  "INVM" magic
+//   4  version
+//   5  dip switches
+//   6  crc32 of the rom (4 bytes)
+//  10  number of frames (4 bytes)
+//  14  number of inputs (4 bytes)
+//  18  inputs: frame (4 bytes), port 1, port 2
+//      then the ram hashes, one per frame (4 bytes each)
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER_SIZE 18
+#define MOVIE_INPUT_SIZE 6
+
+static inline void put32(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+  return p[0] | p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint32_t ram_hash(invaders* const si) {
+  return invaders_crc32(0, si->ram, RAM_SIZE);
+}
+
+static int push_input(invaders_movie* const m, invaders* const si) {
+  if (m->input_count == m->input_capacity) {
+    const uint32_t capacity = m->input_capacity ? m->input_capacity * 2 : 64;
+    invaders_movie_input* const inputs =
+        realloc(m->inputs, capacity * sizeof *inputs);
+    if (inputs == NULL) {
+      fprintf(stderr, "error: cannot allocate movie inputs\n");
+      return 1;
+    }
+    m->inputs = inputs;
+    m->input_capacity = capacity;
+  }
+
+  invaders_movie_input* const input = &m->inputs[m->input_count++];
+  input->frame = m->position;
+  input->port1 = si->port1;
+  input->port2 = si->port2;
+  return 0;
+}
+
+static int push_hash(invaders_movie* const m, uint32_t hash) {
+  if (m->frame_count == m->frame_capacity) {
+    const uint32_t capacity =
+        m->frame_capacity ? m->frame_capacity * 2 : 1024;
+    uint32_t* const hashes = realloc(m->ram_hashes, capacity * sizeof *hashes);
+    if (hashes == NULL) {
+      fprintf(stderr, "error: cannot allocate movie frames\n");
+      return 1;
+    }
+    m->ram_hashes = hashes;
+    m->frame_capacity = capacity;
+  }
+
+  m->ram_hashes[m->frame_count++] = hash;
+  return 0;
+}
+
+// sets the input ports to the inputs of the current frame
+static void play_inputs(invaders_movie* const m, invaders* const si) {
+  while (m->next_input < m->input_count &&
+         m->inputs[m->next_input].frame <= m->position) {
+    si->port1 = m->inputs[m->next_input].port1;
+    si->port2 = m->inputs[m->next_input].port2;
+    m->next_input += 1;
+  }
+}
+
+void invaders_movie_init(invaders_movie* const m) {
+  memset(m, 0, sizeof *m);
+}
+
+void invaders_movie_free(invaders_movie* const m) {
+  free(m->inputs);
+  free(m->ram_hashes);
+  invaders_movie_init(m);
+}
+
+int invaders_movie_load(invaders_movie* const m, const char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "error: can't open movie file '%s'.\n", filename);
+    return 1;
+  }
+
+  uint8_t header[MOVIE_HEADER_SIZE];
+  if (fread(header, 1, sizeof header, f) != sizeof header ||
+      memcmp(header, "INVM", 4) != 0) {
+    fprintf(stderr, "error: '%s' is not a movie file.\n", filename);
+    fclose(f);
+    return 1;
+  }
+  if (header[4] != MOVIE_VERSION) {
+    fprintf(stderr, "error: unsupported movie version %d\n", header[4]);
+    fclose(f);
+    return 1;
+  }
+
+  // checks the counts against the size of the file before allocating
+  const uint32_t frame_count = get32(&header[10]);
+  const uint32_t input_count = get32(&header[14]);
+  fseek(f, 0, SEEK_END);
+  const long file_size = ftell(f);
+  fseek(f, MOVIE_HEADER_SIZE, SEEK_SET);
+  const long long expected_size = MOVIE_HEADER_SIZE +
+                                  (long long) input_count * MOVIE_INPUT_SIZE +
+                                  (long long) frame_count * 4;
+  if (file_size != expected_size) {
+    fprintf(stderr, "error: movie file '%s' is truncated.\n", filename);
+    fclose(f);
+    return 1;
+  }
+
+  invaders_movie_free(m);
+  m->dip_switches = header[5];
+  m->rom_crc = get32(&header[6]);
+  m->inputs = malloc((input_count + 1) * sizeof *m->inputs);
+  m->ram_hashes = malloc((frame_count + 1) * sizeof *m->ram_hashes);
+  if (m->inputs == NULL || m->ram_hashes == NULL) {
+    fprintf(stderr, "error: cannot allocate movie\n");
+    invaders_movie_free(m);
+    fclose(f);
+    return 1;
+  }
+  m->input_capacity = input_count + 1;
+  m->frame_capacity = frame_count + 1;
+
+  uint8_t buffer[MOVIE_INPUT_SIZE];
+  for (uint32_t i = 0; i < input_count; i++) {
+    if (fread(buffer, 1, MOVIE_INPUT_SIZE, f) != MOVIE_INPUT_SIZE) {
+      break;
+    }
+    m->inputs[i].frame = get32(buffer);
+    m->inputs[i].port1 = buffer[4];
+    m->inputs[i].port2 = buffer[5];
+    m->input_count += 1;
+  }
+  for (uint32_t i = 0; i < frame_count; i++) {
+    if (fread(buffer, 1, 4, f) != 4) {
+      break;
+    }
+    m->ram_hashes[i] = get32(buffer);
+    m->frame_count += 1;
+  }
+  fclose(f);
+
+  if (m->input_count != input_count || m->frame_count != frame_count) {
+    fprintf(stderr, "error: can't read movie file '%s'.\n", filename);
+    invaders_movie_free(m);
+    return 1;
+  }
+  return 0;
+}
+
+int invaders_movie_save(invaders_movie* const m, const char* filename) {
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "error: can't open movie file '%s'.\n", filename);
+    return 1;
+  }
+
+  uint8_t header[MOVIE_HEADER_SIZE];
+  memcpy(header, "INVM", 4);
+  header[4] = MOVIE_VERSION;
+  header[5] = m->dip_switches;
+  put32(&header[6], m->rom_crc);
+  put32(&header[10], m->frame_count);
+  put32(&header[14], m->input_count);
+  bool ok = fwrite(header, 1, sizeof header, f) == sizeof header;
+
+  uint8_t buffer[MOVIE_INPUT_SIZE];
+  for (uint32_t i = 0; ok && i < m->input_count; i++) {
+    put32(buffer, m->inputs[i].frame);
+    buffer[4] = m->inputs[i].port1;
+    buffer[5] = m->inputs[i].port2;
+    ok = fwrite(buffer, 1, MOVIE_INPUT_SIZE, f) == MOVIE_INPUT_SIZE;
+  }
+  for (uint32_t i = 0; ok && i < m->frame_count; i++) {
+    put32(buffer, m->ram_hashes[i]);
+    ok = fwrite(buffer, 1, 4, f) == 4;
+  }
+
+  if (fclose(f) != 0 || !ok) {
+    fprintf(stderr, "error: can't write movie file '%s'.\n", filename);
+    return 1;
+  }
+  return 0;
+}
+
+// starts recording a machine that has just been initialised
+int invaders_movie_record_start(invaders_movie* const m, invaders* const si) {
+  m->rom_crc = invaders_crc32(0, si->rom->data, ROM_SIZE);
+  m->dip_switches = si->port2 & INVADERS_DIP_SWITCHES;
+  m->input_count = 0;
+  m->frame_count = 0;
+  m->position = 0;
+  m->next_input = 0;
+  return push_input(m, si);
+}
+
+// records a frame, to be called at the start of every frame (from the
+// `frame_start` callback) once the input ports of the frame are set
+int invaders_movie_record_frame(invaders_movie* const m, invaders* const si) {
+  if (push_hash(m, ram_hash(si)) != 0) {
+    return 1;
+  }
+  m->position += 1;
+
+  const invaders_movie_input* const last = &m->inputs[m->input_count - 1];
+  if (last->port1 != si->port1 || last->port2 != si->port2) {
+    return push_input(m, si);
+  }
+  return 0;
+}
+
+// starts playing the movie on a machine that has just been initialised
+int invaders_movie_play_start(invaders_movie* const m, invaders* const si) {
+  const uint32_t rom_crc = invaders_crc32(0, si->rom->data, ROM_SIZE);
+  if (rom_crc != m->rom_crc) {
+    fprintf(stderr, "error: movie recorded with another rom (%08X, %08X)\n",
+        (unsigned) m->rom_crc, (unsigned) rom_crc);
+    return 1;
+  }
+
+  m->position = 0;
+  m->next_input = 0;
+  si->port2 = (si->port2 & ~INVADERS_DIP_SWITCHES) | m->dip_switches;
+  play_inputs(m, si);
+  return 0;
+}
+
+// plays a frame, to be called at the start of every frame (from the
+// `frame_start` callback). Returns 1 if the replay has diverged from the
+// recording.
+int invaders_movie_play_frame(invaders_movie* const m, invaders* const si) {
+  if (invaders_movie_ended(m)) {
+    return 0;
+  }
+
+  if (ram_hash(si) != m->ram_hashes[m->position]) {
+    fprintf(stderr, "error: replay diverged at frame %u\n",
+        (unsigned) m->position);
+    return 1;
+  }
+  m->position += 1;
+  play_inputs(m, si);
+  return 0;
+}
+
+bool invaders_movie_ended(const invaders_movie* const m) {
+  return m->position >= m->frame_count;
+}
+
+// plays the whole movie as fast as possible on a machine that has just been
+// initialised, returns 0 if the replay is identical to the recording
+int invaders_movie_replay(invaders_movie* const m, invaders* const si) {
+  if (invaders_movie_play_start(m, si) != 0) {
+    return 1;
+  }
+
+  while (!invaders_movie_ended(m)) {
+    invaders_run_frames(si, 1);
+    if (invaders_movie_play_frame(m, si) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef INVADERS_MOVIE_H
+#define INVADERS_MOVIE_H
+
+#include "invaders.h"
+
+// bits of port 2 set by the dip switches (number of lives, bonus life at
+// 1000 or 1500 points, coin info display)
+#define INVADERS_DIP_SWITCHES 0x8B
+
+// values of the input ports from frame `frame` onwards
+typedef struct invaders_movie_input invaders_movie_input;
+struct invaders_movie_input {
+  uint32_t frame;
+  uint8_t port1, port2;
+};
+
+// Inputs of a session, recorded from power on so that it can be replayed
+// exactly. Input ports are only stored when they change, and only change
+// at the start of a frame (see the `frame_start` callback). A hash of the
+// ram at the start of every frame is stored to check that a replay has not
+// diverged from the recording.
+typedef struct invaders_movie invaders_movie;
+struct invaders_movie {
+  uint32_t rom_crc;
+  uint8_t dip_switches;
+
+  invaders_movie_input* inputs;
+  uint32_t input_count, input_capacity;
+
+  uint32_t* ram_hashes; // one per recorded frame
+  uint32_t frame_count, frame_capacity;
+
+  uint32_t position; // frame being recorded or played
+  uint32_t next_input; // next input to play
+};
+
+void invaders_movie_init(invaders_movie* const m);
+void invaders_movie_free(invaders_movie* const m);
+int invaders_movie_load(invaders_movie* const m, const char* filename);
+int invaders_movie_save(invaders_movie* const m, const char* filename);
+
+int invaders_movie_record_start(invaders_movie* const m, invaders* const si);
+int invaders_movie_record_frame(invaders_movie* const m, invaders* const si);
+int invaders_movie_play_start(invaders_movie* const m, invaders* const si);
+int invaders_movie_play_frame(invaders_movie* const m, invaders* const si);
+bool invaders_movie_ended(const invaders_movie* const m);
+int invaders_movie_replay(invaders_movie* const m, invaders* const si);
+
+#endif // INVADERS_MOVIE_H
@@ -0,0 +1,363 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET netplay_socket;
+#define CLOSE_SOCKET closesocket
+#else
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+typedef int netplay_socket;
+#define INVALID_SOCKET (-1)
+#define CLOSE_SOCKET close
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "netplay.h"
+
+// packet: "IN", player of the sender, its input delay, remote inputs
+// received by the sender (4 bytes), frame of the first input (4 bytes),
+// number of inputs, newest frame checksummed (4 bytes, 0xFFFFFFFF if none)
+// and its checksum (4 bytes), then the inputs (1 byte each). Numbers are
+// little endian.
+#define HEADER_SIZE 21
+#define MAX_PACKET_SIZE (HEADER_SIZE + INVADERS_ROLLBACK_INPUTS)
+#define NO_CHECK 0xFFFFFFFF
+
+#define SEND_INTERVAL 5 // ms between two packets when no input is new
+#define SHIM_QUEUE_SIZE 256 // packets delayed by the shim
+
+typedef struct netplay_packet netplay_packet;
+struct netplay_packet {
+  uint64_t due; // ms
+  int size;
+  uint8_t data[MAX_PACKET_SIZE];
+};
+
+struct invaders_netplay {
+  invaders_rollback rollback;
+  netplay_socket socket;
+  struct sockaddr_in peer;
+  unsigned long remote_ack; // local inputs received by the other player
+  uint64_t last_send; // ms
+  unsigned long last_sent_count; // local inputs when the last packet was sent
+  bool failed;
+
+  invaders_netplay_shim shim;
+  uint32_t random; // xorshift state
+  netplay_packet queue[SHIM_QUEUE_SIZE]; // not sorted when jittered
+  int queued;
+
+  unsigned long sent, received, dropped;
+};
+
+static uint64_t now_ms(void) {
+#ifdef _WIN32
+  return GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static inline void put32(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint32_t next_random(invaders_netplay* const n) {
+  uint32_t x = n->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return n->random = x;
+}
+
+static void send_now(invaders_netplay* const n, const uint8_t* data, int size) {
+  sendto(n->socket, (const char*) data, size, 0,
+      (const struct sockaddr*) &n->peer, sizeof n->peer);
+}
+
+// sends a packet through the shim: dropped, delayed, or sent right away
+static void send_packet(
+    invaders_netplay* const n, const uint8_t* data, int size) {
+  n->sent += 1;
+  if (n->shim.loss > 0 && next_random(n) < n->shim.loss * 4294967296.0) {
+    n->dropped += 1;
+    return;
+  }
+  if (n->shim.latency <= 0 && n->shim.jitter <= 0) {
+    send_now(n, data, size);
+    return;
+  }
+  if (n->queued == SHIM_QUEUE_SIZE) {
+    n->dropped += 1;
+    return;
+  }
+
+  netplay_packet* const p = &n->queue[n->queued++];
+  p->due = now_ms() + (n->shim.latency > 0 ? n->shim.latency : 0);
+  if (n->shim.jitter > 0) {
+    p->due += next_random(n) % (n->shim.jitter + 1);
+  }
+  p->size = size;
+  memcpy(p->data, data, size);
+}
+
+// sends the packets delayed by the shim that are due
+static void flush_queue(invaders_netplay* const n) {
+  const uint64_t now = now_ms();
+  for (int i = 0; i < n->queued;) {
+    if (n->queue[i].due <= now) {
+      send_now(n, n->queue[i].data, n->queue[i].size);
+      n->queue[i] = n->queue[--n->queued];
+    } else {
+      i++;
+    }
+  }
+}
+
+// sends the local inputs not acknowledged yet (at most the ones still in
+// the ring of inputs, the older ones are known to the other player, see
+// rollback.h)
+static void send_inputs(invaders_netplay* const n) {
+  const invaders_rollback* const r = &n->rollback;
+  unsigned long first = n->remote_ack;
+  if (r->local_count - first > INVADERS_ROLLBACK_INPUTS) {
+    first = r->local_count - INVADERS_ROLLBACK_INPUTS;
+  }
+  const int count = first < r->local_count ? r->local_count - first : 0;
+
+  uint8_t packet[MAX_PACKET_SIZE];
+  packet[0] = 'I';
+  packet[1] = 'N';
+  packet[2] = r->player;
+  packet[3] = r->delay;
+  put32(&packet[4], r->remote_count);
+  put32(&packet[8], first);
+  packet[12] = count;
+  put32(&packet[13], r->checked == ULONG_MAX ? NO_CHECK : r->checked);
+  put32(&packet[17], r->checked == ULONG_MAX
+                         ? 0
+                         : r->checks[r->checked % INVADERS_ROLLBACK_INPUTS]);
+  for (int i = 0; i < count; i++) {
+    packet[HEADER_SIZE + i] =
+        r->inputs[(first + i) % INVADERS_ROLLBACK_INPUTS][r->player];
+  }
+  send_packet(n, packet, HEADER_SIZE + count);
+  n->last_send = now_ms();
+  n->last_sent_count = r->local_count;
+}
+
+static int receive_packet(
+    invaders_netplay* const n, const uint8_t* packet, int size) {
+  invaders_rollback* const r = &n->rollback;
+  if (size < HEADER_SIZE || packet[0] != 'I' || packet[1] != 'N' ||
+      size != HEADER_SIZE + packet[12]) {
+    return 0;
+  }
+  if (packet[2] == r->player || packet[3] != r->delay) {
+    fprintf(stderr,
+        "error: the other player is player %d with a delay of %d frames "
+        "(player %d with %d here)\n",
+        packet[2] + 1, packet[3], r->player + 1, r->delay);
+    return 1;
+  }
+  n->received += 1;
+
+  const unsigned long ack = get32(&packet[4]);
+  if (ack > n->remote_ack) {
+    n->remote_ack = ack;
+  }
+  const unsigned long first = get32(&packet[8]);
+  for (int i = 0; i < packet[12]; i++) {
+    invaders_rollback_add_remote(r, first + i, packet[HEADER_SIZE + i]);
+  }
+
+  const uint32_t checked = get32(&packet[13]);
+  if (checked != NO_CHECK &&
+      !invaders_rollback_check(r, checked, get32(&packet[17]))) {
+    fprintf(stderr, "error: desync at frame %lu\n", (unsigned long) checked);
+    return 1;
+  }
+  return 0;
+}
+
+// takes the packets received, and sends the local inputs if there are new
+// ones or if none have been sent for a while. Returns 0 on success.
+static int poll_network(invaders_netplay* const n) {
+  if (n->failed) {
+    return 1;
+  }
+
+  uint8_t packet[MAX_PACKET_SIZE + 1];
+  for (;;) {
+    struct sockaddr_in from;
+    socklen_t from_size = sizeof from;
+    const int size = recvfrom(n->socket, (char*) packet, sizeof packet, 0,
+        (struct sockaddr*) &from, &from_size);
+    if (size < 0) {
+      break; // nothing left (or an icmp error, while the peer is not up)
+    }
+    if (from.sin_addr.s_addr != n->peer.sin_addr.s_addr ||
+        from.sin_port != n->peer.sin_port) {
+      continue;
+    }
+    if (receive_packet(n, packet, size) != 0) {
+      n->failed = true;
+      return 1;
+    }
+  }
+
+  if (n->rollback.local_count != n->last_sent_count ||
+      now_ms() - n->last_send >= SEND_INTERVAL) {
+    send_inputs(n);
+  }
+  flush_queue(n);
+  return 0;
+}
+
+static bool set_non_blocking(netplay_socket s) {
+#ifdef _WIN32
+  u_long mode = 1;
+  return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+  const int flags = fcntl(s, F_GETFL, 0);
+  return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+static void netplay_free(invaders_netplay* const n) {
+  if (n->socket != INVALID_SOCKET) {
+    CLOSE_SOCKET(n->socket);
+  }
+#ifdef _WIN32
+  WSACleanup();
+#endif
+  free(n);
+}
+
+// starts a session as `player` (0 or 1) with the other player at `peer`,
+// with `delay` frames of input delay (the same for both players) and the
+// network conditions of `shim` (can be NULL). The machines of both players
+// must be in the same state. Returns NULL on error.
+invaders_netplay* invaders_netplay_open(int player, int delay, int port,
+    const char* peer, const invaders_netplay_shim* shim) {
+  invaders_netplay* const n = calloc(1, sizeof *n);
+  if (n == NULL) {
+    return NULL;
+  }
+  n->socket = INVALID_SOCKET;
+#ifdef _WIN32
+  WSADATA wsa;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+    fprintf(stderr, "error: can't initialise winsock\n");
+    free(n);
+    return NULL;
+  }
+#endif
+
+  invaders_rollback_init(&n->rollback, player, delay);
+  n->remote_ack = n->rollback.delay; // the first inputs are not sent
+  if (shim != NULL) {
+    n->shim = *shim;
+  }
+  n->random = 0x9E3779B9u ^ (uint32_t) (player + 1) * 0x85EBCA6Bu;
+
+  // "HOST:PORT", the host can be a name
+  char host[256];
+  const char* const colon = strrchr(peer, ':');
+  if (colon == NULL || (size_t) (colon - peer) >= sizeof host) {
+    fprintf(stderr, "error: invalid peer '%s' (HOST:PORT)\n", peer);
+    netplay_free(n);
+    return NULL;
+  }
+  memcpy(host, peer, colon - peer);
+  host[colon - peer] = '\0';
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo* address = NULL;
+  if (getaddrinfo(host, colon + 1, &hints, &address) != 0 ||
+      address == NULL) {
+    fprintf(stderr, "error: can't resolve '%s'\n", peer);
+    netplay_free(n);
+    return NULL;
+  }
+  memcpy(&n->peer, address->ai_addr, sizeof n->peer);
+  freeaddrinfo(address);
+
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof local);
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(port);
+  n->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (n->socket == INVALID_SOCKET ||
+      bind(n->socket, (struct sockaddr*) &local, sizeof local) != 0 ||
+      !set_non_blocking(n->socket)) {
+    fprintf(stderr, "error: can't listen on udp port %d\n", port);
+    netplay_free(n);
+    return NULL;
+  }
+  return n;
+}
+
+// exchanges the inputs, and runs the next frame with `input` from the local
+// player (see invaders_rollback_advance). Returns 1 if the frame has been
+// run, 0 if it has to wait for the other player, -1 on error (a desync, or
+// the players are not set up the same way).
+int invaders_netplay_frame(
+    invaders_netplay* const n, invaders* const si, uint8_t input) {
+  if (poll_network(n) != 0) {
+    return -1;
+  }
+  const int ran = invaders_rollback_advance(&n->rollback, si, input);
+  if (poll_network(n) != 0) {
+    return -1;
+  }
+  return ran;
+}
+
+// exchanges the inputs and runs again the mispredicted frames, without
+// running a new frame (eg. to wait for the other player at the end of a
+// session). Returns 0 on success.
+int invaders_netplay_sync(invaders_netplay* const n, invaders* const si) {
+  if (poll_network(n) != 0) {
+    return 1;
+  }
+  invaders_rollback_sync(&n->rollback, si);
+  return 0;
+}
+
+const invaders_rollback* invaders_netplay_rollback(
+    const invaders_netplay* const n) {
+  return &n->rollback;
+}
+
+// ends the session, after printing its statistics
+void invaders_netplay_close(invaders_netplay* const n) {
+  const invaders_rollback* const r = &n->rollback;
+  fprintf(stderr,
+      "netplay: %lu frames, %lu rollbacks (%lu frames replayed), "
+      "%lu stalls, %lu packets sent (%lu dropped), %lu received\n",
+      r->frame, r->rollbacks, r->replayed, r->stalls, n->sent, n->dropped,
+      n->received);
+  netplay_free(n);
+}
@@ -0,0 +1,31 @@
+#ifndef INVADERS_NETPLAY_H
+#define INVADERS_NETPLAY_H
+
+#include "rollback.h"
+
+// conditions of a bad network, simulated on the packets sent
+typedef struct invaders_netplay_shim invaders_netplay_shim;
+struct invaders_netplay_shim {
+  int latency; // ms added to every packet
+  int jitter; // random ms added on top of the latency (reorders packets)
+  double loss; // part of the packets dropped, from 0 to 1
+};
+
+typedef struct invaders_netplay invaders_netplay;
+
+// Rollback session (see rollback.h) between two machines over UDP. Every
+// packet carries the local inputs the other player has not acknowledged
+// yet, so that a lost packet is covered by the next one, and the checksum
+// of the newest frame run with the inputs of both players, so that a
+// desync is detected. Each player sends from and receives on `port`, and
+// only takes the packets coming from `peer` ("HOST:PORT", IPv4).
+invaders_netplay* invaders_netplay_open(int player, int delay, int port,
+    const char* peer, const invaders_netplay_shim* shim);
+int invaders_netplay_frame(
+    invaders_netplay* const n, invaders* const si, uint8_t input);
+int invaders_netplay_sync(invaders_netplay* const n, invaders* const si);
+const invaders_rollback* invaders_netplay_rollback(
+    const invaders_netplay* const n);
+void invaders_netplay_close(invaders_netplay* const n);
+
+#endif // INVADERS_NETPLAY_H
@@ -0,0 +1,176 @@
+#include <stdio.h>
+
+#include "observe.h"
+
+// initialises an observer of frames of `width` x `height` pixels, in one of
+// the INVADERS_OBSERVE_* formats, `stack` frames per observation. Returns 0
+// on success.
+int invaders_observer_init(invaders_observer* const o, int format, int width,
+    int height, int stack) {
+  if ((format != INVADERS_OBSERVE_BINARY && format != INVADERS_OBSERVE_GRAY) ||
+      width < 1 || width > SCREEN_WIDTH || height < 1 ||
+      height > SCREEN_HEIGHT || stack < 1) {
+    fprintf(stderr, "error: invalid observation format %d (%dx%d, %d)\n",
+        format, width, height, stack);
+    return 1;
+  }
+
+  o->format = format;
+  o->width = width;
+  o->height = height;
+  o->stack = stack;
+  const size_t row_size =
+      format == INVADERS_OBSERVE_BINARY ? (width + 7) / 8 : width;
+  o->frame_size = row_size * height;
+  o->size = o->frame_size * stack;
+
+  for (int i = 0; i <= width; i++) {
+    o->x[i] = i * SCREEN_WIDTH / width;
+  }
+  for (int j = 0; j <= height; j++) {
+    o->y[j] = j * SCREEN_HEIGHT / height;
+  }
+  return 0;
+}
+
+// EXPAND[b][i] is 1 if bit i of b is set, 0 otherwise
+#define E(b, i) (((b) >> (i)) & 1)
+#define E8(b) {E(b, 0), E(b, 1), E(b, 2), E(b, 3), E(b, 4), E(b, 5), E(b, 6), E(b, 7)}
+#define E4(b) E8(b), E8(b + 1), E8(b + 2), E8(b + 3)
+#define E16(b) E4(b), E4(b + 4), E4(b + 8), E4(b + 12)
+#define E64(b) E16(b), E16(b + 16), E16(b + 32), E16(b + 48)
+
+static const uint8_t EXPAND[256][8] = {E64(0), E64(64), E64(128), E64(192)};
+
+#undef E64
+#undef E16
+#undef E4
+#undef E8
+#undef E
+
+// counts the lit pixels of every column of the screen over the rows [y0,
+// y1[ of a bitmap, 8 columns at once: one counter per byte, so that at most
+// 255 rows can be counted
+static inline void count_columns(uint8_t bitmap[][SCREEN_WIDTH / 8],
+    int y0, int y1, uint8_t count[SCREEN_WIDTH]) {
+  uint64_t lanes[SCREEN_WIDTH / 8] = {0};
+  for (int row = y0; row < y1; row++) {
+    for (int k = 0; k < SCREEN_WIDTH / 8; k++) {
+      uint64_t bits;
+      memcpy(&bits, EXPAND[bitmap[row][k]], sizeof bits);
+      lanes[k] += bits;
+    }
+  }
+  memcpy(count, lanes, sizeof lanes);
+}
+
+// renders the screen in a frame: the screen is drawn in a bitmap, which is
+// the frame itself if it is not downsampled, then for each row of the
+// frame, the lit pixels of the rows of its boxes are counted by column and
+// summed over the columns of each box
+static void observe_frame(const invaders_observer* const o,
+    invaders* const si, uint8_t* frame) {
+  if (o->format == INVADERS_OBSERVE_BINARY && o->width == SCREEN_WIDTH &&
+      o->height == SCREEN_HEIGHT) {
+    invaders_render_bitmap(si, (uint8_t (*)[SCREEN_WIDTH / 8]) frame);
+    return;
+  }
+
+  uint8_t bitmap[SCREEN_HEIGHT][SCREEN_WIDTH / 8];
+  invaders_render_bitmap(si, bitmap);
+
+  // copied, as the frame could alias the observer
+  const int width = o->width;
+  const int height = o->height;
+  const bool binary = o->format == INVADERS_OBSERVE_BINARY;
+  uint16_t x[SCREEN_WIDTH + 1], y[SCREEN_HEIGHT + 1];
+  memcpy(x, o->x, (width + 1) * sizeof *x);
+  memcpy(y, o->y, (height + 1) * sizeof *y);
+
+  // boxes are `narrow` or `narrow + 1` columns wide
+  const int narrow = SCREEN_WIDTH / width;
+
+  for (int j = 0; j < height; j++) {
+    // lit pixels of each box of the row, counted by chunks of 255 rows
+    uint32_t lit[SCREEN_WIDTH] = {0};
+    for (int y0 = y[j]; y0 < y[j + 1]; y0 += 255) {
+      const int y1 = y[j + 1] - y0 > 255 ? y0 + 255 : y[j + 1];
+      uint8_t count[SCREEN_WIDTH];
+      count_columns(bitmap, y0, y1, count);
+      // lit pixels of the columns [0, col[ of the chunk
+      uint16_t before[SCREEN_WIDTH + 1];
+      before[0] = 0;
+      for (int col = 0; col < SCREEN_WIDTH; col++) {
+        before[col + 1] = before[col] + count[col];
+      }
+      for (int i = 0; i < width; i++) {
+        lit[i] += before[x[i + 1]] - before[x[i]];
+      }
+    }
+
+    if (binary) {
+      uint8_t* const out = &frame[j * ((width + 7) / 8)];
+      for (int i = 0; i < width; i += 8) {
+        uint8_t bits = 0;
+        for (int b = 0; b < 8 && i + b < width; b++) {
+          bits |= (lit[i + b] != 0) << b;
+        }
+        out[i / 8] = bits;
+      }
+      continue;
+    }
+
+    // 255 / area of the boxes of the row, in 8.24 fixed point
+    const uint32_t box_height = y[j + 1] - y[j];
+    const uint32_t scale[2] = {
+        ((255u << 24) + narrow * box_height / 2) / (narrow * box_height),
+        ((255u << 24) + (narrow + 1) * box_height / 2) /
+            ((narrow + 1) * box_height)};
+    uint8_t* const out = &frame[j * width];
+    for (int i = 0; i < width; i++) {
+      const uint32_t s = scale[x[i + 1] - x[i] - narrow];
+      out[i] = ((uint64_t) lit[i] * s + (1u << 23)) >> 24;
+    }
+  }
+}
+
+// renders the current screen in the newest frame of an observation, the
+// older frames are moved back by one
+void invaders_observe(
+    const invaders_observer* const o, invaders* const si, uint8_t* obs) {
+  uint8_t* const frame = obs + o->size - o->frame_size;
+  memmove(obs, obs + o->frame_size, o->size - o->frame_size);
+  observe_frame(o, si, frame);
+}
+
+// fills every frame of an observation with the current screen (eg. when the
+// machine has been reset)
+void invaders_observe_reset(
+    const invaders_observer* const o, invaders* const si, uint8_t* obs) {
+  invaders_observe(o, si, obs);
+  for (int f = 0; f + 1 < o->stack; f++) {
+    memcpy(obs + f * o->frame_size, obs + o->size - o->frame_size,
+        o->frame_size);
+  }
+}
+
+static inline int32_t bcd(int32_t value) {
+  return (value >> 4) * 10 + (value & 0xF);
+}
+
+static inline int32_t peek(invaders* const si, uint16_t addr) {
+  return si->ram[addr - RAM_ADDR];
+}
+
+// writes INVADERS_FEATURE_COUNT features of the game (the scores are
+// stored in bcd, two bytes each, low digits first)
+void invaders_get_features(invaders* const si, int32_t* features) {
+  features[INVADERS_FEATURE_SCORE1] =
+      bcd(peek(si, 0x20F9)) * 100 + bcd(peek(si, 0x20F8));
+  features[INVADERS_FEATURE_SCORE2] =
+      bcd(peek(si, 0x20FD)) * 100 + bcd(peek(si, 0x20FC));
+  features[INVADERS_FEATURE_SHIPS1] = peek(si, 0x21FF);
+  features[INVADERS_FEATURE_SHIPS2] = peek(si, 0x22FF);
+  features[INVADERS_FEATURE_ALIENS] = peek(si, 0x2082);
+  features[INVADERS_FEATURE_PLAYING] = peek(si, 0x20EF) != 0;
+}
@@ -0,0 +1,53 @@
+#ifndef INVADERS_OBSERVE_H
+#define INVADERS_OBSERVE_H
+
+#include "invaders.h"
+
+// formats of the observed frames
+enum {
+  INVADERS_OBSERVE_BINARY, // 1 bit per pixel, 8 pixels per byte (leftmost
+                           // in bit 0), rows padded to a byte: a pixel is
+                           // set if any pixel of its box is lit
+  INVADERS_OBSERVE_GRAY, // 1 byte per pixel: the part of its box that is
+                         // lit, from 0 to 255
+};
+
+// features read from the ram of the game
+enum {
+  INVADERS_FEATURE_SCORE1, // score of player 1 (0x20F8)
+  INVADERS_FEATURE_SCORE2, // score of player 2 (0x20FC)
+  INVADERS_FEATURE_SHIPS1, // ships left to player 1 (0x21FF)
+  INVADERS_FEATURE_SHIPS2, // ships left to player 2 (0x22FF)
+  INVADERS_FEATURE_ALIENS, // aliens left in the rack (0x2082)
+  INVADERS_FEATURE_PLAYING, // 1 during a game, 0 in attract mode (0x20EF)
+  INVADERS_FEATURE_COUNT
+};
+
+// Observations of the game for learning agents, read straight from the
+// video ram (upright, as the player sees the screen). The screen can be
+// downsampled: each pixel of the observation covers a box of pixels of the
+// screen. The colour overlay is ignored, it carries nothing of the game.
+// The last `stack` frames of a machine are kept together, oldest first.
+typedef struct invaders_observer invaders_observer;
+struct invaders_observer {
+  int format; // INVADERS_OBSERVE_*
+  int width, height; // at most SCREEN_WIDTH x SCREEN_HEIGHT
+  int stack; // number of frames per observation
+  size_t frame_size; // bytes of a frame
+  size_t size; // bytes of an observation (stack * frame_size)
+
+  // boxes of the pixels of the observation: columns [x[i], x[i + 1][ and
+  // rows [y[j], y[j + 1][ of the screen
+  uint16_t x[SCREEN_WIDTH + 1];
+  uint16_t y[SCREEN_HEIGHT + 1];
+};
+
+int invaders_observer_init(invaders_observer* const o, int format, int width,
+    int height, int stack);
+void invaders_observe(
+    const invaders_observer* const o, invaders* const si, uint8_t* obs);
+void invaders_observe_reset(
+    const invaders_observer* const o, invaders* const si, uint8_t* obs);
+void invaders_get_features(invaders* const si, int32_t* features);
+
+#endif // INVADERS_OBSERVE_H
@@ -0,0 +1,97 @@
+#include <SDL.h>
+
+#include "invaders.h"
+#include "pacing.h"
+
+// a wait that spins switches from sleeping to spinning this long before
+// the deadline, to be immune to the granularity of the scheduler
+#define SPIN_MS 2
+
+#define FRAME_COST(p) ((p)->frequency * CYCLES_PER_FRAME)
+
+void invaders_pacer_init(invaders_pacer* const p, int max_catchup, bool spin) {
+  p->frequency = SDL_GetPerformanceFrequency();
+  p->last = SDL_GetPerformanceCounter();
+  p->accumulator = 0;
+  p->max_catchup = max_catchup > 0 ? max_catchup : 1;
+  p->spin = spin;
+}
+
+// restarts the pacing from now (eg. after running unthrottled)
+void invaders_pacer_reset(invaders_pacer* const p) {
+  p->last = SDL_GetPerformanceCounter();
+  p->accumulator = 0;
+}
+
+// returns the number of frames to run now: after a stall, only
+// `max_catchup` frames are run and the rest of the time is dropped, rather
+// than running the machine in a long burst
+int invaders_pacer_frames_due(invaders_pacer* const p, int speed) {
+  const uint64_t now = SDL_GetPerformanceCounter();
+  p->accumulator += (now - p->last) * CLOCK_SPEED * speed;
+  p->last = now;
+
+  const uint64_t frames = p->accumulator / FRAME_COST(p);
+  if (frames > (uint64_t) p->max_catchup) {
+    p->accumulator %= FRAME_COST(p);
+    return p->max_catchup;
+  }
+  p->accumulator -= frames * FRAME_COST(p);
+  return frames;
+}
+
+// waits until the next frame is due
+void invaders_pacer_wait(invaders_pacer* const p, int speed) {
+  const uint64_t rate = (uint64_t) CLOCK_SPEED * speed;
+  const uint64_t left = FRAME_COST(p) - p->accumulator;
+  const uint64_t deadline = p->last + (left + rate - 1) / rate;
+
+  const uint64_t now = SDL_GetPerformanceCounter();
+  if (now >= deadline) {
+    return;
+  }
+  const uint64_t ms = (deadline - now) * 1000 / p->frequency;
+  if (!p->spin) {
+    SDL_Delay(ms + 1);
+    return;
+  }
+
+  if (ms > SPIN_MS) {
+    SDL_Delay(ms - SPIN_MS);
+  }
+  while (SDL_GetPerformanceCounter() < deadline) {
+  }
+}
+
+void invaders_stats_add(invaders_stats* const s, double ms) {
+  s->samples[s->count % INVADERS_STATS_SIZE] = ms;
+  s->count += 1;
+}
+
+static int compare_samples(const void* a, const void* b) {
+  const float x = *(const float*) a;
+  const float y = *(const float*) b;
+  return (x > y) - (x < y);
+}
+
+// prints the percentiles of the last samples
+void invaders_stats_print(const invaders_stats* const s) {
+  const uint32_t count =
+      s->count < INVADERS_STATS_SIZE ? s->count : INVADERS_STATS_SIZE;
+  if (count == 0) {
+    SDL_Log("%s: no samples", s->name);
+    return;
+  }
+
+  float* const sorted = SDL_malloc(count * sizeof *sorted);
+  if (sorted == NULL) {
+    return;
+  }
+  SDL_memcpy(sorted, s->samples, count * sizeof *sorted);
+  SDL_qsort(sorted, count, sizeof *sorted, compare_samples);
+  SDL_Log("%s (last %u of %u): p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, "
+          "max %.2f ms",
+      s->name, (unsigned) count, (unsigned) s->count, sorted[count / 2],
+      sorted[count * 90 / 100], sorted[count * 99 / 100], sorted[count - 1]);
+  SDL_free(sorted);
+}
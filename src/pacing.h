@@ -0,0 +1,39 @@
+#ifndef INVADERS_PACING_H
+#define INVADERS_PACING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define INVADERS_STATS_SIZE 4096
+
+// Paces the emulation on the high resolution clock of the host, in steps of
+// exactly one emulated frame: the time elapsed is accumulated (in cycles
+// times ticks of the clock, so that nothing is lost to rounding) and a frame
+// is run every time a whole frame has been accumulated.
+typedef struct invaders_pacer invaders_pacer;
+struct invaders_pacer {
+  uint64_t frequency; // of the performance counter
+  uint64_t last; // performance counter at the last call
+  uint64_t accumulator; // in cycles * ticks
+  int max_catchup; // frames run at once at most, the time beyond is dropped
+  bool spin; // sleeps, then spins for the last milliseconds of a wait
+};
+
+void invaders_pacer_init(invaders_pacer* const p, int max_catchup, bool spin);
+void invaders_pacer_reset(invaders_pacer* const p);
+int invaders_pacer_frames_due(invaders_pacer* const p, int speed);
+void invaders_pacer_wait(invaders_pacer* const p, int speed);
+
+// Durations in milliseconds, the last INVADERS_STATS_SIZE of which are kept
+// to compute percentiles.
+typedef struct invaders_stats invaders_stats;
+struct invaders_stats {
+  const char* name;
+  uint32_t count;
+  float samples[INVADERS_STATS_SIZE];
+};
+
+void invaders_stats_add(invaders_stats* const s, double ms);
+void invaders_stats_print(const invaders_stats* const s);
+
+#endif // INVADERS_PACING_H
@@ -0,0 +1,253 @@
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define _POSIX_C_SOURCE 200809L
+#define PACK_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "crc32.h"
+#include "pack.h"
+
+// archive layout (little endian):
+//   0  "INVP" magic
+//   4  version
+//   5  number of entries
+//   6  reserved (2 bytes)
+//   8  crc32 of the entry table (4 bytes)
+//  12  entry table, 36 bytes per entry: name (16 bytes, nul padded), type,
+//      3 reserved bytes, then offset, size, param and crc32 of the data
+//      (4 bytes each)
+//      data of the entries, each aligned on 16 bytes
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 12
+#define PACK_ENTRY_SIZE 36
+#define PACK_ALIGN(x) (((x) + 15) & ~(size_t) 15)
+
+static inline void put32(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+  return p[0] | p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static int map_file(invaders_pack* const p, const char* filename) {
+#ifdef PACK_MMAP
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+  // private mapping: writes (eg. the high score patched in the rom) are
+  // not written back to the file
+  void* data = mmap(
+      NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+  p->data = data;
+  p->size = st.st_size;
+  p->mapped = true;
+  return 0;
+#else
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    return 1;
+  }
+  fseek(f, 0, SEEK_END);
+  const long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  p->data = size > 0 ? malloc(size) : NULL;
+  if (p->data == NULL || fread(p->data, 1, size, f) != (size_t) size) {
+    free(p->data);
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+  p->size = size;
+  p->mapped = false;
+  return 0;
+#endif
+}
+
+// opens an archive and checks the hashes of all its entries, returns 0 on
+// success. A missing archive is not reported (the separate files are used
+// instead), a corrupted one is.
+int invaders_pack_open(invaders_pack* const p, const char* filename) {
+  memset(p, 0, sizeof *p);
+  if (map_file(p, filename) != 0) {
+    return 1;
+  }
+
+  const uint8_t* const d = p->data;
+  const int count = p->size >= PACK_HEADER_SIZE ? d[5] : 0;
+  const size_t table_end = PACK_HEADER_SIZE + count * PACK_ENTRY_SIZE;
+  if (p->size < PACK_HEADER_SIZE || memcmp(d, "INVP", 4) != 0 ||
+      d[4] != PACK_VERSION || count > INVADERS_PACK_MAX_ENTRIES ||
+      p->size < table_end ||
+      invaders_crc32(0, &d[PACK_HEADER_SIZE], count * PACK_ENTRY_SIZE) !=
+          get32(&d[8])) {
+    fprintf(stderr, "error: '%s' is not a valid archive.\n", filename);
+    invaders_pack_close(p);
+    return 1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const uint8_t* const e = &d[PACK_HEADER_SIZE + i * PACK_ENTRY_SIZE];
+    invaders_pack_entry* const entry = &p->entries[i];
+    memcpy(entry->name, e, INVADERS_PACK_NAME_SIZE);
+    entry->name[INVADERS_PACK_NAME_SIZE - 1] = '\0';
+    entry->type = e[16];
+    entry->offset = get32(&e[20]);
+    entry->size = get32(&e[24]);
+    entry->param = get32(&e[28]);
+    entry->crc = get32(&e[32]);
+
+    if (entry->offset < table_end || entry->offset > p->size ||
+        entry->size > p->size - entry->offset ||
+        invaders_crc32(0, &d[entry->offset], entry->size) != entry->crc) {
+      fprintf(stderr, "error: entry '%s' of archive '%s' is corrupted.\n",
+          entry->name, filename);
+      invaders_pack_close(p);
+      return 1;
+    }
+  }
+  p->entry_count = count;
+  return 0;
+}
+
+void invaders_pack_close(invaders_pack* const p) {
+#ifdef PACK_MMAP
+  if (p->mapped) {
+    munmap(p->data, p->size);
+  } else {
+    free(p->data);
+  }
+#else
+  free(p->data);
+#endif
+  p->data = NULL;
+  p->size = 0;
+  p->entry_count = 0;
+}
+
+const invaders_pack_entry* invaders_pack_find(
+    const invaders_pack* const p, const char* name) {
+  for (int i = 0; i < p->entry_count; i++) {
+    if (strcmp(p->entries[i].name, name) == 0) {
+      return &p->entries[i];
+    }
+  }
+  return NULL;
+}
+
+// loads the rom chunks of the archive: when they cover the whole rom and
+// are stored contiguously (as written by the pack tool), the rom is used in
+// place, without any copy. The archive must stay open as long as the rom
+// is used.
+int invaders_pack_load_rom(invaders_pack* const p, invaders_rom* const rom) {
+  uint32_t base = 0;
+  size_t covered = 0;
+  bool contiguous = true;
+
+  for (int i = 0; i < p->entry_count; i++) {
+    const invaders_pack_entry* const e = &p->entries[i];
+    if (e->type != INVADERS_PACK_ROM) {
+      continue;
+    }
+    if (e->param >= ROM_SIZE || e->size > ROM_SIZE - e->param) {
+      fprintf(stderr, "error: rom entry '%s' is out of the rom\n", e->name);
+      return 1;
+    }
+    if (covered == 0) {
+      base = e->offset - e->param;
+    }
+    contiguous = contiguous && e->offset >= e->param &&
+                 e->offset == base + e->param;
+    covered += e->size;
+  }
+
+  if (contiguous && covered == ROM_SIZE && base + ROM_SIZE <= p->size) {
+    invaders_rom_map(rom, &p->data[base]);
+    return 0;
+  }
+
+  for (int i = 0; i < p->entry_count; i++) {
+    const invaders_pack_entry* const e = &p->entries[i];
+    if (e->type == INVADERS_PACK_ROM &&
+        invaders_rom_load_mem(rom, &p->data[e->offset], e->size, e->param) !=
+            0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// writes an archive of `count` entries: the name, type, size and param of
+// each entry are given, offsets and hashes are computed
+int invaders_pack_save(const char* filename, invaders_pack_entry* entries,
+    const uint8_t* const* data, int count) {
+  if (count > INVADERS_PACK_MAX_ENTRIES) {
+    fprintf(stderr, "error: too many entries in archive\n");
+    return 1;
+  }
+
+  uint8_t header[PACK_HEADER_SIZE + INVADERS_PACK_MAX_ENTRIES *
+                                        PACK_ENTRY_SIZE] = {0};
+  size_t offset = PACK_ALIGN(PACK_HEADER_SIZE + count * PACK_ENTRY_SIZE);
+  for (int i = 0; i < count; i++) {
+    invaders_pack_entry* const entry = &entries[i];
+    entry->offset = offset;
+    entry->crc = invaders_crc32(0, data[i], entry->size);
+    offset = PACK_ALIGN(offset + entry->size);
+
+    uint8_t* const e = &header[PACK_HEADER_SIZE + i * PACK_ENTRY_SIZE];
+    strncpy((char*) e, entry->name, INVADERS_PACK_NAME_SIZE - 1);
+    e[16] = entry->type;
+    put32(&e[20], entry->offset);
+    put32(&e[24], entry->size);
+    put32(&e[28], entry->param);
+    put32(&e[32], entry->crc);
+  }
+  memcpy(header, "INVP", 4);
+  header[4] = PACK_VERSION;
+  header[5] = count;
+  put32(&header[8],
+      invaders_crc32(0, &header[PACK_HEADER_SIZE], count * PACK_ENTRY_SIZE));
+
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "error: can't open archive '%s'.\n", filename);
+    return 1;
+  }
+
+  static const uint8_t PADDING[16];
+  const size_t header_size = PACK_HEADER_SIZE + count * PACK_ENTRY_SIZE;
+  bool ok = fwrite(header, 1, header_size, f) == header_size;
+  size_t written = header_size;
+  for (int i = 0; ok && i < count; i++) {
+    const size_t padding = entries[i].offset - written;
+    ok = fwrite(PADDING, 1, padding, f) == padding &&
+         fwrite(data[i], 1, entries[i].size, f) == entries[i].size;
+    written = entries[i].offset + entries[i].size;
+  }
+
+  if (fclose(f) != 0 || !ok) {
+    fprintf(stderr, "error: can't write archive '%s'.\n", filename);
+    return 1;
+  }
+  return 0;
+}
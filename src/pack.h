@@ -0,0 +1,47 @@
+#ifndef INVADERS_PACK_H
+#define INVADERS_PACK_H
+
+#include "invaders.h"
+
+#define INVADERS_PACK_MAX_ENTRIES 32
+#define INVADERS_PACK_NAME_SIZE 16
+// sample rate of the sounds written by the pack tool
+#define INVADERS_PACK_FREQUENCY 44100
+
+enum {
+  INVADERS_PACK_ROM, // rom chunk, `param` is its address
+  INVADERS_PACK_PCM, // signed 16 bits little endian mono samples, `param`
+                     // is the sample rate
+};
+
+typedef struct invaders_pack_entry invaders_pack_entry;
+struct invaders_pack_entry {
+  char name[INVADERS_PACK_NAME_SIZE]; // file the entry was packed from
+  uint8_t type; // INVADERS_PACK_*
+  uint32_t offset, size; // location in the archive
+  uint32_t param;
+  uint32_t crc;
+};
+
+// Asset archive holding the rom chunks and the decoded sounds, written by
+// the pack tool. The whole file is mapped in memory (copy on write), its
+// hashes are checked when it is opened, and the entries are used in place.
+typedef struct invaders_pack invaders_pack;
+struct invaders_pack {
+  uint8_t* data;
+  size_t size;
+  bool mapped; // data is mapped (else allocated)
+
+  int entry_count;
+  invaders_pack_entry entries[INVADERS_PACK_MAX_ENTRIES];
+};
+
+int invaders_pack_open(invaders_pack* const p, const char* filename);
+void invaders_pack_close(invaders_pack* const p);
+const invaders_pack_entry* invaders_pack_find(
+    const invaders_pack* const p, const char* name);
+int invaders_pack_load_rom(invaders_pack* const p, invaders_rom* const rom);
+int invaders_pack_save(const char* filename, invaders_pack_entry* entries,
+    const uint8_t* const* data, int count);
+
+#endif // INVADERS_PACK_H
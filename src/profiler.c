@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profiler.h"
+
+// words of the guest stack scanned for return addresses: the stack of the
+// game lives at the top of the work ram, below the video ram
+#define STACK_SCAN 64
+#define STACK_END VRAM_ADDR
+
+int invaders_profiler_init(invaders_profiler* const p, uint32_t period) {
+  memset(p, 0, sizeof *p);
+  p->period = period > 0 ? period : 1;
+  p->stacks = calloc(INVADERS_PROFILER_STACKS, sizeof *p->stacks);
+  if (p->stacks == NULL) {
+    fprintf(stderr, "error: can't allocate the profiler\n");
+    return 1;
+  }
+  return 0;
+}
+
+void invaders_profiler_free(invaders_profiler* const p) {
+  free(p->stacks);
+  free(p->symbols);
+  p->stacks = NULL;
+  p->symbols = NULL;
+  p->stack_count = 0;
+  p->symbol_count = 0;
+}
+
+static int compare_symbols(const void* a, const void* b) {
+  const invaders_symbol* const x = a;
+  const invaders_symbol* const y = b;
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+// loads a symbol map: one "ADDRESS NAME" per line, the address in
+// hexadecimal (eg. "0100 DrawAlien" or "$0100 DrawAlien"), blank lines and
+// lines starting with '#' or ';' ignored. A symbol names all the addresses
+// up to the next one.
+int invaders_profiler_load_symbols(
+    invaders_profiler* const p, const char* filename) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) {
+    fprintf(stderr, "error: can't open symbol file '%s'.\n", filename);
+    return 1;
+  }
+
+  char line[256];
+  int capacity = 0;
+  while (fgets(line, sizeof line, f) != NULL) {
+    char* s = line;
+    while (*s == ' ' || *s == '\t') {
+      s++;
+    }
+    if (*s == '$') {
+      s++;
+    }
+
+    char* end;
+    const unsigned long addr = strtoul(s, &end, 16);
+    char name[INVADERS_SYMBOL_SIZE];
+    if (*s == '#' || *s == ';' || end == s || addr > 0xFFFF ||
+        sscanf(end, "%31s", name) != 1) {
+      continue;
+    }
+
+    if (p->symbol_count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      invaders_symbol* const symbols =
+          realloc(p->symbols, capacity * sizeof *symbols);
+      if (symbols == NULL) {
+        fclose(f);
+        return 1;
+      }
+      p->symbols = symbols;
+    }
+    invaders_symbol* const symbol = &p->symbols[p->symbol_count++];
+    symbol->addr = addr;
+    memcpy(symbol->name, name, sizeof name);
+  }
+  fclose(f);
+
+  qsort(p->symbols, p->symbol_count, sizeof *p->symbols, compare_symbols);
+  return 0;
+}
+
+// fills `frames` with the pc, then the routines called on the stack from
+// the innermost one, and returns their number
+static int walk_stack(invaders* const si, uint16_t* frames) {
+  const i8080* const c = &si->cpu;
+  const uint8_t* const code = si->rom->data;
+  int depth = 0;
+  frames[depth++] = c->pc;
+
+  const uint32_t end = c->sp + 2 * STACK_SCAN;
+  for (uint32_t sp = c->sp; sp + 1 < STACK_END && sp < end; sp += 2) {
+    const uint16_t ret = invaders_read(si, sp) | invaders_read(si, sp + 1) << 8;
+    if (ret < 3 || ret >= ROM_SIZE || depth == INVADERS_PROFILER_DEPTH) {
+      continue;
+    }
+    const uint8_t call = code[ret - 3];
+    const uint8_t rst = code[ret - 1];
+    if (call == 0xCD || (call & 0xC7) == 0xC4) { // CALL, Ccc
+      frames[depth++] = code[ret - 2] | code[ret - 1] << 8;
+    } else if ((rst & 0xC7) == 0xC7) { // RST n
+      frames[depth++] = rst & 0x38;
+    }
+  }
+  return depth;
+}
+
+static uint32_t hash_stack(const uint16_t* frames, int depth) {
+  uint32_t hash = 2166136261u; // fnv-1a
+  for (int i = 0; i < depth; i++) {
+    hash = (hash ^ frames[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// records the stack of the machine, called by the scheduler every period
+void invaders_profiler_sample(invaders_profiler* const p, invaders* const si) {
+  uint16_t frames[INVADERS_PROFILER_DEPTH];
+  const int depth = walk_stack(si, frames);
+  p->samples += 1;
+
+  uint32_t slot = hash_stack(frames, depth);
+  for (int probe = 0; probe < INVADERS_PROFILER_STACKS; probe++, slot++) {
+    invaders_stack* const stack =
+        &p->stacks[slot & (INVADERS_PROFILER_STACKS - 1)];
+    if (stack->depth == 0) {
+      // new stack, the table is kept at most 3/4 full to stay fast
+      if (p->stack_count >= INVADERS_PROFILER_STACKS * 3 / 4) {
+        break;
+      }
+      memcpy(stack->frames, frames, depth * sizeof *frames);
+      stack->depth = depth;
+      p->stack_count += 1;
+    } else if (stack->depth != depth ||
+               memcmp(stack->frames, frames, depth * sizeof *frames) != 0) {
+      continue;
+    }
+    stack->count += 1;
+    return;
+  }
+  p->dropped += 1;
+}
+
+// returns the symbol of the routine containing `addr`, or NULL
+static const char* find_symbol(
+    const invaders_profiler* const p, uint16_t addr) {
+  int lo = 0, hi = p->symbol_count;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (p->symbols[mid].addr <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo > 0 ? p->symbols[lo - 1].name : NULL;
+}
+
+static void name_frame(const invaders_profiler* const p, uint16_t addr,
+    char* name, size_t size) {
+  const char* const symbol = find_symbol(p, addr);
+  if (symbol != NULL) {
+    snprintf(name, size, "%s", symbol);
+  } else {
+    snprintf(name, size, "0x%04x", addr);
+  }
+}
+
+// writes the samples as folded stacks: one line per stack, its frames from
+// the outermost separated by ';', then its number of samples (the format
+// read by flamegraph.pl, inferno or speedscope)
+int invaders_profiler_write(
+    const invaders_profiler* const p, const char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) {
+    fprintf(stderr, "error: can't open profile file '%s'.\n", filename);
+    return 1;
+  }
+
+  for (int i = 0; i < INVADERS_PROFILER_STACKS; i++) {
+    const invaders_stack* const stack = &p->stacks[i];
+    if (stack->depth == 0) {
+      continue;
+    }
+
+    char last[INVADERS_SYMBOL_SIZE] = "";
+    for (int frame = stack->depth - 1; frame >= 0; frame--) {
+      char name[INVADERS_SYMBOL_SIZE];
+      name_frame(p, stack->frames[frame], name, sizeof name);
+      // the pc is usually in the innermost routine called
+      if (strcmp(name, last) != 0) {
+        fprintf(f, "%s%s", last[0] ? ";" : "", name);
+        memcpy(last, name, sizeof name);
+      }
+    }
+    fprintf(f, " %llu\n", (unsigned long long) stack->count);
+  }
+
+  if (fclose(f) != 0) {
+    fprintf(stderr, "error: can't write profile file '%s'.\n", filename);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef INVADERS_PROFILER_H
+#define INVADERS_PROFILER_H
+
+#include "invaders.h"
+
+#define INVADERS_PROFILER_DEPTH 16 // frames kept per sample
+#define INVADERS_PROFILER_STACKS 8192 // distinct stacks, power of two
+#define INVADERS_SYMBOL_SIZE 32
+
+typedef struct invaders_symbol invaders_symbol;
+struct invaders_symbol {
+  uint16_t addr;
+  char name[INVADERS_SYMBOL_SIZE];
+};
+
+typedef struct invaders_stack invaders_stack;
+struct invaders_stack {
+  uint16_t frames[INVADERS_PROFILER_DEPTH]; // innermost first
+  int depth; // 0 for a free slot of the table
+  uint64_t count;
+};
+
+// Sampling profiler of the guest code: every `period` cycles, the pc and
+// an approximate call stack are recorded. The stack is recovered from the
+// words of the guest stack that are return addresses, ie. that follow a
+// CALL or RST in rom (the routine called is then known from the operand of
+// the CALL). The samples are written as folded stacks, the input of flame
+// graph tools, with the addresses named after an optional symbol map.
+struct invaders_profiler {
+  uint32_t period;
+  uint64_t samples;
+  uint64_t dropped; // samples of new stacks when the table is full
+
+  invaders_stack* stacks; // hash table of the stacks seen
+  int stack_count;
+
+  invaders_symbol* symbols; // sorted by address
+  int symbol_count;
+};
+
+int invaders_profiler_init(invaders_profiler* const p, uint32_t period);
+void invaders_profiler_free(invaders_profiler* const p);
+int invaders_profiler_load_symbols(
+    invaders_profiler* const p, const char* filename);
+void invaders_profiler_sample(invaders_profiler* const p, invaders* const si);
+int invaders_profiler_write(
+    const invaders_profiler* const p, const char* filename);
+
+#endif // INVADERS_PROFILER_H
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rewind.h"
+
+// keyframes are compressed as a delta against an empty state
+static const uint8_t EMPTY_STATE[INVADERS_STATE_SIZE];
+
+static size_t put_varint(uint8_t* out, size_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+static size_t get_varint(const uint8_t* in, size_t* value) {
+  size_t n = 0;
+  int shift = 0;
+  *value = 0;
+  do {
+    *value |= (size_t) (in[n] & 0x7F) << shift;
+    shift += 7;
+  } while (in[n++] & 0x80);
+  return n;
+}
+
+// compresses `state` as a sequence of (number of unchanged bytes, number of
+// changed bytes, changed bytes xor `base`). Isolated unchanged bytes are
+// kept in the runs of changed bytes. `out` must be at least
+// 2 * INVADERS_STATE_SIZE bytes long.
+static size_t delta_encode(
+    uint8_t* out, const uint8_t* state, const uint8_t* base) {
+  const size_t size = INVADERS_STATE_SIZE;
+  size_t n = 0;
+  size_t i = 0;
+
+  while (i < size) {
+    size_t changed = i;
+    while (changed < size && state[changed] == base[changed]) {
+      changed++;
+    }
+    size_t end = changed;
+    while (end < size && (state[end] != base[end] ||
+                             (end + 1 < size && state[end + 1] != base[end + 1]))) {
+      end++;
+    }
+
+    n += put_varint(&out[n], changed - i);
+    n += put_varint(&out[n], end - changed);
+    for (size_t k = changed; k < end; k++) {
+      out[n++] = state[k] ^ base[k];
+    }
+    i = end;
+  }
+
+  return n;
+}
+
+static void delta_decode(
+    uint8_t* state, const uint8_t* in, size_t size, const uint8_t* base) {
+  memcpy(state, base, INVADERS_STATE_SIZE);
+
+  size_t n = 0;
+  size_t i = 0;
+  while (n < size) {
+    size_t unchanged, changed;
+    n += get_varint(&in[n], &unchanged);
+    n += get_varint(&in[n], &changed);
+    i += unchanged;
+    for (size_t k = 0; k < changed; k++) {
+      state[i++] ^= in[n++];
+    }
+  }
+}
+
+static inline invaders_rewind_entry* entry_at(
+    invaders_rewind* const r, int index) {
+  return &r->entries[(r->first + index) % r->max_entries];
+}
+
+// removes the oldest keyframe, and the deltas that depend on it
+static void drop_oldest(invaders_rewind* const r) {
+  do {
+    r->first = (r->first + 1) % r->max_entries;
+    r->count -= 1;
+  } while (r->count > 0 && entry_at(r, 0)->keyframe_id != entry_at(r, 0)->id);
+}
+
+// finds `size` contiguous bytes in the ring buffer for a new entry, dropping
+// the oldest entries if needed. Returns false if the keyframe `keep` had to
+// be dropped.
+static bool make_room(invaders_rewind* const r, size_t size,
+    unsigned long keep, size_t* offset) {
+  bool kept = true;
+
+  for (;;) {
+    if (r->count == 0) {
+      *offset = 0;
+      return kept;
+    }
+
+    if (r->count < r->max_entries) {
+      const invaders_rewind_entry* const oldest = entry_at(r, 0);
+      const invaders_rewind_entry* const newest = entry_at(r, r->count - 1);
+      const size_t tail = oldest->offset;
+      const size_t head = newest->offset + newest->size;
+
+      if (newest->offset >= tail) {
+        // used: [tail, head[, free: [head, capacity[ and [0, tail[
+        if (r->capacity - head >= size) {
+          *offset = head;
+          return kept;
+        }
+        if (tail >= size) {
+          *offset = 0;
+          return kept;
+        }
+      } else if (tail - head >= size) {
+        // used: [tail, capacity[ and [0, head[, free: [head, tail[
+        *offset = head;
+        return kept;
+      }
+    }
+
+    if (entry_at(r, 0)->id == keep) {
+      kept = false;
+    }
+    drop_oldest(r);
+  }
+}
+
+// creates a rewind buffer of `capacity` bytes holding at most `max_entries`
+// frames, with a keyframe every `keyframe_interval` frames
+int invaders_rewind_init(invaders_rewind* const r, size_t capacity,
+    int max_entries, int keyframe_interval) {
+  r->buffer = malloc(capacity);
+  r->entries = malloc(max_entries * sizeof *r->entries);
+  if (r->buffer == NULL || r->entries == NULL) {
+    fprintf(stderr, "error: cannot allocate rewind buffer\n");
+    free(r->buffer);
+    free(r->entries);
+    return 1;
+  }
+
+  r->capacity = capacity;
+  r->max_entries = max_entries;
+  r->first = 0;
+  r->count = 0;
+  r->keyframe_interval = keyframe_interval;
+  r->since_keyframe = keyframe_interval;
+  r->next_id = 0;
+  r->base_id = 0;
+  return 0;
+}
+
+void invaders_rewind_free(invaders_rewind* const r) {
+  free(r->buffer);
+  free(r->entries);
+  r->buffer = NULL;
+  r->entries = NULL;
+}
+
+// stores the current state of the machine
+void invaders_rewind_push(invaders_rewind* const r, invaders* const si) {
+  uint8_t* const packed = r->packed;
+
+  invaders_save_state(si, r->state);
+  bool keyframe = r->count == 0 || r->since_keyframe >= r->keyframe_interval;
+
+  size_t size, offset;
+  for (;;) {
+    size = delta_encode(packed, r->state, keyframe ? EMPTY_STATE : r->base);
+    if (size > r->capacity) {
+      return;
+    }
+    if (make_room(r, size, keyframe ? r->next_id : r->base_id, &offset)) {
+      break;
+    }
+    // the keyframe of this delta has just been dropped
+    keyframe = true;
+  }
+
+  invaders_rewind_entry* const e = entry_at(r, r->count);
+  e->offset = offset;
+  e->size = size;
+  e->id = r->next_id++;
+  e->keyframe_id = keyframe ? e->id : r->base_id;
+  memcpy(&r->buffer[offset], packed, size);
+  r->count += 1;
+
+  if (keyframe) {
+    memcpy(r->base, r->state, INVADERS_STATE_SIZE);
+    r->base_id = e->id;
+    r->since_keyframe = 0;
+  }
+  r->since_keyframe += 1;
+}
+
+// restores the last stored state and removes it from the buffer, returns 1
+// if the buffer is empty
+int invaders_rewind_pop(invaders_rewind* const r, invaders* const si) {
+  if (r->count == 0) {
+    return 1;
+  }
+
+  const invaders_rewind_entry* const e = entry_at(r, r->count - 1);
+  if (e->keyframe_id == e->id) {
+    delta_decode(r->state, &r->buffer[e->offset], e->size, EMPTY_STATE);
+  } else {
+    if (r->base_id != e->keyframe_id) {
+      // ids are contiguous, so the keyframe is found from the oldest entry
+      const invaders_rewind_entry* const k =
+          entry_at(r, e->keyframe_id - entry_at(r, 0)->id);
+      delta_decode(r->base, &r->buffer[k->offset], k->size, EMPTY_STATE);
+      r->base_id = k->id;
+    }
+    delta_decode(r->state, &r->buffer[e->offset], e->size, r->base);
+  }
+
+  r->next_id = e->id;
+  r->count -= 1;
+  // the next push starts from a new keyframe
+  r->since_keyframe = r->keyframe_interval;
+
+  return invaders_load_state(si, r->state, INVADERS_STATE_SIZE);
+}
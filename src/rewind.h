@@ -0,0 +1,46 @@
+#ifndef INVADERS_REWIND_H
+#define INVADERS_REWIND_H
+
+#include "invaders.h"
+
+// one compressed state in the ring buffer
+typedef struct invaders_rewind_entry invaders_rewind_entry;
+struct invaders_rewind_entry {
+  size_t offset, size; // location in the ring buffer
+  unsigned long id; // sequence number of the entry
+  unsigned long keyframe_id; // entry this one is a delta of (itself if
+                             // it is a keyframe)
+};
+
+// History of the last states of a machine, pushed once per frame. Every
+// `keyframe_interval` frames a full state (a keyframe) is stored, the other
+// frames are stored as a xor delta against their keyframe, compressed with
+// run-length encoding of the unchanged bytes. When the buffer is full, the
+// oldest entries are dropped.
+typedef struct invaders_rewind invaders_rewind;
+struct invaders_rewind {
+  uint8_t* buffer;
+  size_t capacity;
+
+  invaders_rewind_entry* entries;
+  int max_entries;
+  int first, count;
+
+  int keyframe_interval;
+  int since_keyframe;
+  unsigned long next_id;
+
+  // uncompressed keyframe that deltas are computed against/applied to
+  unsigned long base_id;
+  uint8_t base[INVADERS_STATE_SIZE];
+  uint8_t state[INVADERS_STATE_SIZE];
+  uint8_t packed[2 * INVADERS_STATE_SIZE]; // worst case of a compressed state
+};
+
+int invaders_rewind_init(invaders_rewind* const r, size_t capacity,
+    int max_entries, int keyframe_interval);
+void invaders_rewind_free(invaders_rewind* const r);
+void invaders_rewind_push(invaders_rewind* const r, invaders* const si);
+int invaders_rewind_pop(invaders_rewind* const r, invaders* const si);
+
+#endif // INVADERS_REWIND_H
@@ -0,0 +1,172 @@
+#include "crc32.h"
+#include "rollback.h"
+
+#define INPUT_MASK (INVADERS_ROLLBACK_INPUTS - 1)
+#define STATE_COUNT (INVADERS_ROLLBACK_MAX + 1)
+
+// inputs shared by the players (coin and start buttons), and moving one
+// player (fire and joystick)
+#define SHARED_INPUTS 0x07
+#define PLAYER_INPUTS 0x70
+
+// starts a session at the current state of the machine, which must be the
+// same for both players. `player` is the local player (0 or 1), and `delay`
+// is clamped to [0, INVADERS_ROLLBACK_MAX_DELAY].
+void invaders_rollback_init(
+    invaders_rollback* const r, int player, int delay) {
+  delay = delay < 0                             ? 0
+          : delay > INVADERS_ROLLBACK_MAX_DELAY ? INVADERS_ROLLBACK_MAX_DELAY
+                                                : delay;
+  r->player = player;
+  r->delay = delay;
+
+  // the first `delay` frames are played without inputs
+  r->frame = 0;
+  r->local_count = delay;
+  r->remote_count = delay;
+  r->mispredicted = ULONG_MAX;
+  memset(r->inputs, 0, sizeof r->inputs);
+  memset(r->predicted, 0, sizeof r->predicted);
+
+  r->checked = ULONG_MAX;
+  r->verified = ULONG_MAX;
+  for (int i = 0; i < INVADERS_ROLLBACK_INPUTS; i++) {
+    r->check_frames[i] = ULONG_MAX;
+  }
+
+  r->replaying = false;
+  r->rollbacks = 0;
+  r->replayed = 0;
+  r->stalls = 0;
+}
+
+// runs the next frame with the inputs known or predicted, after saving the
+// machine
+static void run_frame(invaders_rollback* const r, invaders* const si) {
+  const unsigned long frame = r->frame;
+  const int remote = !r->player;
+  uint8_t* const inputs = r->inputs[frame & INPUT_MASK];
+
+  invaders_save_state(si, r->states[frame % STATE_COUNT]);
+  if (frame >= r->remote_count) {
+    // predicted: the last remote input is held
+    const unsigned long last = r->remote_count - 1;
+    inputs[remote] =
+        r->remote_count > 0 ? r->inputs[last & INPUT_MASK][remote] : 0;
+  }
+  r->predicted[frame & INPUT_MASK] = inputs[remote];
+
+  // the tilt switch is not part of the inputs, the dip switches are kept
+  si->port1 = (inputs[0] & (SHARED_INPUTS | PLAYER_INPUTS)) |
+              (inputs[1] & SHARED_INPUTS);
+  si->port2 = (si->port2 & ~(PLAYER_INPUTS | 0x04)) |
+              (inputs[1] & PLAYER_INPUTS);
+  invaders_run_frames(si, 1);
+  r->frame += 1;
+}
+
+// checksums the machine at the start of the newest frame run with the
+// inputs of both players
+static void update_check(invaders_rollback* const r) {
+  if (r->frame == 0) {
+    return;
+  }
+  const unsigned long frame =
+      r->remote_count < r->frame ? r->remote_count : r->frame - 1;
+  if (r->check_frames[frame & INPUT_MASK] == frame) {
+    return;
+  }
+  r->checked = frame;
+  r->check_frames[frame & INPUT_MASK] = frame;
+  r->checks[frame & INPUT_MASK] = invaders_crc32(
+      0, r->states[frame % STATE_COUNT], INVADERS_STATE_SIZE);
+}
+
+// runs again the frames since the first misprediction, if a remote input
+// received has shown one. Only the last frame is rendered (if the machine
+// renders its frames), none of them plays sounds.
+void invaders_rollback_sync(invaders_rollback* const r, invaders* const si) {
+  if (r->mispredicted >= r->frame) {
+    r->mispredicted = ULONG_MAX;
+    update_check(r);
+    return;
+  }
+
+  const unsigned long frame = r->frame;
+  const bool skip_render = si->skip_render;
+  invaders_load_state(si, r->states[r->mispredicted % STATE_COUNT],
+      INVADERS_STATE_SIZE);
+  r->rollbacks += 1;
+  r->replayed += frame - r->mispredicted;
+  r->frame = r->mispredicted;
+  r->mispredicted = ULONG_MAX;
+
+  r->replaying = true;
+  si->skip_render = true;
+  while (r->frame < frame) {
+    if (r->frame + 1 == frame) {
+      si->skip_render = skip_render;
+    }
+    run_frame(r, si);
+  }
+  r->replaying = false;
+  update_check(r);
+}
+
+// gives the local input to play in `delay` frames, and runs the next frame
+// (after running again the mispredicted ones). Returns 0 if the frame could
+// not be run: the machine is too far ahead of the remote inputs, and the
+// input is ignored.
+int invaders_rollback_advance(
+    invaders_rollback* const r, invaders* const si, uint8_t input) {
+  // only the new frame is rendered
+  const bool skip_render = si->skip_render;
+  si->skip_render = true;
+  invaders_rollback_sync(r, si);
+  si->skip_render = skip_render;
+  if (r->frame >= r->remote_count + INVADERS_ROLLBACK_MAX) {
+    r->stalls += 1;
+    return 0;
+  }
+
+  r->inputs[r->local_count & INPUT_MASK][r->player] = input;
+  r->local_count += 1;
+  run_frame(r, si);
+  update_check(r);
+  return 1;
+}
+
+// gives the remote input of a frame. The inputs are only taken in order:
+// the others are ignored, and must be given again.
+void invaders_rollback_add_remote(
+    invaders_rollback* const r, unsigned long frame, uint8_t input) {
+  // the inputs too far ahead would overwrite the ones still needed
+  if (frame != r->remote_count ||
+      frame >= r->frame + (INVADERS_ROLLBACK_INPUTS -
+                              INVADERS_ROLLBACK_MAX_DELAY)) {
+    return;
+  }
+  r->inputs[frame & INPUT_MASK][!r->player] = input;
+  r->remote_count += 1;
+  if (frame < r->frame && r->predicted[frame & INPUT_MASK] != input &&
+      r->mispredicted == ULONG_MAX) {
+    r->mispredicted = frame;
+  }
+}
+
+// compares the checksum of a frame computed by the other player with the
+// local one: returns false if they differ, true if they match or if the
+// local one is unknown
+bool invaders_rollback_check(
+    invaders_rollback* const r, unsigned long frame, uint32_t crc) {
+  if (r->check_frames[frame & INPUT_MASK] != frame) {
+    return true;
+  }
+  if (r->checks[frame & INPUT_MASK] != crc) {
+    return false;
+  }
+  if (r->verified == ULONG_MAX || frame > r->verified) {
+    r->verified = frame;
+  }
+  return true;
+}
@@ -0,0 +1,67 @@
+#ifndef INVADERS_ROLLBACK_H
+#define INVADERS_ROLLBACK_H
+
+#include <limits.h>
+
+#include "invaders.h"
+
+#define INVADERS_ROLLBACK_MAX 8 // frames run ahead of the remote inputs
+#define INVADERS_ROLLBACK_MAX_DELAY 8 // frames of input delay
+#define INVADERS_ROLLBACK_INPUTS 64 // frames of inputs kept (power of two)
+
+// Two-player session where each player runs a machine with the inputs of
+// both, the remote ones arriving late. The inputs of a player are one byte,
+// laid out as port 1 for player 1: coin (bit 0), start buttons (bits 1-2),
+// fire and joystick (bits 4-6). Player 1 moves with port 1 and player 2
+// with port 2, both can insert coins and start a game.
+//
+// The remote input of a frame not received yet is predicted to be the last
+// one received. When it arrives and differs from the prediction, the
+// machine is restored as it was at the start of that frame and the frames
+// since are run again with the right inputs (muted and not rendered, see
+// `replaying`). A machine runs at most INVADERS_ROLLBACK_MAX frames past
+// the last remote input, then stalls until more arrive.
+//
+// The local inputs are played `delay` frames after they are given, so that
+// they reach the other player in time (fewer rollbacks, more latency).
+// Both players must use the same delay.
+typedef struct invaders_rollback invaders_rollback;
+struct invaders_rollback {
+  int player; // local player, 0 or 1
+  int delay;
+
+  unsigned long frame; // number of frames run
+  unsigned long local_count; // local inputs given, for frames [0, count[
+  unsigned long remote_count; // remote inputs received
+  unsigned long mispredicted; // first frame run with a wrong prediction
+                              // (ULONG_MAX if none)
+
+  uint8_t inputs[INVADERS_ROLLBACK_INPUTS][2]; // by frame, then player
+  uint8_t predicted[INVADERS_ROLLBACK_INPUTS]; // remote input each frame
+                                               // was run with
+  // machine at the start of each of the last frames
+  uint8_t states[INVADERS_ROLLBACK_MAX + 1][INVADERS_STATE_SIZE];
+
+  // checksums of the machine at the start of the last frames run with the
+  // inputs of both players, to detect a desync
+  unsigned long checked; // newest frame checksummed (ULONG_MAX if none)
+  unsigned long verified; // newest frame checksummed by both players, with
+                          // the same result (ULONG_MAX if none)
+  unsigned long check_frames[INVADERS_ROLLBACK_INPUTS];
+  uint32_t checks[INVADERS_ROLLBACK_INPUTS];
+
+  bool replaying; // set while frames are run again after a misprediction
+  unsigned long rollbacks, replayed, stalls; // statistics
+};
+
+void invaders_rollback_init(
+    invaders_rollback* const r, int player, int delay);
+int invaders_rollback_advance(
+    invaders_rollback* const r, invaders* const si, uint8_t input);
+void invaders_rollback_sync(invaders_rollback* const r, invaders* const si);
+void invaders_rollback_add_remote(
+    invaders_rollback* const r, unsigned long frame, uint8_t input);
+bool invaders_rollback_check(
+    invaders_rollback* const r, unsigned long frame, uint32_t crc);
+
+#endif // INVADERS_ROLLBACK_H
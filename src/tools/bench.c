@@ -0,0 +1,352 @@
+// benchmark of the whole emulator, headless: runs a number of frames from a
+// cold boot, then as many frames of a game played by a built-in input
+// script, then replays an input movie if one is given. Reports the emulated
+// clock speed, the frames per second, the time spent in each stage (cpu,
+// screen rendering, movie checks, and the rest), the number of sounds
+// played, the size of a machine and the peak memory usage, as text or json.
+// Fails if a run is below the given thresholds.
+//
+// usage: invaders_bench [--frames N] [--movie FILE] [--roms DIR] [--json]
+//                       [--min-mhz X] [--min-fps X]
+//                       [--engine interpreter|threaded|recompiled]
+//                       [--profile FILE [--symbols FILE] [--sample-period N]]
+//
+// --engine runs the cpu with another engine than the default one of the
+// build (recompiled in builds with INVADERS_RECOMPILE, threaded otherwise).
+//
+// with --profile, the guest code is sampled every N cycles (1000 by default)
+// and the folded stacks written to FILE, see profiler.h.
+//
+// built with INVADERS_INSTRUMENT, it also prints the counters of the
+// instrumentation, and writes the trace of the stages with --trace FILE.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "instrument.h"
+#include "invaders.h"
+#include "movie.h"
+#include "profiler.h"
+
+typedef struct bench_run bench_run;
+struct bench_run {
+  const char* name;
+  unsigned long frames;
+  uint64_t cycles;
+  double total, cpu, render, movie; // seconds
+  unsigned long sound_events;
+};
+
+static invaders_profiler* profiler = NULL;
+static int engine = -1; // INVADERS_ENGINE_*, -1 for the default one
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// peak resident set size in kilobytes, -1 if unknown
+static long peak_rss_kb(void) {
+#if defined(__unix__) || defined(__APPLE__)
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return -1;
+  }
+#if defined(__APPLE__)
+  return usage.ru_maxrss / 1024; // in bytes on macOS
+#else
+  return usage.ru_maxrss;
+#endif
+#else
+  return -1;
+#endif
+}
+
+static void play_sound(invaders* const si, int sound) {
+  bench_run* const run = (bench_run*) si->userdata;
+  (void) sound;
+  run->sound_events += 1;
+}
+
+// inputs of the scripted run (port 1) at each frame: a coin is inserted and
+// a one player game started every 2048 frames (about 34 s), and meanwhile
+// the cannon moves left and right and fires every half second
+static uint8_t script_inputs(unsigned long frame) {
+  const unsigned long t = frame % 2048;
+  if (t >= 60 && t < 66) {
+    return 1 << 0; // coin
+  }
+  if (t >= 120 && t < 126) {
+    return 1 << 2; // one player button
+  }
+  uint8_t port1 = 0;
+  if (t % 128 < 48) {
+    port1 |= 1 << 5; // left
+  } else if (t % 128 >= 64 && t % 128 < 112) {
+    port1 |= 1 << 6; // right
+  }
+  if (t % 32 < 4) {
+    port1 |= 1 << 4; // fire
+  }
+  return port1;
+}
+
+static int load_roms(invaders_rom* const rom, const char* dir) {
+  static const char* FILES[] = {
+      "invaders.h", "invaders.g", "invaders.f", "invaders.e"};
+  char path[1024];
+
+  invaders_rom_init(rom);
+  for (int i = 0; i < 4; i++) {
+    snprintf(path, sizeof path, "%s/%s", dir, FILES[i]);
+    if (invaders_rom_load(rom, path, i * 0x800) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// runs `frames` frames, with the inputs of the script if `scripted` (or
+// the whole movie if `movie` is not NULL): the screen is rendered at each
+// vblank outside of the core, to time it apart
+static int run(bench_run* const r, invaders* const si, invaders_rom* const rom,
+    invaders_movie* const movie, bool scripted, unsigned long frames) {
+  invaders_init(si, rom);
+  si->userdata = r;
+  si->play_sound = play_sound;
+  si->skip_render = true;
+  if (engine >= 0) {
+    si->engine = engine;
+  }
+  if (profiler != NULL) {
+    invaders_set_profiler(si, profiler);
+  }
+
+  if (movie != NULL) {
+    if (invaders_movie_play_start(movie, si) != 0) {
+      return 1;
+    }
+    frames = movie->frame_count;
+  }
+
+  const double start = now();
+  for (unsigned long i = 0; i < frames; i++) {
+    if (scripted) {
+      si->port1 = script_inputs(i);
+    }
+    double t = now();
+    invaders_run_frames(si, 1);
+    r->cpu += now() - t;
+
+    t = now();
+    invaders_gpu_update(si);
+    r->render += now() - t;
+
+    if (movie != NULL) {
+      t = now();
+      if (invaders_movie_play_frame(movie, si) != 0) {
+        return 1;
+      }
+      r->movie += now() - t;
+    }
+  }
+  r->total = now() - start;
+  r->frames = frames;
+  r->cycles = si->cycles;
+  return 0;
+}
+
+static double mhz(const bench_run* const r) {
+  return r->cycles / r->total / 1e6;
+}
+
+static double fps(const bench_run* const r) {
+  return r->frames / r->total;
+}
+
+// time of the run outside of the stages measured (timers, loop)
+static double other(const bench_run* const r) {
+  return r->total - r->cpu - r->render - r->movie;
+}
+
+static void print_text(const bench_run* const runs, int count) {
+  for (int i = 0; i < count; i++) {
+    const bench_run* const r = &runs[i];
+    printf("%s: %lu frames in %.3f s\n", r->name, r->frames, r->total);
+    printf("  emulated clock: %.1f MHz (x%.1f), %.0f frames/s\n", mhz(r),
+        r->cycles / r->total / CLOCK_SPEED, fps(r));
+    printf("  cpu:    %8.3f s (%4.1f%%)\n", r->cpu, 100 * r->cpu / r->total);
+    printf("  render: %8.3f s (%4.1f%%)\n", r->render,
+        100 * r->render / r->total);
+    if (r->movie > 0) {
+      printf("  movie:  %8.3f s (%4.1f%%)\n", r->movie,
+          100 * r->movie / r->total);
+    }
+    printf("  other:  %8.3f s (%4.1f%%)\n", other(r),
+        100 * other(r) / r->total);
+    printf("  sounds: %lu\n", r->sound_events);
+  }
+  printf("machine: %zu bytes\n", sizeof(invaders));
+  printf("peak rss: %ld KB\n", peak_rss_kb());
+}
+
+static void print_json(const bench_run* const runs, int count) {
+  printf("{\n  \"runs\": [\n");
+  for (int i = 0; i < count; i++) {
+    const bench_run* const r = &runs[i];
+    printf("    {\"name\": \"%s\", \"frames\": %lu, \"cycles\": %llu, "
+           "\"seconds\": %.6f, \"mhz\": %.3f, \"fps\": %.1f, "
+           "\"cpu_seconds\": %.6f, \"render_seconds\": %.6f, "
+           "\"movie_seconds\": %.6f, \"other_seconds\": %.6f, "
+           "\"sound_events\": %lu}%s\n",
+        r->name, r->frames, (unsigned long long) r->cycles, r->total, mhz(r),
+        fps(r), r->cpu, r->render, r->movie, other(r), r->sound_events,
+        i + 1 < count ? "," : "");
+  }
+  printf("  ],\n  \"machine_bytes\": %zu,\n  \"peak_rss_kb\": %ld\n}\n",
+      sizeof(invaders), peak_rss_kb());
+}
+
+int main(int argc, char** argv) {
+  unsigned long frames = 10000;
+  const char* movie_path = NULL;
+  const char* roms_dir = "roms";
+  bool json = false;
+  double min_mhz = 0;
+  double min_fps = 0;
+  const char* profile_path = NULL;
+  const char* symbols_path = NULL;
+  unsigned long sample_period = 1000;
+#ifdef INVADERS_INSTRUMENT
+  const char* trace_path = NULL;
+#endif
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--movie") == 0 && i + 1 < argc) {
+      movie_path = argv[++i];
+    } else if (strcmp(argv[i], "--roms") == 0 && i + 1 < argc) {
+      roms_dir = argv[++i];
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "--min-mhz") == 0 && i + 1 < argc) {
+      min_mhz = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--min-fps") == 0 && i + 1 < argc) {
+      min_fps = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      static const char* ENGINES[] = {"interpreter", "threaded", "recompiled"};
+      engine = -1;
+      for (int e = 0; e < 3; e++) {
+        if (strcmp(argv[i + 1], ENGINES[e]) == 0) {
+          engine = e;
+        }
+      }
+      if (engine < 0) {
+        fprintf(stderr, "error: unknown engine %s\n", argv[i + 1]);
+        return 1;
+      }
+      i += 1;
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+      symbols_path = argv[++i];
+    } else if (strcmp(argv[i], "--sample-period") == 0 && i + 1 < argc) {
+      sample_period = strtoul(argv[++i], NULL, 10);
+#ifdef INVADERS_INSTRUMENT
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+#endif
+    } else {
+      fprintf(stderr,
+          "usage: %s [--frames N] [--movie FILE] [--roms DIR] [--json] "
+          "[--min-mhz X] [--min-fps X] "
+          "[--engine interpreter|threaded|recompiled] "
+          "[--profile FILE [--symbols FILE] [--sample-period N]]\n",
+          argv[0]);
+      return 1;
+    }
+  }
+
+  static invaders_rom rom;
+  static invaders si;
+  static invaders_movie movie;
+  static invaders_profiler guest_profiler;
+  if (load_roms(&rom, roms_dir) != 0) {
+    return 1;
+  }
+  if (engine == INVADERS_ENGINE_RECOMPILED && rom.blocks == NULL) {
+    fprintf(stderr, "warning: the rom was not recompiled in this build, "
+                    "it is run by the threaded engine\n");
+  }
+  if (profile_path != NULL) {
+    if (invaders_profiler_init(&guest_profiler, sample_period) != 0 ||
+        (symbols_path != NULL &&
+            invaders_profiler_load_symbols(&guest_profiler, symbols_path) !=
+                0)) {
+      return 1;
+    }
+    profiler = &guest_profiler;
+  }
+
+  bench_run runs[3] = {
+      {.name = "cold_boot"}, {.name = "script"}, {.name = "movie"}};
+  int count = 2;
+  if (run(&runs[0], &si, &rom, NULL, false, frames) != 0 ||
+      run(&runs[1], &si, &rom, NULL, true, frames) != 0) {
+    return 1;
+  }
+  if (movie_path != NULL) {
+    if (invaders_movie_load(&movie, movie_path) != 0 ||
+        run(&runs[2], &si, &rom, &movie, false, 0) != 0) {
+      return 1;
+    }
+    invaders_movie_free(&movie);
+    count = 3;
+  }
+
+  if (json) {
+    print_json(runs, count);
+  } else {
+    print_text(runs, count);
+  }
+
+  if (profiler != NULL) {
+    const int error = invaders_profiler_write(profiler, profile_path);
+    fprintf(stderr, "profile: %llu samples, %d stacks (%llu dropped)\n",
+        (unsigned long long) profiler->samples, profiler->stack_count,
+        (unsigned long long) profiler->dropped);
+    invaders_profiler_free(profiler);
+    if (error != 0) {
+      return 1;
+    }
+  }
+
+#ifdef INVADERS_INSTRUMENT
+  invaders_instrument_summary(stderr);
+  if (trace_path != NULL && invaders_instrument_export(trace_path) != 0) {
+    return 1;
+  }
+#endif
+
+  int result = 0;
+  for (int i = 0; i < count; i++) {
+    if (mhz(&runs[i]) < min_mhz) {
+      fprintf(stderr, "error: %s: %.1f MHz is below the threshold (%.1f)\n",
+          runs[i].name, mhz(&runs[i]), min_mhz);
+      result = 1;
+    }
+    if (fps(&runs[i]) < min_fps) {
+      fprintf(stderr, "error: %s: %.0f frames/s is below the threshold (%.0f)\n",
+          runs[i].name, fps(&runs[i]), min_fps);
+      result = 1;
+    }
+  }
+  return result;
+}
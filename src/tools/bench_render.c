@@ -0,0 +1,124 @@
+// microbenchmark of the screen rendering: renders random video ram with the
+// previous per-pixel renderer and with the current one
+// (invaders_render_screen), checks that both give the same screen and
+// prints the time per frame of each.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "invaders.h"
+
+#define FRAMES 2000
+
+typedef uint8_t screen_buffer[SCREEN_HEIGHT][SCREEN_WIDTH][4];
+
+// the renderer before the tile/lookup table rewrite, kept as a reference
+static void legacy_render(invaders* const si, screen_buffer screen) {
+  for (int i = 0; i < 256 * 224 / 8; i++) {
+    const int y = i * 8 / 256;
+    const int base_x = (i * 8) % 256;
+    const uint8_t cur_byte = invaders_get_vram(si)[i];
+
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      int px = base_x + bit;
+      int py = y;
+      const bool is_pixel_lit = (cur_byte >> bit) & 1;
+      uint8_t r = 0, g = 0, b = 0;
+
+      if (!si->colored_screen && is_pixel_lit) {
+        r = 255;
+        g = 255;
+        b = 255;
+      } else if (si->colored_screen && is_pixel_lit) {
+        if (px < 16) {
+          if (py < 16 || py > 118 + 16) {
+            r = 255;
+            g = 255;
+            b = 255;
+          } else {
+            g = 255;
+          }
+        } else if (px >= 16 && px <= 16 + 56) {
+          g = 255;
+        } else if (px >= 16 + 56 + 120 && px < 16 + 56 + 120 + 32) {
+          r = 255;
+        } else {
+          r = 255;
+          g = 255;
+          b = 255;
+        }
+      }
+
+      const int temp_x = px;
+      px = py;
+      py = -temp_x + SCREEN_HEIGHT - 1;
+
+      screen[py][px][0] = r;
+      screen[py][px][1] = g;
+      screen[py][px][2] = b;
+    }
+  }
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint8_t* vram(invaders* const si) {
+  return &si->ram[VRAM_ADDR - RAM_ADDR];
+}
+
+static void randomize_vram(invaders* const si, unsigned seed) {
+  srand(seed);
+  for (int i = 0; i < VRAM_SIZE; i++) {
+    vram(si)[i] = rand() & 0xFF;
+  }
+}
+
+static void current_render(invaders* const si, screen_buffer screen) {
+  invaders_render_screen(si, screen, 0, SCREEN_WIDTH);
+}
+
+// measures the rendering of whole frames
+static double bench(invaders* const si,
+    void (*render)(invaders* const, screen_buffer), screen_buffer screen) {
+  randomize_vram(si, 1);
+  const double start = now_ns();
+  for (int i = 0; i < FRAMES; i++) {
+    vram(si)[i % VRAM_SIZE] ^= 0xFF;
+    render(si, screen);
+  }
+  return (now_ns() - start) / FRAMES;
+}
+
+int main(void) {
+  static invaders_rom rom;
+  static invaders si;
+  static screen_buffer expected, screen;
+  invaders_rom_init(&rom);
+  invaders_init(&si, &rom);
+
+  for (int colored = 0; colored < 2; colored++) {
+    si.colored_screen = colored;
+    randomize_vram(&si, 42 + colored);
+
+    legacy_render(&si, expected);
+    memset(screen, 0, sizeof screen);
+    current_render(&si, screen);
+
+    if (memcmp(expected, screen, sizeof expected) != 0) {
+      fprintf(stderr, "error: renderers disagree (colored=%d)\n", colored);
+      return 1;
+    }
+  }
+
+  si.colored_screen = true;
+  const double before = bench(&si, legacy_render, screen);
+  const double after = bench(&si, current_render, screen);
+
+  printf("legacy renderer:  %10.0f ns/frame\n", before);
+  printf("current renderer: %10.0f ns/frame (x%.1f)\n", after, before / after);
+  return 0;
+}
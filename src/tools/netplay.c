@@ -0,0 +1,211 @@
+// plays a two-player session over the network without window nor sound,
+// with the inputs of a bot, to test the rollback netplay: run it once for
+// each player (eg. on the same host), through a shim dropping and delaying
+// the packets sent. Both players check at every frame that their machines
+// are in the same state; at the end, the state of the last frame is
+// printed.
+//
+// usage: invaders_netplay --player 1|2 --port PORT --peer HOST:PORT
+//                         [--delay FRAMES] [--frames N] [--roms DIR]
+//                         [--latency MS] [--jitter MS] [--loss P]
+//                         [--seed N] [--speed X]
+//
+// the bot of player 1 inserts two coins and starts a two-player game, then
+// both bots move and shoot at random. --speed runs at X times the speed of
+// the game (1 by default), 0 as fast as possible.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32.h"
+#include "invaders.h"
+#include "netplay.h"
+
+#define TIMEOUT 10.0 // s without progress before giving up
+#define LINGER 0.5 // s spent sending after the end, for the other player
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_for(double delay) {
+  if (delay > 0) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) delay;
+    ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+  }
+}
+
+static int load_roms(invaders_rom* const rom, const char* dir) {
+  static const char* FILES[] = {
+      "invaders.h", "invaders.g", "invaders.f", "invaders.e"};
+  char path[1024];
+
+  invaders_rom_init(rom);
+  for (int i = 0; i < 4; i++) {
+    snprintf(path, sizeof path, "%s/%s", dir, FILES[i]);
+    if (invaders_rom_load(rom, path, i * 0x800) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+typedef struct bot bot;
+struct bot {
+  uint32_t random; // xorshift state
+  uint8_t held; // fire and joystick
+  unsigned long until; // frame the held inputs are changed at
+};
+
+// input of the bot of `player` at `frame` (laid out as port 1, see
+// rollback.h)
+static uint8_t bot_input(bot* const b, int player, unsigned long frame) {
+  if (player == 0 && frame < 240) {
+    const bool coin =
+        (frame >= 60 && frame < 66) || (frame >= 90 && frame < 96);
+    const bool start = frame >= 150 && frame < 156;
+    return (coin ? 0x01 : 0) | (start ? 0x02 : 0);
+  }
+  if (frame >= b->until) {
+    b->random ^= b->random << 13;
+    b->random ^= b->random >> 17;
+    b->random ^= b->random << 5;
+    // left or right or none, fire or not, for 10 to 40 frames
+    const uint8_t moves[3] = {0, 0x20, 0x40};
+    b->held = moves[b->random % 3] | ((b->random >> 8) & 1 ? 0x10 : 0);
+    b->until = frame + 10 + (b->random >> 16) % 31;
+  }
+  return b->held;
+}
+
+int main(int argc, char** argv) {
+  int player = -1;
+  int port = 0;
+  const char* peer = NULL;
+  int delay = 2;
+  unsigned long frames = 3600;
+  const char* roms_dir = "roms";
+  invaders_netplay_shim shim = {.latency = 0, .jitter = 0, .loss = 0};
+  uint32_t seed = 1;
+  double speed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--player") == 0 && i + 1 < argc) {
+      player = atoi(argv[++i]) - 1;
+    } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+      peer = argv[++i];
+    } else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {
+      delay = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--roms") == 0 && i + 1 < argc) {
+      roms_dir = argv[++i];
+    } else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+      shim.latency = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--jitter") == 0 && i + 1 < argc) {
+      shim.jitter = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+      shim.loss = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+      speed = strtod(argv[++i], NULL);
+    } else {
+      player = -1;
+      break;
+    }
+  }
+  if ((player != 0 && player != 1) || port <= 0 || peer == NULL ||
+      frames == 0) {
+    fprintf(stderr,
+        "usage: %s --player 1|2 --port PORT --peer HOST:PORT "
+        "[--delay FRAMES] [--frames N] [--roms DIR] [--latency MS] "
+        "[--jitter MS] [--loss P] [--seed N] [--speed X]\n",
+        argv[0]);
+    return 1;
+  }
+
+  static invaders_rom rom;
+  static invaders si;
+  if (load_roms(&rom, roms_dir) != 0) {
+    return 1;
+  }
+  invaders_init(&si, &rom);
+
+  invaders_netplay* const n =
+      invaders_netplay_open(player, delay, port, peer, &shim);
+  if (n == NULL) {
+    return 1;
+  }
+  const invaders_rollback* const r = invaders_netplay_rollback(n);
+
+  bot b = {.random = seed * 2654435761u + player + 1, .held = 0, .until = 0};
+  int result = 0;
+  const double start = now();
+  double last_progress = start;
+  while (r->frame < frames) {
+    const unsigned long local_count = r->local_count;
+    const int ran =
+        invaders_netplay_frame(n, &si, bot_input(&b, player, local_count));
+    if (ran < 0) {
+      result = 1;
+      break;
+    }
+
+    const double t = now();
+    if (ran == 0) {
+      // stalled, the same input is given again
+      if (t - last_progress > TIMEOUT) {
+        fprintf(stderr, "error: no input from the other player\n");
+        result = 1;
+        break;
+      }
+      sleep_for(0.001);
+      continue;
+    }
+    last_progress = t;
+    if (speed > 0) {
+      sleep_for(start + r->frame / (FPS * speed) - t);
+    }
+  }
+
+  // waits for the last inputs of the other player, and until it has
+  // checked the last frame too
+  while (result == 0 &&
+         (r->remote_count < frames || r->verified == ULONG_MAX ||
+             r->verified + 1 < frames)) {
+    if (invaders_netplay_sync(n, &si) != 0) {
+      result = 1;
+    } else if (now() - last_progress > TIMEOUT) {
+      fprintf(stderr, "error: the other player has not checked the end\n");
+      result = 1;
+    }
+    sleep_for(0.001);
+  }
+  const double total = now() - start;
+  const double linger_end =
+      now() + LINGER + (shim.latency + shim.jitter) / 1000.0;
+  while (result == 0 && now() < linger_end) {
+    invaders_netplay_sync(n, &si);
+    sleep_for(0.001);
+  }
+
+  if (result == 0) {
+    uint8_t state[INVADERS_STATE_SIZE];
+    invaders_save_state(&si, state);
+    printf("%lu frames in %.3f s, checked by both players, state crc %08x, "
+           "ram crc %08x\n",
+        r->frame, total, (unsigned) invaders_crc32(0, state, sizeof state),
+        (unsigned) invaders_crc32(0, si.ram, RAM_SIZE));
+  }
+  invaders_netplay_close(n);
+  return result;
+}
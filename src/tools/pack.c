@@ -0,0 +1,188 @@
+// packs the rom chunks and the sounds of the game into one asset archive
+// (see pack.h), loaded by the emulator in place of the separate files. The
+// wav files are decoded and resampled to INVADERS_PACK_FREQUENCY here, so
+// that the emulator can play them without any conversion.
+//
+// usage: invaders_pack [--roms DIR] OUTPUT
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pack.h"
+
+static const char* ROM_FILES[] = {
+    "invaders.h", "invaders.g", "invaders.f", "invaders.e"};
+static const char* SOUND_FILES[] = {"8.wav", "1.wav", "2.wav", "3.wav",
+    "4.wav", "5.wav", "6.wav", "7.wav", "0.wav"};
+
+static uint8_t* read_file(const char* dir, const char* name, size_t* size) {
+  char path[1024];
+  snprintf(path, sizeof path, "%s/%s", dir, name);
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+
+  fseek(f, 0, SEEK_END);
+  const long file_size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t* data = file_size > 0 ? malloc(file_size) : NULL;
+  if (data != NULL) {
+    *size = fread(data, 1, file_size, f);
+  }
+  fclose(f);
+  return data;
+}
+
+static inline uint16_t get16(const uint8_t* p) {
+  return p[0] | p[1] << 8;
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+  return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+// decodes a pcm wav file (8 or 16 bits, any number of channels) to signed
+// 16 bits little endian mono samples at INVADERS_PACK_FREQUENCY
+static uint8_t* decode_wav(const uint8_t* wav, size_t size, uint32_t* out_size) {
+  if (size < 12 || memcmp(wav, "RIFF", 4) != 0 ||
+      memcmp(wav + 8, "WAVE", 4) != 0) {
+    return NULL;
+  }
+
+  int channels = 0, rate = 0, bits = 0;
+  const uint8_t* samples = NULL;
+  uint32_t samples_size = 0;
+  for (size_t pos = 12; pos + 8 <= size;) {
+    const uint32_t chunk_size = get32(wav + pos + 4);
+    const uint8_t* const chunk = wav + pos + 8;
+    if (chunk_size > size - pos - 8) {
+      return NULL;
+    }
+    if (memcmp(wav + pos, "fmt ", 4) == 0 && chunk_size >= 16) {
+      if (get16(chunk) != 1) {
+        return NULL; // not pcm
+      }
+      channels = get16(chunk + 2);
+      rate = get32(chunk + 4);
+      bits = get16(chunk + 14);
+    } else if (memcmp(wav + pos, "data", 4) == 0) {
+      samples = chunk;
+      samples_size = chunk_size;
+    }
+    pos += 8 + chunk_size + (chunk_size & 1);
+  }
+  if (samples == NULL || channels == 0 || rate == 0 ||
+      (bits != 8 && bits != 16)) {
+    return NULL;
+  }
+
+  const uint32_t frame_size = channels * bits / 8;
+  const uint32_t frames = samples_size / frame_size;
+  const uint32_t out_frames =
+      (uint64_t) frames * INVADERS_PACK_FREQUENCY / rate;
+  uint8_t* const out = malloc(out_frames * 2 + 1);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  for (uint32_t i = 0; i < out_frames; i++) {
+    // linear interpolation between the two nearest source frames
+    const double t = (double) i * rate / INVADERS_PACK_FREQUENCY;
+    const uint32_t a = (uint32_t) t;
+    const uint32_t b = a + 1 < frames ? a + 1 : a;
+    double value[2] = {0, 0};
+    for (int k = 0; k < 2; k++) {
+      const uint8_t* const frame = samples + (k == 0 ? a : b) * frame_size;
+      for (int c = 0; c < channels; c++) {
+        value[k] += bits == 8 ? (frame[c] - 128) * 256
+                              : (int16_t) get16(frame + c * 2);
+      }
+      value[k] /= channels;
+    }
+    const int16_t sample = value[0] + (value[1] - value[0]) * (t - a);
+    out[i * 2] = sample & 0xFF;
+    out[i * 2 + 1] = (sample >> 8) & 0xFF;
+  }
+
+  *out_size = out_frames * 2;
+  return out;
+}
+
+int main(int argc, char** argv) {
+  const char* roms_dir = "roms";
+  const char* output = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--roms") == 0 && i + 1 < argc) {
+      roms_dir = argv[++i];
+    } else if (output == NULL && argv[i][0] != '-') {
+      output = argv[i];
+    } else {
+      output = NULL;
+      break;
+    }
+  }
+  if (output == NULL) {
+    fprintf(stderr, "usage: %s [--roms DIR] OUTPUT\n", argv[0]);
+    return 1;
+  }
+
+  invaders_pack_entry entries[INVADERS_PACK_MAX_ENTRIES];
+  uint8_t* data[INVADERS_PACK_MAX_ENTRIES];
+  int count = 0;
+  int result = 0;
+
+  // the rom chunks first, in the order of their addresses, so that they
+  // are contiguous in the archive
+  for (int i = 0; i < 4; i++) {
+    size_t size = 0;
+    data[count] = read_file(roms_dir, ROM_FILES[i], &size);
+    if (data[count] == NULL || size != 0x800) {
+      fprintf(stderr, "error: can't read rom file %s/%s\n", roms_dir,
+          ROM_FILES[i]);
+      free(data[count]);
+      result = 1;
+      goto done;
+    }
+    snprintf(entries[count].name, INVADERS_PACK_NAME_SIZE, "%s", ROM_FILES[i]);
+    entries[count].type = INVADERS_PACK_ROM;
+    entries[count].size = size;
+    entries[count].param = i * 0x800;
+    count += 1;
+  }
+
+  for (int i = 0; i < INVADERS_SOUND_COUNT; i++) {
+    size_t size = 0;
+    uint8_t* const wav = read_file(roms_dir, SOUND_FILES[i], &size);
+    if (wav == NULL) {
+      fprintf(stderr, "warning: no sound file %s/%s\n", roms_dir,
+          SOUND_FILES[i]);
+      continue;
+    }
+
+    data[count] = decode_wav(wav, size, &entries[count].size);
+    free(wav);
+    if (data[count] == NULL) {
+      fprintf(stderr, "error: can't decode sound file %s/%s\n", roms_dir,
+          SOUND_FILES[i]);
+      result = 1;
+      goto done;
+    }
+    snprintf(
+        entries[count].name, INVADERS_PACK_NAME_SIZE, "%s", SOUND_FILES[i]);
+    entries[count].type = INVADERS_PACK_PCM;
+    entries[count].param = INVADERS_PACK_FREQUENCY;
+    count += 1;
+  }
+
+  result = invaders_pack_save(
+      output, entries, (const uint8_t* const*) data, count);
+  if (result == 0) {
+    printf("packed %d entries in %s\n", count, output);
+  }
+
+done:
+  for (int i = 0; i < count; i++) {
+    free(data[i]);
+  }
+  return result;
+}
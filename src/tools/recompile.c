@@ -0,0 +1,493 @@
+// translates the code of the rom to C ahead of time, for the recompiled
+// engine (see cpu.c). The control flow is followed from the reset and
+// interrupt entry points (0x0000, RST 1 and RST 2), through the jumps,
+// calls and RSTs, and the code found is split in basic blocks, each one
+// written as a C function doing what the instructions run one by one would,
+// cycle counts included. Everything else (code only reached through PCHL,
+// EI, DI, HLT) is left to the threaded engine.
+//
+// usage: invaders_recompile ROMS_DIR OUTPUT.c
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu_ops.h"
+#include "crc32.h"
+
+#define MAX_BLOCK 32 // instructions per block
+
+static const char* ROM_FILES[] = {
+    "invaders.h", "invaders.g", "invaders.f", "invaders.e"};
+
+// what is known of each address of the rom
+enum {
+  CODE = 1 << 0, // an instruction starts there
+  BYTES = 1 << 1, // part of an instruction
+  LEADER = 1 << 2, // a block starts there
+};
+
+static uint8_t rom[ROM_SIZE];
+static uint8_t flags[ROM_SIZE];
+
+static const char* REGS[8] = {"b", "c", "d", "e", "h", "l", "m", "a"};
+static const char* PAIRS[4] = {"bc", "de", "hl", "sp"};
+static const char* CONDS[8] = {
+    "!c->zf", "c->zf", "!c->cf", "c->cf", "!c->pf", "c->pf", "!c->sf", "c->sf"};
+
+static int load_roms(const char* dir) {
+  char path[1024];
+  for (int i = 0; i < 4; i++) {
+    snprintf(path, sizeof path, "%s/%s", dir, ROM_FILES[i]);
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+      fprintf(stderr, "error: can't open rom file %s\n", path);
+      return 1;
+    }
+    // one extra byte so that oversized files are detected
+    uint8_t buffer[0x800 + 1];
+    const size_t size = fread(buffer, 1, sizeof buffer, f);
+    fclose(f);
+    if (size > 0x800) {
+      fprintf(stderr, "error: rom file '%s' could not be loaded\n", path);
+      return 1;
+    }
+    memcpy(&rom[i * 0x800], buffer, size);
+  }
+  return 0;
+}
+
+// instructions run by i8080_step only: EI and DI change the interrupts,
+// HLT waits for one
+static bool is_unsupported(uint8_t op) {
+  return op == 0xFB || op == 0xF3 || op == 0x76;
+}
+
+static bool is_jmp(uint8_t op) {
+  return op == 0xC3 || op == 0xCB;
+}
+
+static bool is_call(uint8_t op) {
+  return op == 0xCD || op == 0xDD || op == 0xED || op == 0xFD;
+}
+
+static bool is_ret(uint8_t op) {
+  return op == 0xC9 || op == 0xD9;
+}
+
+// instructions that may change pc: they end a block
+static bool is_branch(uint8_t op) {
+  return is_jmp(op) || is_call(op) || is_ret(op) || op == 0xE9 ||
+         (op & 0xC7) == 0xC0 || (op & 0xC7) == 0xC2 || (op & 0xC7) == 0xC4 ||
+         (op & 0xC7) == 0xC7;
+}
+
+static uint16_t operand(uint16_t addr) {
+  return OPCODE_SIZES[rom[addr]] == 2
+             ? rom[addr + 1]
+             : rom[addr + 1] | rom[addr + 2] << 8;
+}
+
+static uint16_t pending[ROM_SIZE];
+static int pending_count = 0;
+
+static void add_entry(uint16_t addr) {
+  if (addr < ROM_SIZE && !(flags[addr] & LEADER)) {
+    flags[addr] |= LEADER;
+    pending[pending_count++] = addr;
+  }
+}
+
+// follows the code from `addr` until an unconditional branch, or code
+// already found
+static void follow(uint16_t addr) {
+  while (addr < ROM_SIZE && !(flags[addr] & CODE)) {
+    const uint8_t op = rom[addr];
+    const uint16_t next = addr + OPCODE_SIZES[op];
+    if (next > ROM_SIZE) {
+      return; // the operands are not in rom
+    }
+    if (is_unsupported(op)) {
+      // the code resumes after it, once run by i8080_step
+      add_entry(next);
+      return;
+    }
+    flags[addr] |= CODE;
+    for (uint16_t i = addr; i < next; i++) {
+      flags[i] |= BYTES;
+    }
+
+    if (is_branch(op)) {
+      if (op != 0xE9 && !is_ret(op) && (op & 0xC7) != 0xC0) {
+        add_entry((op & 0xC7) == 0xC7 ? op & 0x38 : operand(addr));
+      }
+      if (is_jmp(op) || is_ret(op) || op == 0xE9) {
+        return;
+      }
+      // returned to, or not taken
+      add_entry(next);
+    }
+    addr = next;
+  }
+}
+
+static void find_code(void) {
+  add_entry(0x0000);
+  add_entry(0x0008);
+  add_entry(0x0010);
+  while (pending_count > 0) {
+    follow(pending[--pending_count]);
+  }
+}
+
+static const char* src(uint8_t r) {
+  static char buffer[32];
+  if (r == 6) {
+    return "rb(si, get_hl(c))";
+  }
+  snprintf(buffer, sizeof buffer, "c->%s", REGS[r]);
+  return buffer;
+}
+
+// writes the C code of an instruction that does not branch
+static void write_insn(FILE* out, uint16_t addr) {
+  const uint8_t op = rom[addr];
+  const uint16_t imm = OPCODE_SIZES[op] > 1 ? operand(addr) : 0;
+  const uint8_t dst = (op >> 3) & 7;
+  const uint8_t pair = (op >> 4) & 3;
+  static const char* ALU[8] = {"add(c, %s, 0)", "add(c, %s, c->cf)",
+      "sub(c, %s, 0)", "sub(c, %s, c->cf)", "ana(c, %s)", "xra(c, %s)",
+      "ora(c, %s)", "cmp(c, %s)"};
+  char value[32];
+
+  if (op >= 0x40 && op < 0x80) {
+    if (dst == 6) {
+      fprintf(out, "  wb(si, get_hl(c), %s);\n", src(op & 7));
+    } else {
+      fprintf(out, "  c->%s = %s;\n", REGS[dst], src(op & 7));
+    }
+    return;
+  }
+  if (op >= 0x80 && op < 0xC0) {
+    fprintf(out, "  ");
+    fprintf(out, ALU[dst], src(op & 7));
+    fprintf(out, ";\n");
+    return;
+  }
+  if ((op & 0xC7) == 0xC6) {
+    snprintf(value, sizeof value, "0x%02X", imm);
+    fprintf(out, "  ");
+    fprintf(out, ALU[dst], value);
+    fprintf(out, ";\n");
+    return;
+  }
+
+  switch (op & 0xCF) {
+  case 0x01: // lxi
+    if (pair == 3) {
+      fprintf(out, "  c->sp = 0x%04X;\n", imm);
+    } else {
+      fprintf(out, "  set_%s(c, 0x%04X);\n", PAIRS[pair], imm);
+    }
+    return;
+  case 0x03: // inx
+  case 0x0B: // dcx
+    if (pair == 3) {
+      fprintf(out, "  c->sp %s= 1;\n", op & 0x08 ? "-" : "+");
+    } else {
+      fprintf(out, "  set_%s(c, get_%s(c) %s 1);\n", PAIRS[pair],
+          PAIRS[pair], op & 0x08 ? "-" : "+");
+    }
+    return;
+  case 0x09: // dad
+    if (pair == 3) {
+      fprintf(out, "  dad(c, c->sp);\n");
+    } else {
+      fprintf(out, "  dad(c, get_%s(c));\n", PAIRS[pair]);
+    }
+    return;
+  case 0xC1: // pop
+    if (pair == 3) {
+      fprintf(out, "  {\n"
+                   "    const uint16_t af = pop(si);\n"
+                   "    c->a = af >> 8;\n"
+                   "    set_flags(c, af & 0xFF);\n"
+                   "  }\n");
+    } else {
+      fprintf(out, "  set_%s(c, pop(si));\n", PAIRS[pair]);
+    }
+    return;
+  case 0xC5: // push
+    if (pair == 3) {
+      fprintf(out, "  push(si, c->a << 8 | get_flags(c));\n");
+    } else {
+      fprintf(out, "  push(si, get_%s(c));\n", PAIRS[pair]);
+    }
+    return;
+  }
+
+  switch (op & 0xC7) {
+  case 0x00: // nop
+    return;
+  case 0x04: // inr
+  case 0x05: // dcr
+    if (dst == 6) {
+      fprintf(out, "  wb(si, get_hl(c), %s(c, rb(si, get_hl(c))));\n",
+          op & 1 ? "dcr" : "inr");
+    } else {
+      fprintf(out, "  c->%s = %s(c, c->%s);\n", REGS[dst],
+          op & 1 ? "dcr" : "inr", REGS[dst]);
+    }
+    return;
+  case 0x06: // mvi
+    if (dst == 6) {
+      fprintf(out, "  wb(si, get_hl(c), 0x%02X);\n", imm);
+    } else {
+      fprintf(out, "  c->%s = 0x%02X;\n", REGS[dst], imm);
+    }
+    return;
+  }
+
+  switch (op) {
+  case 0x02:
+    fprintf(out, "  wb(si, get_bc(c), c->a);\n");
+    break;
+  case 0x12:
+    fprintf(out, "  wb(si, get_de(c), c->a);\n");
+    break;
+  case 0x0A:
+    fprintf(out, "  c->a = rb(si, get_bc(c));\n");
+    break;
+  case 0x1A:
+    fprintf(out, "  c->a = rb(si, get_de(c));\n");
+    break;
+  case 0x22:
+    fprintf(out, "  ww(si, 0x%04X, get_hl(c));\n", imm);
+    break;
+  case 0x2A:
+    fprintf(out, "  set_hl(c, rw(si, 0x%04X));\n", imm);
+    break;
+  case 0x32:
+    fprintf(out, "  wb(si, 0x%04X, c->a);\n", imm);
+    break;
+  case 0x3A:
+    fprintf(out, "  c->a = rb(si, 0x%04X);\n", imm);
+    break;
+  case 0x07:
+    fprintf(out, "  c->cf = c->a >> 7;\n"
+                 "  c->a = (c->a << 1) | c->cf;\n");
+    break;
+  case 0x0F:
+    fprintf(out, "  c->cf = c->a & 1;\n"
+                 "  c->a = (c->a >> 1) | (c->cf << 7);\n");
+    break;
+  case 0x17:
+    fprintf(out, "  {\n"
+                 "    const bool cy = c->cf;\n"
+                 "    c->cf = c->a >> 7;\n"
+                 "    c->a = (c->a << 1) | cy;\n"
+                 "  }\n");
+    break;
+  case 0x1F:
+    fprintf(out, "  {\n"
+                 "    const bool cy = c->cf;\n"
+                 "    c->cf = c->a & 1;\n"
+                 "    c->a = (c->a >> 1) | (cy << 7);\n"
+                 "  }\n");
+    break;
+  case 0x27:
+    fprintf(out, "  daa(c);\n");
+    break;
+  case 0x2F:
+    fprintf(out, "  c->a = ~c->a;\n");
+    break;
+  case 0x37:
+    fprintf(out, "  c->cf = 1;\n");
+    break;
+  case 0x3F:
+    fprintf(out, "  c->cf = !c->cf;\n");
+    break;
+  case 0xD3:
+    fprintf(out, "  c->port_out(c->userdata, 0x%02X, c->a);\n", imm);
+    break;
+  case 0xDB:
+    fprintf(out, "  c->a = c->port_in(c->userdata, 0x%02X);\n", imm);
+    break;
+  case 0xE3:
+    fprintf(out, "  {\n"
+                 "    const uint16_t val = rw(si, c->sp);\n"
+                 "    ww(si, c->sp, get_hl(c));\n"
+                 "    set_hl(c, val);\n"
+                 "  }\n");
+    break;
+  case 0xEB:
+    fprintf(out, "  {\n"
+                 "    const uint16_t de = get_de(c);\n"
+                 "    set_de(c, get_hl(c));\n"
+                 "    set_hl(c, de);\n"
+                 "  }\n");
+    break;
+  case 0xF9:
+    fprintf(out, "  c->sp = get_hl(c);\n");
+    break;
+  }
+}
+
+// writes the C code of a branch, its cycles already counted
+static void write_branch(FILE* out, uint16_t addr) {
+  const uint8_t op = rom[addr];
+  const uint16_t next = addr + OPCODE_SIZES[op];
+  const char* const cond = CONDS[(op >> 3) & 7];
+
+  if (is_jmp(op)) {
+    fprintf(out, "  c->pc = 0x%04X;\n", operand(addr));
+  } else if (is_call(op)) {
+    fprintf(out, "  push(si, 0x%04X);\n  c->pc = 0x%04X;\n", next,
+        operand(addr));
+  } else if (is_ret(op)) {
+    fprintf(out, "  c->pc = pop(si);\n");
+  } else if (op == 0xE9) {
+    fprintf(out, "  c->pc = get_hl(c);\n");
+  } else if ((op & 0xC7) == 0xC7) {
+    fprintf(out, "  push(si, 0x%04X);\n  c->pc = 0x%04X;\n", next, op & 0x38);
+  } else if ((op & 0xC7) == 0xC2) {
+    fprintf(out, "  c->pc = %s ? 0x%04X : 0x%04X;\n", cond, operand(addr),
+        next);
+  } else if ((op & 0xC7) == 0xC4) {
+    fprintf(out,
+        "  if (%s) {\n"
+        "    push(si, 0x%04X);\n"
+        "    c->pc = 0x%04X;\n"
+        "    c->cyc += 6;\n"
+        "  } else {\n"
+        "    c->pc = 0x%04X;\n"
+        "  }\n",
+        cond, next, operand(addr), next);
+  } else {
+    fprintf(out,
+        "  if (%s) {\n"
+        "    c->pc = pop(si);\n"
+        "    c->cyc += 6;\n"
+        "  } else {\n"
+        "    c->pc = 0x%04X;\n"
+        "  }\n",
+        cond, next);
+  }
+}
+
+// writes the block starting at `start`, returns the cycles before its last
+// instruction
+static int write_block(FILE* out, uint16_t start) {
+  uint16_t addr = start;
+  uint16_t last = start;
+  int count = 0;
+  int cycles = 0; // not counted yet
+  int lead = 0;
+
+  fprintf(out, "static void block_%04X(invaders* const si) {\n", start);
+  fprintf(out, "  i8080* const c = &si->cpu;\n");
+  while (true) {
+    const uint8_t op = rom[addr];
+    const uint16_t next = addr + OPCODE_SIZES[op];
+    lead += count > 0 ? OPCODE_CYCLES[rom[last]] : 0;
+    last = addr;
+    count += 1;
+
+    cycles += OPCODE_CYCLES[op];
+    if (op == 0xD3 || op == 0xDB) {
+      // the i/o sees the cycles and pc as they are after the instruction
+      fprintf(out, "  c->cyc += %d;\n  c->pc = 0x%04X;\n", cycles, next);
+      cycles = 0;
+    }
+    if (is_branch(op)) {
+      fprintf(out, "  c->cyc += %d;\n", cycles);
+      write_branch(out, addr);
+      break;
+    }
+    write_insn(out, addr);
+    if (next >= ROM_SIZE || !(flags[next] & CODE) ||
+        (flags[next] & LEADER) || count == MAX_BLOCK) {
+      if (cycles > 0) {
+        fprintf(out, "  c->cyc += %d;\n", cycles);
+      }
+      fprintf(out, "  c->pc = 0x%04X;\n", next);
+      if (next < ROM_SIZE && (flags[next] & CODE)) {
+        // continued by another block
+        flags[next] |= LEADER;
+      }
+      break;
+    }
+    addr = next;
+  }
+  fprintf(out, "}\n\n");
+  return lead;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s ROMS_DIR OUTPUT.c\n", argv[0]);
+    return 1;
+  }
+  if (load_roms(argv[1]) != 0) {
+    return 1;
+  }
+  find_code();
+
+  FILE* out = fopen(argv[2], "w");
+  if (out == NULL) {
+    fprintf(stderr, "error: can't open %s\n", argv[2]);
+    return 1;
+  }
+  fprintf(out, "// generated by invaders_recompile, do not edit\n"
+               "#include \"cpu.h\"\n"
+               "#include \"cpu_ops.h\"\n\n");
+
+  // the blocks are written by address: the ones continuing another block
+  // are found before being reached
+  static uint16_t leads[ROM_SIZE];
+  int block_count = 0;
+  for (int addr = 0; addr < ROM_SIZE; addr++) {
+    if ((flags[addr] & LEADER) && (flags[addr] & CODE)) {
+      leads[addr] = write_block(out, addr);
+      block_count += 1;
+    }
+  }
+
+  fprintf(out,
+      "const invaders_block invaders_recompiled_blocks[ROM_SIZE] = {\n");
+  for (int addr = 0; addr < ROM_SIZE; addr++) {
+    if ((flags[addr] & LEADER) && (flags[addr] & CODE)) {
+      fprintf(out, "    [0x%04X] = {block_%04X, %d},\n", addr, addr,
+          leads[addr]);
+    }
+  }
+  if (block_count == 0) {
+    fprintf(out, "    {NULL, 0},\n"); // no empty initializer in C
+  }
+  fprintf(out, "};\n\n");
+
+  // the bytes translated, checked against the rom the machines run
+  uint32_t crc = 0;
+  int code_size = 0;
+  fprintf(out, "const uint8_t invaders_recompiled_code[ROM_SIZE / 8] = {");
+  for (int i = 0; i < ROM_SIZE / 8; i++) {
+    uint8_t mask = 0;
+    for (int bit = 0; bit < 8; bit++) {
+      const int addr = i * 8 + bit;
+      if (flags[addr] & BYTES) {
+        mask |= 1 << bit;
+        crc = invaders_crc32(crc, &rom[addr], 1);
+        code_size += 1;
+      }
+    }
+    fprintf(out, "%s0x%02X,", i % 12 == 0 ? "\n    " : " ", mask);
+  }
+  fprintf(out, "\n};\n\n");
+  fprintf(out, "const uint32_t invaders_recompiled_crc = 0x%08X;\n",
+      (unsigned) crc);
+
+  if (fclose(out) != 0) {
+    fprintf(stderr, "error: can't write %s\n", argv[2]);
+    return 1;
+  }
+  printf("%d blocks, %d bytes of code translated\n", block_count, code_size);
+  return 0;
+}
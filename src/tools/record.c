@@ -0,0 +1,175 @@
+// records a headless run of the emulator, from a cold boot or replaying an
+// input movie, as a video and a side track of the sounds (see capture.h).
+// Reports the speed of the run and the time spent capturing the frames in
+// the emulation thread.
+//
+// usage: invaders_record [--frames N] [--movie FILE] [--roms DIR]
+//                        [--format y4m|raw|png] [--changed] [--slots N]
+//                        [--speed X] OUTPUT
+//
+// --changed only captures the frames where the screen has changed (the
+// video keeps the timing of the game), --speed runs at X times the speed of
+// the game instead of as fast as possible.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "capture.h"
+#include "invaders.h"
+#include "movie.h"
+
+typedef struct record_state record_state;
+struct record_state {
+  invaders_capture* capture;
+  bool changed; // the screen has changed since the last frame captured
+};
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_until(double deadline) {
+  const double delay = deadline - now();
+  if (delay > 0) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) delay;
+    ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void update_screen(invaders* const si) {
+  ((record_state*) si->userdata)->changed = true;
+}
+
+static void play_sound(invaders* const si, int sound) {
+  invaders_capture_sound(((record_state*) si->userdata)->capture, si, sound);
+}
+
+static int load_roms(invaders_rom* const rom, const char* dir) {
+  static const char* FILES[] = {
+      "invaders.h", "invaders.g", "invaders.f", "invaders.e"};
+  char path[1024];
+
+  invaders_rom_init(rom);
+  for (int i = 0; i < 4; i++) {
+    snprintf(path, sizeof path, "%s/%s", dir, FILES[i]);
+    if (invaders_rom_load(rom, path, i * 0x800) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  unsigned long frames = 3600;
+  const char* movie_path = NULL;
+  const char* roms_dir = "roms";
+  int format = INVADERS_CAPTURE_Y4M;
+  bool changed_only = false;
+  int slots = 256;
+  double speed = 0;
+  const char* output = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--movie") == 0 && i + 1 < argc) {
+      movie_path = argv[++i];
+    } else if (strcmp(argv[i], "--roms") == 0 && i + 1 < argc) {
+      roms_dir = argv[++i];
+    } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc &&
+               (strcmp(argv[i + 1], "y4m") == 0 ||
+                   strcmp(argv[i + 1], "raw") == 0 ||
+                   strcmp(argv[i + 1], "png") == 0)) {
+      i += 1;
+      format = strcmp(argv[i], "y4m") == 0   ? INVADERS_CAPTURE_Y4M
+               : strcmp(argv[i], "raw") == 0 ? INVADERS_CAPTURE_RAW
+                                             : INVADERS_CAPTURE_PNG;
+    } else if (strcmp(argv[i], "--changed") == 0) {
+      changed_only = true;
+    } else if (strcmp(argv[i], "--slots") == 0 && i + 1 < argc) {
+      slots = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+      speed = strtod(argv[++i], NULL);
+    } else if (output == NULL && argv[i][0] != '-') {
+      output = argv[i];
+    } else {
+      output = NULL;
+      break;
+    }
+  }
+  if (output == NULL) {
+    fprintf(stderr,
+        "usage: %s [--frames N] [--movie FILE] [--roms DIR] "
+        "[--format y4m|raw|png] [--changed] [--slots N] [--speed X] "
+        "OUTPUT\n",
+        argv[0]);
+    return 1;
+  }
+
+  static invaders_rom rom;
+  static invaders si;
+  static invaders_movie movie;
+  if (load_roms(&rom, roms_dir) != 0) {
+    return 1;
+  }
+
+  record_state state = {.capture = NULL, .changed = false};
+  invaders_init(&si, &rom);
+  si.userdata = &state;
+  si.update_screen = update_screen;
+  si.play_sound = play_sound;
+  if (movie_path != NULL) {
+    if (invaders_movie_load(&movie, movie_path) != 0 ||
+        invaders_movie_play_start(&movie, &si) != 0) {
+      return 1;
+    }
+    frames = movie.frame_count;
+  }
+
+  state.capture = invaders_capture_open(output, format, slots);
+  if (state.capture == NULL) {
+    return 1;
+  }
+
+  int result = 0;
+  double capture_time = 0;
+  const double start = now();
+  for (unsigned long i = 0; i < frames; i++) {
+    invaders_run_frames(&si, 1);
+    if (movie_path != NULL && invaders_movie_play_frame(&movie, &si) != 0) {
+      result = 1;
+      break;
+    }
+
+    if (state.changed || !changed_only) {
+      const double t = now();
+      invaders_capture_frame(state.capture, &si);
+      capture_time += now() - t;
+      state.changed = false;
+    }
+
+    if (speed > 0) {
+      sleep_until(start + (i + 1) / (FPS * speed));
+    }
+  }
+  const double total = now() - start;
+
+  printf("%lu frames in %.3f s (x%.1f)\n", si.frame_count, total,
+      si.frame_count / FPS / total);
+  printf("capture: %.3f s in the emulation thread (%.2f%%)\n", capture_time,
+      100 * capture_time / total);
+
+  if (invaders_capture_close(state.capture, si.frame_count) != 0) {
+    result = 1;
+  }
+  if (movie_path != NULL) {
+    invaders_movie_free(&movie);
+  }
+  return result;
+}
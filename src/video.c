@@ -0,0 +1,114 @@
+#include <SDL.h>
+
+#include "video.h"
+
+// flag of `middle`: the frame has been published and not taken yet
+#define FRESH 4
+// ranges of the last published frames, to know which columns changed since
+// the frame the render thread has
+#define HISTORY_SIZE 16 // power of two
+
+typedef struct dirty_range dirty_range;
+struct dirty_range {
+  int x0, x1;
+};
+
+static invaders_frame buffers[3];
+static int format;
+static uint16_t palette[INVADERS_COLOUR_COUNT];
+
+// buffer in between the threads (| FRESH), exchanged by both
+static SDL_atomic_t middle;
+// number of the last frame taken by the render thread
+static SDL_atomic_t taken;
+
+// state of the emulation thread
+static int back;
+static uint32_t published;
+static dirty_range history[HISTORY_SIZE];
+
+// state of the render thread
+static int front;
+
+void invaders_video_init(
+    int frame_format, const uint16_t colours[INVADERS_COLOUR_COUNT]) {
+  format = frame_format;
+  SDL_memcpy(palette, colours, sizeof palette);
+  back = 0;
+  front = 1;
+  published = 0;
+  SDL_AtomicSet(&middle, 2);
+  SDL_AtomicSet(&taken, 0);
+}
+
+// union of the columns changed by the frames published after frame `number`
+static dirty_range changes_since(uint32_t number) {
+  const uint32_t count = published - number;
+  dirty_range range = {0, SCREEN_WIDTH};
+  if (count < HISTORY_SIZE) {
+    range.x0 = SCREEN_WIDTH;
+    range.x1 = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      const dirty_range* const r = &history[(published - i) % HISTORY_SIZE];
+      if (r->x0 < r->x1) {
+        range.x0 = r->x0 < range.x0 ? r->x0 : range.x0;
+        range.x1 = r->x1 > range.x1 ? r->x1 : range.x1;
+      }
+    }
+  }
+  return range;
+}
+
+void invaders_video_publish(invaders* const si, uint32_t tag) {
+  published += 1;
+  history[published % HISTORY_SIZE].x0 = si->dirty_x0;
+  history[published % HISTORY_SIZE].x1 = si->dirty_x1;
+
+  // only the columns changed since the frame that was in the buffer are
+  // drawn, either expanded from the video ram or copied from the machine
+  invaders_frame* const frame = &buffers[back];
+  const dirty_range stale = changes_since(frame->number);
+  if (format == INVADERS_VIDEO_PACKED16) {
+    invaders_render_screen16(
+        si, frame->pixels.packed16, stale.x0, stale.x1, palette);
+  } else if (format == INVADERS_VIDEO_PACKED8) {
+    uint8_t colours[INVADERS_COLOUR_COUNT];
+    for (int i = 0; i < INVADERS_COLOUR_COUNT; i++) {
+      colours[i] = palette[i];
+    }
+    invaders_render_screen8(
+        si, frame->pixels.packed8, stale.x0, stale.x1, colours);
+  } else {
+#ifdef INVADERS_COMPACT_SCREEN
+    invaders_render_screen(si, frame->pixels.rgba32, stale.x0, stale.x1);
+#else
+    for (int row = 0; row < SCREEN_HEIGHT && stale.x0 < stale.x1; row++) {
+      SDL_memcpy(&frame->pixels.rgba32[row][stale.x0],
+          &si->screen_buffer[row][stale.x0],
+          (stale.x1 - stale.x0) * sizeof frame->pixels.rgba32[row][0]);
+    }
+#endif
+  }
+  frame->number = published;
+  frame->tag = tag;
+
+  // the columns changed since the frame the render thread has: if it takes
+  // a newer one meanwhile, the range is only larger than needed
+  const dirty_range changed = changes_since(SDL_AtomicGet(&taken));
+  frame->x0 = changed.x0;
+  frame->x1 = changed.x1;
+
+  // publishes the frame (SDL_AtomicSet is a full memory barrier), and draws
+  // the next one in the buffer that was in between, skipped if it was fresh
+  back = SDL_AtomicSet(&middle, back | FRESH) & ~FRESH;
+}
+
+const invaders_frame* invaders_video_take(void) {
+  if (!(SDL_AtomicGet(&middle) & FRESH)) {
+    return NULL;
+  }
+
+  front = SDL_AtomicSet(&middle, front) & ~FRESH;
+  SDL_AtomicSet(&taken, (int) buffers[front].number);
+  return &buffers[front];
+}
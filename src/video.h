@@ -0,0 +1,42 @@
+#ifndef INVADERS_VIDEO_H
+#define INVADERS_VIDEO_H
+
+#include "invaders.h"
+
+// formats of the frames, by size of pixel
+enum {
+  INVADERS_VIDEO_RGBA32, // 4 bytes per pixel, as the screen of the machine
+  INVADERS_VIDEO_PACKED16, // 2 bytes per pixel (eg. RGB565), with a palette
+  INVADERS_VIDEO_PACKED8, // 1 byte per pixel (eg. RGB332), with a palette
+};
+
+// Frames handed from the emulation thread to the render thread through a
+// triple buffer: the emulation always has a buffer to draw into and the
+// render thread always has the last complete frame, neither ever waits for
+// the other. Frames published faster than they are presented are skipped.
+typedef struct invaders_frame invaders_frame;
+struct invaders_frame {
+  // in the format given to invaders_video_init: the packed formats are
+  // drawn straight from the video ram
+  union {
+    uint8_t rgba32[SCREEN_HEIGHT][SCREEN_WIDTH][4];
+    uint16_t packed16[SCREEN_HEIGHT][SCREEN_WIDTH];
+    uint8_t packed8[SCREEN_HEIGHT][SCREEN_WIDTH];
+  } pixels;
+  uint32_t number; // frames are numbered from 1, in order of publication
+  // columns [x0, x1[ that differ from the last frame taken before this one
+  int x0, x1;
+  uint32_t tag; // given by the emulation thread (eg. the inputs of the frame)
+};
+
+// `palette` gives the pixels of the colours (INVADERS_COLOUR_*) of the
+// packed formats, black being 0
+void invaders_video_init(
+    int format, const uint16_t palette[INVADERS_COLOUR_COUNT]);
+// called by the emulation thread when the screen has been updated
+void invaders_video_publish(invaders* const si, uint32_t tag);
+// called by the render thread: returns the newest frame published since the
+// last call, or NULL. The frame is valid until the next call.
+const invaders_frame* invaders_video_take(void);
+
+#endif // INVADERS_VIDEO_H
@@ -0,0 +1,143 @@
+// loads savestates of version 1 (before the cycle scheduler) from fixed
+// bytes, and checks the machine they give: the frame count and the cycle
+// count derived from the next interrupt, the registers and the ram, then
+// that the machine still runs to the next vblank.
+//
+// usage: invaders_test_savestate
+#include <stdio.h>
+
+#include "invaders.h"
+
+// size of a version 1 state: header, cpu, half frame cycles, next
+// interrupt, shift registers and out ports, frame count, ram
+#define STATE_V1_SIZE (5 + 14 + 4 + 1 + 5 + 4 + RAM_SIZE)
+
+typedef struct fixture fixture;
+struct fixture {
+  const char* name;
+  uint8_t header[STATE_V1_SIZE - RAM_SIZE];
+  uint8_t ram_seed; // ram byte i is (i * 7 + ram_seed) & 0xFF
+  unsigned long frame_count;
+  uint64_t cycles;
+};
+
+static const fixture FIXTURES[] = {
+    {
+        // saved right after invaders_init: its half frame is longer than
+        // the start of frame 0, the state starts at cycle 0
+        .name = "boot",
+        .header = {'I', 'N', 'V', 'S', 1,
+            0x00, 0x00, 0x00, 0x00, // pc, sp
+            0, 0, 0, 0, 0, 0, 0, 0, // a, b, c, d, e, h, l, flags
+            0x00, 0x00, // interrupt vector and delay
+            0x00, 0x00, 0x00, 0x00, // half frame cycles: 0
+            0xcf, // next interrupt: mid-screen
+            0, 0, 0, 0, 0, // shift msb, lsb & offset, out ports 3 & 5
+            0x00, 0x00, 0x00, 0x00}, // frame count: 0
+        .ram_seed = 0,
+        .frame_count = 0,
+        .cycles = 0,
+    },
+    {
+        // 6768 cycles before the vblank of frame 1000
+        .name = "vblank",
+        .header = {'I', 'N', 'V', 'S', 1,
+            0x00, 0x01, 0x00, 0x24, // pc: 0x0100, sp: 0x2400
+            0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xcc,
+            0xd7, 0x01,
+            0x10, 0x27, 0x00, 0x00, // half frame cycles: 10000
+            0xd7, // next interrupt: vblank
+            0x12, 0x34, 0x05, 0x01, 0x02,
+            0xe8, 0x03, 0x00, 0x00}, // frame count: 1000
+        .ram_seed = 3,
+        .frame_count = 1000,
+        .cycles = 1000ull * CYCLES_PER_FRAME + 224 * CYCLES_PER_LINE - 6768,
+    },
+    {
+        // 16668 cycles before the mid-screen interrupt of frame 5, so
+        // after the vblank of frame 4
+        .name = "mid-screen",
+        .header = {'I', 'N', 'V', 'S', 1,
+            0x34, 0x12, 0xf0, 0x23, // pc: 0x1234, sp: 0x23f0
+            0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x04,
+            0x00, 0x00,
+            0x64, 0x00, 0x00, 0x00, // half frame cycles: 100
+            0xcf, // next interrupt: mid-screen
+            0xff, 0x00, 0x07, 0x10, 0x20,
+            0x05, 0x00, 0x00, 0x00}, // frame count: 5
+        .ram_seed = 9,
+        .frame_count = 5,
+        .cycles = 5ull * CYCLES_PER_FRAME + 96 * CYCLES_PER_LINE - 16668,
+    },
+};
+
+static int check(bool ok, const fixture* const f, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "error: %s: %s\n", f->name, what);
+  }
+  return !ok;
+}
+
+static int test_fixture(invaders_rom* const rom, const fixture* const f) {
+  static invaders si;
+  static uint8_t state[STATE_V1_SIZE];
+  memcpy(state, f->header, sizeof f->header);
+  uint8_t* const ram = &state[sizeof f->header];
+  for (int i = 0; i < RAM_SIZE; i++) {
+    ram[i] = (i * 7 + f->ram_seed) & 0xFF;
+  }
+
+  invaders_init(&si, rom);
+  si.skip_render = true;
+  if (invaders_load_state(&si, state, sizeof state) != 0) {
+    return check(false, f, "the state is rejected");
+  }
+
+  const uint8_t* const h = f->header;
+  const i8080* const c = &si.cpu;
+  int failures = 0;
+  failures += check(si.frame_count == f->frame_count, f, "frame count");
+  failures += check(si.cycles == f->cycles, f, "cycle count");
+  failures += check(c->pc == (h[5] | h[6] << 8) &&
+                        c->sp == (h[7] | h[8] << 8) && c->a == h[9] &&
+                        c->b == h[10] && c->c == h[11] && c->d == h[12] &&
+                        c->e == h[13] && c->h == h[14] && c->l == h[15] &&
+                        c->interrupt_vector == h[17] &&
+                        c->interrupt_delay == h[18],
+      f, "registers");
+  failures += check(si.shift_msb == h[24] && si.shift_lsb == h[25] &&
+                        si.shift_offset == h[26] &&
+                        si.last_out_port3 == h[27] &&
+                        si.last_out_port5 == h[28],
+      f, "shift registers and out ports");
+  failures += check(memcmp(si.ram, ram, RAM_SIZE) == 0, f, "ram");
+
+  // the cpu runs the nops of the rom until the vblank
+  invaders_run_frames(&si, 1);
+  const uint64_t vblank =
+      (uint64_t) f->frame_count * CYCLES_PER_FRAME + 224 * CYCLES_PER_LINE;
+  failures += check(si.frame_count == f->frame_count + 1 &&
+                        si.cycles >= vblank && si.cycles < vblank + 18,
+      f, "next vblank");
+  return failures;
+}
+
+int main(void) {
+  // a rom of nops, looping back to 0 before the ram
+  static invaders_rom rom;
+  static const uint8_t JMP_0[] = {0xc3, 0x00, 0x00};
+  invaders_rom_init(&rom);
+  if (invaders_rom_load_mem(&rom, JMP_0, sizeof JMP_0, ROM_SIZE - 3) != 0) {
+    return 1;
+  }
+
+  int failures = 0;
+  for (size_t i = 0; i < sizeof FIXTURES / sizeof FIXTURES[0]; i++) {
+    failures += test_fixture(&rom, &FIXTURES[i]);
+  }
+  if (failures == 0) {
+    printf("%zu savestates of version 1 loaded\n",
+        sizeof FIXTURES / sizeof FIXTURES[0]);
+  }
+  return failures != 0;
+}